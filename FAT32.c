@@ -5,6 +5,21 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#define FAT32_HAVE_URING
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT32_SCAN_X86
+#endif
 
 #define PATH_SEP '/'
 
@@ -22,950 +37,6494 @@ u32 BPBGetSectorCount(const BPB* input)
 
 //------------------------------------------------------------------------------
 
-u32 clusterPtrGetIndex(ClusterPtr ptr)
+/*
+ * Locking in concurrent mode. Every public call holds volumeLock shared,
+ * flush, fsck and cache resizing hold it exclusive. Shared holds nest.
+ * Lookups and iteration hold the lock of their directory shared and read
+ * directory clusters with positional reads into a per-thread buffer, so
+ * they never touch the cluster cache. Directory writers hold the directory
+ * lock exclusive plus the cache and name index locks, and write their
+ * clusters through before letting go. FAT entries are guarded by region
+ * locks and the free map by allocLock. Locks are taken in this order:
+ * volume, directory, cache, name index, dentry, alloc, FAT region.
+ */
+
+// Context whose directory write section the thread is in
+static __thread const Fat32Context* dirWriter;
+
+static void lockMutex(const Fat32Context* cont, pthread_mutex_t* mutex)
 {
-    return ptr & 0x0fffffff;
+    if (cont->isConcurrent)
+        pthread_mutex_lock(mutex);
 }
 
-bool clusterPtrIsBadCluster(ClusterPtr ptr)
+static void unlockMutex(const Fat32Context* cont, pthread_mutex_t* mutex)
 {
-    return clusterPtrGetIndex(ptr) == 0x0ffffff7;
+    if (cont->isConcurrent)
+        pthread_mutex_unlock(mutex);
 }
 
-bool clusterPtrIsLastCluster(ClusterPtr ptr)
+static void lockShared(const Fat32Context* cont, pthread_rwlock_t* lock)
 {
-    return clusterPtrGetIndex(ptr) >= 0x0ffffff8;
+    if (cont->isConcurrent)
+        pthread_rwlock_rdlock(lock);
 }
 
-bool clusterPtrIsNull(ClusterPtr ptr)
+static void lockExclusive(const Fat32Context* cont, pthread_rwlock_t* lock)
 {
-    return clusterPtrGetIndex(ptr) == 0;
+    if (cont->isConcurrent)
+        pthread_rwlock_wrlock(lock);
 }
 
-u32 fatGetNextClusterPtr(const Fat32Context* cont, ClusterPtr current)
-{
-    const u32 fatOffset = clusterPtrGetIndex(current) * 4;
-    return *(u32*)&cont->fat[fatOffset];
-}
-u32 findFreeCluster(Fat32Context* cont)
+static void unlockRw(const Fat32Context* cont, pthread_rwlock_t* lock)
 {
-    u64 i, entry, totalClusters;
-    u64 dataSectors = cont->ebpb->sectorsPerFat - cont->firstDataSector;
-
-    u64 countOfClusters  = dataSectors / cont->bpb->sectorsPerClusters;
-
-    for(i=0;i<totalClusters; i++)
-    {
-        entry = fatGetNextClusterPtr(cont,i);
-        if((entry & 0x0fffffff) == 0) break;
-    }
-    return i;
+    if (cont->isConcurrent)
+        pthread_rwlock_unlock(lock);
 }
 
-bool directoryEntryIsVolumeLabel(const DirectoryEntry* entry)
+static pthread_rwlock_t* dirLock(Fat32Context* cont, u32 dirCluster)
 {
-    if (!directoryEntryIsLFE(entry->attributes)
-        && (entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY)) == DIRENTRY_ATTR_VOLUME_ID)
-    {
-        assert(entry->entryFirstClusterNum1 == 0);
-        assert(entry->entryFirstClusterNum2 == 0);
-        return true;
-    }
-    return false;
+    return &cont->dirLocks[((dirCluster * 2654435761u) >> 16) % FAT32_DIR_LOCK_STRIPES];
 }
 
-bool directoryEntryIsLFE(u8 attrs)
+static pthread_mutex_t* fatLock(Fat32Context* cont, u32 cluster)
 {
-    return (attrs & DIRENTRY_MASK_LONG_NAME) == DIRENTRY_ATTR_LONG_NAME;
+    return &cont->fatLocks[(cluster / FAT32_FAT_LOCK_REGION) % FAT32_FAT_LOCK_STRIPES];
 }
 
-bool directoryEntryIsDirectory(const DirectoryEntry* entry)
+// The name index lock is already held exclusive inside a directory write section
+static void nameIndexLockShared(Fat32Context* cont)
 {
-    if (!directoryEntryIsLFE(entry->attributes)
-        && (entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY)) == DIRENTRY_ATTR_DIRECTORY)
-    {
-        assert(entry->fileSize == 0);
-        return true;
-    }
-    return false;
+    if (dirWriter != cont)
+        lockShared(cont, &cont->nameIndexLock);
 }
 
-bool directoryEntryIsFile(const DirectoryEntry* entry)
+static void nameIndexLockExclusive(Fat32Context* cont)
 {
-    return (!directoryEntryIsLFE(entry->attributes)
-            && (entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY))) == 0;
+    if (dirWriter != cont)
+        lockExclusive(cont, &cont->nameIndexLock);
 }
 
-bool directoryEntryIsEmpty(const DirectoryEntry* entry)
+static void nameIndexUnlock(Fat32Context* cont)
 {
-    return clusterPtrIsNull(directoryEntryGetClusterPtr(entry));
+    if (dirWriter != cont)
+        unlockRw(cont, &cont->nameIndexLock);
 }
 
-u32 directoryEntryGetClusterPtr(const DirectoryEntry* entry)
+static void concurrencyInit(Fat32Context* cont, bool isConcurrent)
 {
-    return ((u32)entry->entryFirstClusterNum1 << 16)
-           | (u32)entry->entryFirstClusterNum2;
+    // Generations of different contexts never overlap, so per-thread buffers can't mix them up
+    static u64 generationBase;
+    cont->dirGeneration = __atomic_add_fetch(&generationBase, 1ULL << 32, __ATOMIC_RELAXED);
+    cont->isConcurrent = isConcurrent;
+    if (!isConcurrent)
+        return;
+
+    pthread_rwlock_init(&cont->volumeLock, NULL);
+    for (u32 i = 0; i < FAT32_DIR_LOCK_STRIPES; ++i)
+        pthread_rwlock_init(&cont->dirLocks[i], NULL);
+    for (u32 i = 0; i < FAT32_FAT_LOCK_STRIPES; ++i)
+        pthread_mutex_init(&cont->fatLocks[i], NULL);
+    pthread_mutex_init(&cont->allocLock, NULL);
+    pthread_mutex_init(&cont->cacheLock, NULL);
+    pthread_rwlock_init(&cont->nameIndexLock, NULL);
+    pthread_mutex_init(&cont->dentryLock, NULL);
 }
 
-u32 directoryEntryGetFirstClusterNumber(const DirectoryEntry* input)
+static void concurrencyDestroy(Fat32Context* cont)
 {
-    return clusterPtrGetIndex(directoryEntryGetClusterPtr(input));
+    if (!cont->isConcurrent)
+        return;
+
+    pthread_rwlock_destroy(&cont->volumeLock);
+    for (u32 i = 0; i < FAT32_DIR_LOCK_STRIPES; ++i)
+        pthread_rwlock_destroy(&cont->dirLocks[i]);
+    for (u32 i = 0; i < FAT32_FAT_LOCK_STRIPES; ++i)
+        pthread_mutex_destroy(&cont->fatLocks[i]);
+    pthread_mutex_destroy(&cont->allocLock);
+    pthread_mutex_destroy(&cont->cacheLock);
+    pthread_rwlock_destroy(&cont->nameIndexLock);
+    pthread_mutex_destroy(&cont->dentryLock);
+    cont->isConcurrent = false;
 }
 
-u64 directoryEntryGetDataAddress(const Fat32Context* cont, const DirectoryEntry* entry)
-{
-    return fat32GetFirstSectorOfCluster(cont, directoryEntryGetFirstClusterNumber(entry)) * cont->bpb->sectorSize;
-}
+//------------------------------------------------------------------------------
 
-char* directoryEntryAttrsToString(u8 attrs)
+/*
+ * The free map keeps one bit per cluster (set when the cluster is free)
+ * and a summary level with one bit per 64 bit word of the map (set when
+ * the word has any free cluster), so full regions are skipped 4096
+ * clusters at a time.
+ */
+
+static void freeMapSet(Fat32FreeMap* map, u32 cluster, bool isFree)
 {
-    char* str = malloc(7);
+    const u32 word = cluster / 64;
+    const u64 bit = 1ULL << (cluster % 64);
+    const bool wasFree = (map->bits[word] & bit) != 0;
+    if (wasFree == isFree)
+        return;
 
-    if (directoryEntryIsLFE(attrs))
+    if (isFree)
     {
-        strncpy(str, "__LFE_", 7);
-        return str;
+        map->bits[word] |= bit;
+        map->summary[word / 64] |= 1ULL << (word % 64);
+        __atomic_add_fetch(&map->freeCount, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        map->bits[word] &= ~bit;
+        if (map->bits[word] == 0)
+            map->summary[word / 64] &= ~(1ULL << (word % 64));
+        __atomic_sub_fetch(&map->freeCount, 1, __ATOMIC_RELAXED);
     }
-
-    str[0] = (attrs & DIRENTRY_ATTR_READONLY)  ? 'R' : '-';
-    str[1] = (attrs & DIRENTRY_ATTR_HIDDEN)    ? 'H' : '-';
-    str[2] = (attrs & DIRENTRY_ATTR_SYSTEM)    ? 'S' : '-';
-    str[3] = (attrs & DIRENTRY_ATTR_VOLUME_ID) ? 'V' : '-';
-    str[4] = (attrs & DIRENTRY_ATTR_DIRECTORY) ? 'D' : '-';
-    str[5] = (attrs & DIRENTRY_ATTR_ARCHIVE)   ? 'A' : '-';
-    str[6] = 0;
-    return str;
 }
 
-int directoryEntryReadFileData(Fat32Context* cont, const DirectoryEntry* entry, u8* buffer, size_t bufferSize)
+// Marks [start, end) as free, the clusters must not be marked free yet
+static void freeMapSetFreeRange(Fat32FreeMap* map, u32 start, u32 end)
 {
-    assert(directoryEntryIsFile(entry));
-
-    // Don't do anything if the file is empty
-    // or it is on a bad cluster
-    if (directoryEntryIsEmpty(entry) || clusterPtrIsBadCluster(directoryEntryGetClusterPtr(entry)))
+    map->freeCount += end - start;
+    while (start < end)
     {
-        return 0;
+        const u32 word = start / 64;
+        const u32 bitCount = umin(64 - start % 64, end - start);
+        const u64 bits = bitCount == 64 ? ~0ULL : ((1ULL << bitCount) - 1) << (start % 64);
+        map->bits[word] |= bits;
+        map->summary[word / 64] |= 1ULL << (word % 64);
+        start += bitCount;
     }
-
-    const u64 address = directoryEntryGetDataAddress(cont, entry);
-    fseek(cont->file, address, SEEK_SET);
-    return fread(buffer, 1, umin(bufferSize, entry->fileSize), cont->file);
 }
 
-DirectoryEntryTime toDirectoryEntryTime(u16 input)
+// Index of the first word at or after startWord that has a free cluster, wordCount if none
+static u32 freeMapFindWord(const Fat32FreeMap* map, u32 startWord)
 {
-    DirectoryEntryTime time =
-            {
-            .hour = (input & 0xf800) >> 11,
-            .min  = (input & 0x07e0) >> 5,
-            .sec  = (input & 0x001f) * 2
-    };
-    return time;
-}
+    if (startWord >= map->wordCount)
+        return map->wordCount;
 
-char* directoryEntryTimeToString(const DirectoryEntryTime* input)
-{
-    char* buffer = malloc(9);
-    if (input->hour > 23
-        || input->min > 59
-        || input->sec > 59
-        || snprintf(buffer, 9, "%02i:%02i:%02i", input->hour+1, input->min+1, input->sec) > 8)
+    u32 s = startWord / 64;
+    u64 summary = map->summary[s] & (~0ULL << (startWord % 64));
+    while (true)
     {
-        // If no space for time, fill the output with ?s
-        strcpy(buffer, "\?\?:\?\?:\?\?");
+        if (summary)
+            return s * 64 + __builtin_ctzll(summary);
+        if (++s >= map->summaryCount)
+            return map->wordCount;
+        summary = map->summary[s];
     }
-    return buffer;
 }
 
-
-DirectoryEntryDate toDirectoryEntryDate(u16 input)
+// First free cluster at or after the hint, wrapping around. 0 if the volume is full.
+static u32 freeMapFind(const Fat32FreeMap* map, u32 hint)
 {
-    DirectoryEntryDate date = {
-            .year  = (input & 0xfe00) >> 9,
-            .month = (input & 0x01e0) >> 5,
-            .day   = (input & 0x001f)
-    };
-    return date;
+    if (map->freeCount == 0)
+        return 0;
+    if (hint < 2 || hint >= map->clusterCount + 2)
+        hint = 2;
+
+    u32 word = hint / 64;
+    const u64 bits = map->bits[word] & (~0ULL << (hint % 64));
+    if (bits)
+        return word * 64 + __builtin_ctzll(bits);
+
+    word = freeMapFindWord(map, word + 1);
+    if (word == map->wordCount)
+        word = freeMapFindWord(map, 0);
+    assert(word < map->wordCount);
+    return word * 64 + __builtin_ctzll(map->bits[word]);
 }
 
-char* directoryEntryDateToString(const DirectoryEntryDate* input)
+// Marks [start, end) as used, the clusters must all be free
+static void freeMapSetUsedRange(Fat32FreeMap* map, u32 start, u32 end)
 {
-    char* buffer = malloc(11);
-    if (input->month == 0 || input->month > 12
-        || input->day == 0 || input->day > 31
-        || snprintf(buffer, 11, "%04i-%02i-%02i", 1980+input->year, input->month, input->day) > 10)
+    __atomic_sub_fetch(&map->freeCount, end - start, __ATOMIC_RELAXED);
+    while (start < end)
     {
-        // If invalid, fill the output with ?s
-        strcpy(buffer, "\?\?\?\?-\?\?-\?\?");
+        const u32 word = start / 64;
+        const u32 bitCount = umin(64 - start % 64, end - start);
+        const u64 bits = bitCount == 64 ? ~0ULL : ((1ULL << bitCount) - 1) << (start % 64);
+        assert((map->bits[word] & bits) == bits);
+        map->bits[word] &= ~bits;
+        if (map->bits[word] == 0)
+            map->summary[word / 64] &= ~(1ULL << (word % 64));
+        start += bitCount;
     }
-    return buffer;
 }
 
-u16* lfeEntryGetNameUCS2(const LfeEntry* entry)
+// First free cluster in [start, end), end if there is none
+static u32 freeMapNextFree(const Fat32FreeMap* map, u32 start, u32 end)
 {
-    uint16_t* buffer = calloc(LFE_ENTRY_NAME_LEN+1, 2);
-    for (int i=0; i < 5; ++i)
-    {
-        if (entry->name0[i] != 0xff)
-            buffer[i] = entry->name0[i];
-    }
-    for (int i=0; i < 6; ++i)
-    {
-        if (entry->name1[i] != 0xff)
-            buffer[5+i] = entry->name1[i];
-    }
-    for (int i=0; i < 2; ++i)
+    if (start >= end)
+        return end;
+    u32 word = start / 64;
+    u64 bits = map->bits[word] & (~0ULL << (start % 64));
+    if (!bits)
     {
-        if (entry->name2[i] != 0xff)
-            buffer[11+i] = entry->name2[i];
+        word = freeMapFindWord(map, word + 1);
+        if (word == map->wordCount)
+            return end;
+        bits = map->bits[word];
     }
-    return buffer;
+    return umin(word * 64 + __builtin_ctzll(bits), end);
 }
 
-
-char* lfeEntryGetNameASCII(const LfeEntry* entry)
+// First used cluster in [start, end), end if there is none
+static u32 freeMapNextUsed(const Fat32FreeMap* map, u32 start, u32 end)
 {
-    uint16_t* buffer = lfeEntryGetNameUCS2(entry);
-    char* output = malloc(LFE_ENTRY_NAME_LEN+1);
-    for (int i=0; i < LFE_ENTRY_NAME_LEN; ++i)
+    u32 word = start / 64;
+    u64 used = ~map->bits[word] & (~0ULL << (start % 64));
+    while (!used)
     {
-        output[i] = buffer[i];
+        if (++word >= map->wordCount || word * 64 >= end)
+            return end;
+        used = ~map->bits[word];
     }
-    free(buffer);
-    output[LFE_ENTRY_NAME_LEN] = 0;
-    return output;
+    return umin(word * 64 + __builtin_ctzll(used), end);
 }
 
-void directoryIteratorEntryFree(DirectoryIteratorEntry** entryP)
+// First cluster of a free run of at least count clusters, 0 if there is none.
+// Next fit takes the first run from the hint on, wrapping around, best fit
+// takes the shortest run on the volume so long runs stay for large files.
+static u32 freeMapFindRun(const Fat32FreeMap* map, u32 count, u32 hint, Fat32AllocPolicy policy)
 {
-    free((*entryP)->entry);
-    free((*entryP)->longFilename);
-    free(*entryP);
-    *entryP = NULL;
-}
+    const u32 end = map->clusterCount + 2;
+    if (count == 0 || count > map->freeCount)
+        return 0;
+    if (hint < 2 || hint >= end)
+        hint = 2;
 
-char* directoryIteratorEntryGetFileName(DirectoryIteratorEntry* entry)
-{
-    char* fileName;
-    // If we have a long filename, return it
-    if (entry->longFilename[0] != 0)
-    {
-        const size_t len = strlen(entry->longFilename);
-        fileName = malloc(len+1);
-        strcpy(fileName, entry->longFilename);
-        fileName[len] = 0;
-    }
-        // Only remove padding when this is a file (directories don't have extensions)
-    else if (directoryEntryIsFile(entry->entry))
+    u32 best = 0;
+    u32 bestLength = 0;
+    u32 start = policy == FAT32_ALLOC_BEST_FIT ? 2 : hint;
+    bool isWrapped = false;
+    while (true)
     {
-        // Count extension length
-        int extLen = 0;
-        for (int i=DIRENTRY_FILENAME_LEN-1; i >= 0; --i)
+        const u32 runStart = freeMapNextFree(map, start, end);
+        if (runStart == end)
         {
-            if (entry->entry->fileName[i] == ' ')
+            if (isWrapped || policy == FAT32_ALLOC_BEST_FIT || hint == 2)
                 break;
-            ++extLen;
+            // Runs crossing the hint are found again from their start
+            isWrapped = true;
+            start = 2;
+            continue;
         }
+        if (isWrapped && runStart >= hint)
+            break;
 
-        int outLen;
-        int paddingCount = 0;
-        { // Count length without padding spaces
-            int i=DIRENTRY_FILENAME_LEN-1-extLen;
-            // Skip padding spaces
-            for (; i >= 0; --i)
+        // Next fit only needs to know the run is long enough, not how long it is
+        const u32 limit = policy == FAT32_ALLOC_NEXT_FIT ? umin((u64)runStart + count, end) : end;
+        const u32 runEnd = freeMapNextUsed(map, runStart, limit);
+        const u32 length = runEnd - runStart;
+        if (length >= count)
+        {
+            if (policy == FAT32_ALLOC_NEXT_FIT || length == count)
+                return runStart;
+            if (best == 0 || length < bestLength)
             {
-                if (entry->entry->fileName[i] != ' ')
-                {
-                    break;
-                }
-                ++paddingCount;
+                best = runStart;
+                bestLength = length;
             }
         }
-        // If we have an extension, leave space for the dot
-        outLen = DIRENTRY_FILENAME_LEN-paddingCount+(extLen ? 1 : 0);
+        start = runEnd;
+    }
+    return best;
+}
 
-        fileName = malloc(outLen+1);
-        // Copy string without padding spaces
-        {
-            // Copy extension
-            for (int i=0; i < extLen; ++i)
-                fileName[outLen-i-1] = entry->entry->fileName[DIRENTRY_FILENAME_LEN-1-i];
+//------------------------------------------------------------------------------
 
-            // Put dot if there is an extension
-            if (extLen)
-                fileName[outLen-extLen-1] = '.';
+/*
+ * Scan kernels over the in-memory FAT. An entry is free when its low 28
+ * bits are zero, the upper 4 bits are reserved. The AVX2 and SSE2 versions
+ * compare 8 or 4 entries at a time, the one to use is picked at runtime.
+ */
 
-            // Copy prefix
-            for (int i=0; i < DIRENTRY_FILENAME_LEN-paddingCount-extLen; ++i)
-                fileName[i] = entry->entry->fileName[i];
-        }
-        fileName[outLen] = 0;
+#define FAT_ENTRY_MASK 0x0fffffff
+
+typedef struct FatScanKernels
+{
+    // First free entry in [start, end), end if none
+    u32 (*findFree)(const u32* fat, u32 start, u32 end);
+    // First used entry in [start, end), end if none
+    u32 (*findUsed)(const u32* fat, u32 start, u32 end);
+    u32 (*countFree)(const u32* fat, u32 start, u32 end);
+} FatScanKernels;
+
+static u32 fatScanFindFreeScalar(const u32* fat, u32 start, u32 end)
+{
+    for (u32 i = start; i < end; ++i)
+    {
+        if ((fat[i] & FAT_ENTRY_MASK) == 0)
+            return i;
     }
-        // Directory without a long filename, return as it is
-    else
+    return end;
+}
+
+static u32 fatScanFindUsedScalar(const u32* fat, u32 start, u32 end)
+{
+    for (u32 i = start; i < end; ++i)
     {
-        fileName = malloc(DIRENTRY_FILENAME_LEN+1);
-        strncpy(fileName, (const char*)entry->entry->fileName, DIRENTRY_FILENAME_LEN);
-        fileName[DIRENTRY_FILENAME_LEN] = 0;
+        if ((fat[i] & FAT_ENTRY_MASK) != 0)
+            return i;
     }
-    return fileName;
+    return end;
 }
 
-DirectoryIterator* directoryIteratorNew(u64 addr)
+static u32 fatScanCountFreeScalar(const u32* fat, u32 start, u32 end)
 {
-    DirectoryIterator* it = malloc(sizeof(DirectoryIterator));
-    it->initAddress = addr;
-    it->address = addr;
-    it->longFilename = calloc(LFE_FULL_NAME_LEN + 1, 1);
-    memset(it->lfeChecksums, 0, 16);
-    return it;
+    u32 count = 0;
+    for (u32 i = start; i < end; ++i)
+        count += (fat[i] & FAT_ENTRY_MASK) == 0;
+    return count;
 }
 
-static u8 calcShortNameChecksum(u8 name[DIRENTRY_FILENAME_LEN])
+#ifdef FAT32_SCAN_X86
+// Bit i of the result is set when entry i of the vector is free
+__attribute__((target("sse2")))
+static inline u32 fatScanFreeMaskSse2(const u32* fat)
 {
-    uint8_t sum = 0;
-    for (int i=0; i < DIRENTRY_FILENAME_LEN; ++i)
-        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + name[i];
-    return sum;
+    const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)fat), _mm_set1_epi32(FAT_ENTRY_MASK));
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, _mm_setzero_si128())));
 }
 
-DirectoryIteratorEntry* directoryIteratorNext(Fat32Context* cont,DirectoryIterator* it)
+__attribute__((target("sse2")))
+static u32 fatScanFindFreeSse2(const u32* fat, u32 start, u32 end)
 {
-    if (it->address == 0) // If the iterator ended
+    u32 i = start;
+    for (; i + 4 <= end; i += 4)
     {
-        return NULL;
+        const u32 mask = fatScanFreeMaskSse2(fat + i);
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
+    return fatScanFindFreeScalar(fat, i, end);
+}
 
-    DirectoryEntry* directory = malloc(sizeof(DirectoryEntry));
-    assert(directory);
-    const u32 clusterSizeBytes = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize;
-    while (true)
+__attribute__((target("sse2")))
+static u32 fatScanFindUsedSse2(const u32* fat, u32 start, u32 end)
+{
+    u32 i = start;
+    for (; i + 4 <= end; i += 4)
     {
-        u64 newAddr = it->address + sizeof(DirectoryEntry);
-        fseek(cont->file, it->address, SEEK_SET);
-        fread(directory, sizeof(DirectoryEntry), 1, cont->file);
-
-        if (newAddr % clusterSizeBytes == 0)
-        {
-            const ClusterPtr clusterI = (newAddr-cont->bpb->reservedSectorCount*cont->bpb->sectorSize)/clusterSizeBytes-cont->bpb->sectorSize+1;
-            const ClusterPtr nextCluster = fatGetNextClusterPtr(cont, clusterI);
-            assert(!clusterPtrIsNull(nextCluster));
-            assert(!clusterPtrIsBadCluster(nextCluster));
-            if (clusterPtrIsLastCluster(nextCluster))
-            {
-                it->address = 0;
-                free(directory);
-                return NULL;
-            }
-            else
-            {
-                newAddr = cont->rootDirectoryAddress+(nextCluster-cont->ebpb->rootDirectoryClusterNumber)*cont->bpb->sectorsPerClusters*cont->bpb->sectorSize;
-            }
-        }
-
-        if (directory->fileName[0] == 0) // End of directory
-        {
-            it->address = 0;
-            free(directory);
-            return NULL;
-        }
-
-        if (directory->fileName[0] == 0xe5) // Unused entry, skip
-        {
-            continue;
-        }
-
-        if (directoryEntryIsLFE(directory->attributes)) // LFE Entry
-        {
-            const LfeEntry* lfeEntry = (LfeEntry*)directory;
-            char* lfeVal = lfeEntryGetNameASCII(lfeEntry);
-            const size_t fragI = (lfeEntry->nameStrIndex&0x0f)-1;
-
-            if (it->lfeChecksums[fragI])
-            {
-                assert(false && "Duplicate LFE entry");
-            }
+        const u32 mask = ~fatScanFreeMaskSse2(fat + i) & 0xf;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return fatScanFindUsedScalar(fat, i, end);
+}
 
-            it->lfeChecksums[fragI] = lfeEntry->checksum;
-            strncpy(it->longFilename + fragI * LFE_ENTRY_NAME_LEN, lfeVal, LFE_ENTRY_NAME_LEN);
-            assert(it->longFilename[LFE_FULL_NAME_LEN] == 0);
-            free(lfeVal);
-        }
-        else // Regular directory entry
-        {
-            DirectoryIteratorEntry* dirItEntry = malloc(sizeof(DirectoryIteratorEntry));
-            assert(dirItEntry);
-            dirItEntry->entry = directory;
-            dirItEntry->address = it->address;
-            dirItEntry->longFilename = calloc(LFE_FULL_NAME_LEN+1, 1);
+__attribute__((target("sse2")))
+static u32 fatScanCountFreeSse2(const u32* fat, u32 start, u32 end)
+{
+    const __m128i entryMask = _mm_set1_epi32(FAT_ENTRY_MASK);
+    const __m128i zero = _mm_setzero_si128();
+    // Every free lane subtracts -1, 4 counters of at most 2^28 each can't overflow
+    __m128i counts = zero;
+    u32 i = start;
+    for (; i + 4 <= end; i += 4)
+    {
+        const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(fat + i)), entryMask);
+        counts = _mm_sub_epi32(counts, _mm_cmpeq_epi32(v, zero));
+    }
+    u32 lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, counts);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + fatScanCountFreeScalar(fat, i, end);
+}
 
-            // Verify if the LFE entries have the correct checksum
-            const u8 calcedChecksum = calcShortNameChecksum(dirItEntry->entry->fileName);
-            bool lfeMismatch = false;
-            for (int i=0; i < 16; ++i)
-            {
-                const u8 checksum = it->lfeChecksums[i];
-                if (checksum && checksum != calcedChecksum)
-                {
-                    lfeMismatch = true;
-                    break;
-                }
-            }
+__attribute__((target("avx2")))
+static inline u32 fatScanFreeMaskAvx2(const u32* fat)
+{
+    const __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)fat), _mm256_set1_epi32(FAT_ENTRY_MASK));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, _mm256_setzero_si256())));
+}
 
-            // Throw away long filename on checksum mismatch
-            if (lfeMismatch)
-            {
-                dirItEntry->longFilename[0] = 0;
-            }
-            else
-            {
-                strncpy(dirItEntry->longFilename, it->longFilename, LFE_FULL_NAME_LEN);
-            }
-            memset(it->longFilename, 0, LFE_FULL_NAME_LEN + 1);
-            memset(it->lfeChecksums, 0, 16);
-            it->address = newAddr;
-            return dirItEntry;
-        }
+__attribute__((target("avx2")))
+static u32 fatScanFindFreeAvx2(const u32* fat, u32 start, u32 end)
+{
+    u32 i = start;
+    for (; i + 8 <= end; i += 8)
+    {
+        const u32 mask = fatScanFreeMaskAvx2(fat + i);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return fatScanFindFreeScalar(fat, i, end);
+}
 
-        it->address = newAddr;
+__attribute__((target("avx2")))
+static u32 fatScanFindUsedAvx2(const u32* fat, u32 start, u32 end)
+{
+    u32 i = start;
+    for (; i + 8 <= end; i += 8)
+    {
+        const u32 mask = ~fatScanFreeMaskAvx2(fat + i) & 0xff;
+        if (mask)
+            return i + __builtin_ctz(mask);
     }
+    return fatScanFindUsedScalar(fat, i, end);
 }
 
-void directoryIteratorSetAddress(DirectoryIterator* it, uint64_t addr)
+__attribute__((target("avx2")))
+static u32 fatScanCountFreeAvx2(const u32* fat, u32 start, u32 end)
 {
-    it->initAddress = addr;
-    it->address = addr;
+    const __m256i entryMask = _mm256_set1_epi32(FAT_ENTRY_MASK);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i counts = zero;
+    u32 i = start;
+    for (; i + 8 <= end; i += 8)
+    {
+        const __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(fat + i)), entryMask);
+        counts = _mm256_sub_epi32(counts, _mm256_cmpeq_epi32(v, zero));
+    }
+    u32 lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, counts);
+    u32 count = fatScanCountFreeScalar(fat, i, end);
+    for (int lane = 0; lane < 8; ++lane)
+        count += lanes[lane];
+    return count;
 }
+#endif
 
-void directoryIteratorRewind(DirectoryIterator* it)
+typedef enum ScanLevel
 {
-    it->address = it->initAddress;
+    SCAN_LEVEL_SCALAR,
+    SCAN_LEVEL_SSE2,
+    SCAN_LEVEL_AVX2,
+} ScanLevel;
+
+// Widest vector instruction set the CPU supports, checked once
+static ScanLevel scanLevel(void)
+{
+#ifdef FAT32_SCAN_X86
+    // Every thread finds the same level, so racing on the first call is harmless
+    static int level = -1;
+    if (level < 0)
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            level = SCAN_LEVEL_AVX2;
+        else if (__builtin_cpu_supports("sse2"))
+            level = SCAN_LEVEL_SSE2;
+        else
+            level = SCAN_LEVEL_SCALAR;
+    }
+    return (ScanLevel)level;
+#else
+    return SCAN_LEVEL_SCALAR;
+#endif
 }
 
-void directoryIteratorFree(DirectoryIterator** itP)
+static const FatScanKernels* fatScanKernels(void)
 {
-    if(*itP != NULL)
+    static const FatScanKernels scalar = {fatScanFindFreeScalar, fatScanFindUsedScalar, fatScanCountFreeScalar};
+#ifdef FAT32_SCAN_X86
+    static const FatScanKernels sse2 = {fatScanFindFreeSse2, fatScanFindUsedSse2, fatScanCountFreeSse2};
+    static const FatScanKernels avx2 = {fatScanFindFreeAvx2, fatScanFindUsedAvx2, fatScanCountFreeAvx2};
+    switch (scanLevel())
     {
-        free((*itP)->longFilename);
+        case SCAN_LEVEL_AVX2:
+            return &avx2;
+        case SCAN_LEVEL_SSE2:
+            return &sse2;
+        default:
+            break;
     }
-    free(*itP);
-    *itP = NULL;
+#endif
+    return &scalar;
 }
 
-Fat32Context* fat32Initialize(const char* devFilePath,bool *isFAT32)
+u32 fat32CountFreeClusters(const Fat32Context* cont)
 {
-    Fat32Context* context = malloc(sizeof(Fat32Context));
-    context->file = fopen(devFilePath, "rb+");
-    if (!context->file)
+    return fatScanKernels()->countFree((const u32*)cont->fat, 2, cont->clusterCount + 2);
+}
+
+static void freeMapBuild(Fat32Context* cont)
+{
+    Fat32FreeMap* map = &cont->freeMap;
+    map->clusterCount = cont->clusterCount;
+    map->wordCount = (cont->clusterCount + 2 + 63) / 64;
+    map->summaryCount = (map->wordCount + 63) / 64;
+    map->bits = calloc(map->wordCount, sizeof(u64));
+    map->summary = calloc(map->summaryCount, sizeof(u64));
+    map->freeCount = 0;
+    assert(map->bits && map->summary);
+
+    // Jump between the edges of free runs, entries in between are skipped a vector at a time
+    const FatScanKernels* kernels = fatScanKernels();
+    const u32* fat = (const u32*)cont->fat;
+    const u32 end = cont->clusterCount + 2;
+    u32 cluster = 2;
+    while ((cluster = kernels->findFree(fat, cluster, end)) < end)
     {
-        printf("Failed to open file: %s: %s\n", devFilePath, strerror(errno));
-        free(context);
-        return NULL;
+        const u32 runEnd = kernels->findUsed(fat, cluster, end);
+        freeMapSetFreeRange(map, cluster, runEnd);
+        cluster = runEnd;
     }
 
-    context->bpb = malloc(sizeof(BPB));
-    fseek(context->file, 0, SEEK_SET);
-    fread(context->bpb, sizeof(BPB), 1, context->file);
-    context->isBpbModified = false;
+    map->hint = cont->fsinfo->nextFree;
+    if (map->hint < 2 || map->hint >= cont->clusterCount + 2)
+        map->hint = 2;
+}
 
-    context->ebpb = malloc(sizeof(EBPB));
-    fseek(context->file, sizeof(BPB), SEEK_SET);
-    fread(context->ebpb, sizeof(EBPB), 1, context->file);
-    context->isEbpbModified = false;
+static void freeMapFree(Fat32FreeMap* map)
+{
+    free(map->bits);
+    free(map->summary);
+    map->bits = NULL;
+    map->summary = NULL;
+}
+
+// Number of data clusters, limited by what the FAT can address
+static u32 fat32CalcClusterCount(const Fat32Context* cont)
+{
+    const u64 dataSectors = BPBGetSectorCount(cont->bpb) - cont->firstDataSector;
+    const u64 countOfClusters = dataSectors / cont->bpb->sectorsPerClusters;
+    const u64 fatCapacity = cont->fatSizeBytes / 4 - 2;
+    return umin(countOfClusters, fatCapacity);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Block devices. The file device uses positional I/O, so threads never
+ * share a file position. The map device exposes a writable mapping for
+ * in-place access, or copies out of a read-only one. The RAM disk keeps
+ * the image in memory but still copies, so it runs the same code paths
+ * as the file device without the page cache underneath.
+ *
+ * Batches go to the device's submit. Memory devices and the plain file
+ * device run the requests in order. A file device can start an engine:
+ * io_uring, driven through the raw system calls, or a small thread pool
+ * when io_uring is unavailable. Requests that come back short or failed
+ * from either are finished with plain positional I/O.
+ */
+
+typedef struct UringEngine UringEngine;
+typedef struct PoolEngine PoolEngine;
+
+typedef struct FdDevice
+{
+    Fat32BlockDevice base;
+    int fd;
+    u64 size; // At open or create, the image doesn't grow
+    Fat32IoEngine engine;
+    UringEngine* uring;
+    PoolEngine* pool;
+} FdDevice;
+
+static bool fdRead(int fd, u64 offset, void* data, size_t size)
+{
+    u8* bytes = data;
+    while (size > 0)
+    {
+        const ssize_t readBytes = pread(fd, bytes, size, (off_t)offset);
+        if (readBytes <= 0)
+        {
+            if (readBytes < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += readBytes;
+        offset += readBytes;
+        size -= readBytes;
+    }
+    return true;
+}
+
+static bool fdWrite(int fd, u64 offset, const void* data, size_t size)
+{
+    const u8* bytes = data;
+    while (size > 0)
+    {
+        const ssize_t written = pwrite(fd, bytes, size, (off_t)offset);
+        if (written <= 0)
+        {
+            if (written < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += written;
+        offset += written;
+        size -= written;
+    }
+    return true;
+}
+
+static bool fdRunRequest(int fd, Fat32IoRequest* request)
+{
+    request->isDone = request->isWrite
+            ? fdWrite(fd, request->offset, request->data, request->size)
+            : fdRead(fd, request->offset, request->data, request->size);
+    return request->isDone;
+}
+
+static bool fdDeviceRead(Fat32BlockDevice* dev, u64 offset, void* data, size_t size)
+{
+    return fdRead(((FdDevice*)dev)->fd, offset, data, size);
+}
+
+static bool fdDeviceWrite(Fat32BlockDevice* dev, u64 offset, const void* data, size_t size)
+{
+    return fdWrite(((FdDevice*)dev)->fd, offset, data, size);
+}
+
+// Submit of devices without an engine
+static bool deviceSubmitEach(Fat32BlockDevice* dev, Fat32IoRequest* requests, u32 count)
+{
+    bool isOk = true;
+    for (u32 i = 0; i < count; ++i)
+    {
+        Fat32IoRequest* request = &requests[i];
+        request->isDone = request->isWrite
+                ? dev->write(dev, request->offset, request->data, request->size)
+                : dev->read(dev, request->offset, request->data, request->size);
+        isOk &= request->isDone;
+    }
+    return isOk;
+}
+
+#ifdef FAT32_HAVE_URING
+struct UringEngine
+{
+    int ringFd;
+    bool isBroken; // io_uring_enter failed, the ring can't be trusted anymore
+    u8* sqRing;
+    size_t sqRingSize;
+    u8* cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    u32 sqEntries;
+    u32 sqMask;
+    u32* sqTail;
+    u32* sqArray;
+    u32 cqMask;
+    u32* cqHead;
+    u32* cqTail;
+    struct io_uring_cqe* cqes;
+    pthread_mutex_t lock; // One submitter at a time
+};
+
+static void uringStop(UringEngine* ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingSize);
+    if (ring->sqRing)
+        munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->ringFd);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+static UringEngine* uringStart(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    const int ringFd = syscall(__NR_io_uring_setup, FAT32_IO_QUEUE_DEPTH, &params);
+    if (ringFd < 0)
+        return NULL;
+
+    UringEngine* ring = calloc(1, sizeof(UringEngine));
+    assert(ring);
+    ring->ringFd = ringFd;
+    pthread_mutex_init(&ring->lock, NULL);
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(u32);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both rings with one call
+    const bool isSingleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (isSingleMap)
+    {
+        if (ring->cqRingSize > ring->sqRingSize)
+            ring->sqRingSize = ring->cqRingSize;
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    void* sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+    {
+        uringStop(ring);
+        return NULL;
+    }
+    ring->sqRing = sqRing;
+
+    void* cqRing = isSingleMap
+            ? sqRing
+            : mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED)
+    {
+        uringStop(ring);
+        return NULL;
+    }
+    ring->cqRing = cqRing;
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        uringStop(ring);
+        return NULL;
+    }
+    ring->sqes = sqes;
+
+    ring->sqEntries = params.sq_entries;
+    ring->sqMask = *(u32*)(ring->sqRing + params.sq_off.ring_mask);
+    ring->sqTail = (u32*)(ring->sqRing + params.sq_off.tail);
+    ring->sqArray = (u32*)(ring->sqRing + params.sq_off.array);
+    ring->cqMask = *(u32*)(ring->cqRing + params.cq_off.ring_mask);
+    ring->cqHead = (u32*)(ring->cqRing + params.cq_off.head);
+    ring->cqTail = (u32*)(ring->cqRing + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe*)(ring->cqRing + params.cq_off.cqes);
+    return ring;
+}
+
+// Takes every completion that arrived, returns how many
+static u32 uringReap(UringEngine* ring, int fd, Fat32IoRequest* requests)
+{
+    u32 head = *ring->cqHead;
+    const u32 tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    u32 reaped = 0;
+    for (; head != tail; ++head, ++reaped)
+    {
+        const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+        Fat32IoRequest* request = &requests[cqe->user_data];
+        const s64 result = cqe->res;
+        if (result == (s64)request->size)
+        {
+            request->isDone = true;
+        }
+        else if (result > 0)
+        {
+            // Short transfer, finish the rest here
+            request->isDone = request->isWrite
+                    ? fdWrite(fd, request->offset + result, (const u8*)request->data + result, request->size - result)
+                    : fdRead(fd, request->offset + result, (u8*)request->data + result, request->size - result);
+        }
+        else
+        {
+            // Also covers operations the kernel doesn't support
+            fdRunRequest(fd, request);
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+static void uringSubmit(UringEngine* ring, int fd, Fat32IoRequest* requests, u32 count)
+{
+    pthread_mutex_lock(&ring->lock);
+    for (u32 first = 0; first < count && !ring->isBroken;)
+    {
+        const u32 chunk = umin(count - first, ring->sqEntries);
+        u32 tail = *ring->sqTail;
+        for (u32 i = 0; i < chunk; ++i, ++tail)
+        {
+            const Fat32IoRequest* request = &requests[first + i];
+            const u32 index = tail & ring->sqMask;
+            struct io_uring_sqe* sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = request->isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->off = request->offset;
+            sqe->addr = (u64)(uintptr_t)request->data;
+            // Bigger requests come back short and are finished by uringReap
+            sqe->len = umin(request->size, 1u << 30);
+            sqe->user_data = first + i;
+            ring->sqArray[index] = index;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+        u32 submitted = 0;
+        u32 completed = 0;
+        while (completed < chunk)
+        {
+            const int ret = syscall(__NR_io_uring_enter, ring->ringFd, chunk - submitted, 1,
+                                    IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                    continue;
+                printf("io_uring_enter failed: %s\n", strerror(errno));
+                ring->isBroken = true;
+                // Requests the kernel already took still use the callers' buffers, their completions come without entering
+                while (completed < submitted)
+                {
+                    const u32 reaped = uringReap(ring, fd, requests);
+                    if (reaped == 0)
+                        sched_yield();
+                    completed += reaped;
+                }
+                break;
+            }
+            submitted += ret;
+            completed += uringReap(ring, fd, requests);
+        }
+        first += chunk;
+    }
+
+    // Whatever the ring didn't finish, also when another thread broke it before this one got the lock
+    if (ring->isBroken)
+    {
+        for (u32 i = 0; i < count; ++i)
+        {
+            if (!requests[i].isDone)
+                fdRunRequest(fd, &requests[i]);
+        }
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+#endif
+
+typedef struct PoolBatch
+{
+    Fat32IoRequest* requests;
+    u32 count;
+    u32 next; // Next request to hand out
+    u32 finished;
+    struct PoolBatch* nextBatch;
+} PoolBatch;
+
+struct PoolEngine
+{
+    int fd;
+    pthread_t threads[FAT32_IO_POOL_THREADS];
+    u32 threadCount;
+    pthread_mutex_t lock;
+    pthread_cond_t workCond;
+    pthread_cond_t doneCond;
+    PoolBatch* head; // Batches with requests left to hand out, oldest first
+    PoolBatch* tail;
+    bool isStopping;
+};
+
+// Runs one request of the oldest batch, needs the pool lock and returns with it held
+static bool poolRunOne(PoolEngine* pool)
+{
+    PoolBatch* batch = pool->head;
+    if (!batch)
+        return false;
+    Fat32IoRequest* request = &batch->requests[batch->next++];
+    if (batch->next == batch->count)
+    {
+        pool->head = batch->nextBatch;
+        if (!pool->head)
+            pool->tail = NULL;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    fdRunRequest(pool->fd, request);
+    pthread_mutex_lock(&pool->lock);
+    if (++batch->finished == batch->count)
+        pthread_cond_broadcast(&pool->doneCond);
+    return true;
+}
+
+static void* poolWorker(void* arg)
+{
+    PoolEngine* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        if (poolRunOne(pool))
+            continue;
+        if (pool->isStopping)
+            break;
+        pthread_cond_wait(&pool->workCond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void poolSubmit(PoolEngine* pool, Fat32IoRequest* requests, u32 count)
+{
+    PoolBatch batch = {
+            .requests = requests,
+            .count = count,
+    };
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->nextBatch = &batch;
+    else
+        pool->head = &batch;
+    pool->tail = &batch;
+    pthread_cond_broadcast(&pool->workCond);
+
+    // The submitting thread works too instead of only waiting
+    while (batch.finished < batch.count)
+    {
+        if (!poolRunOne(pool))
+            pthread_cond_wait(&pool->doneCond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void poolStop(PoolEngine* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->isStopping = true;
+    pthread_cond_broadcast(&pool->workCond);
+    pthread_mutex_unlock(&pool->lock);
+    for (u32 i = 0; i < pool->threadCount; ++i)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->workCond);
+    pthread_cond_destroy(&pool->doneCond);
+    free(pool);
+}
+
+static PoolEngine* poolStart(int fd)
+{
+    PoolEngine* pool = calloc(1, sizeof(PoolEngine));
+    assert(pool);
+    pool->fd = fd;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workCond, NULL);
+    pthread_cond_init(&pool->doneCond, NULL);
+    for (u32 i = 0; i < FAT32_IO_POOL_THREADS; ++i)
+    {
+        if (pthread_create(&pool->threads[pool->threadCount], NULL, poolWorker, pool) == 0)
+            ++pool->threadCount;
+    }
+    if (pool->threadCount == 0)
+    {
+        poolStop(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static bool fdDeviceSubmit(Fat32BlockDevice* dev, Fat32IoRequest* requests, u32 count)
+{
+    FdDevice* fdDev = (FdDevice*)dev;
+    for (u32 i = 0; i < count; ++i)
+        requests[i].isDone = false;
+#ifdef FAT32_HAVE_URING
+    if (fdDev->uring && !fdDev->uring->isBroken)
+        uringSubmit(fdDev->uring, fdDev->fd, requests, count);
+    else
+#endif
+    if (fdDev->pool)
+        poolSubmit(fdDev->pool, requests, count);
+    else
+        return deviceSubmitEach(dev, requests, count);
+
+    bool isOk = true;
+    for (u32 i = 0; i < count; ++i)
+        isOk &= requests[i].isDone;
+    return isOk;
+}
+
+// Writes already reached the kernel, like fflush did for the stdio stream
+static bool fdDeviceFlush(Fat32BlockDevice* dev)
+{
+    (void)dev;
+    return true;
+}
+
+static u64 fdDeviceSize(const Fat32BlockDevice* dev)
+{
+    return ((const FdDevice*)dev)->size;
+}
+
+static void fdDeviceClose(Fat32BlockDevice* dev)
+{
+    FdDevice* fdDev = (FdDevice*)dev;
+#ifdef FAT32_HAVE_URING
+    if (fdDev->uring)
+        uringStop(fdDev->uring);
+#endif
+    if (fdDev->pool)
+        poolStop(fdDev->pool);
+    close(fdDev->fd);
+    free(dev);
+}
+
+static bool readOnlyDeviceWrite(Fat32BlockDevice* dev, u64 offset, const void* data, size_t size)
+{
+    (void)dev; (void)offset; (void)data; (void)size;
+    errno = EROFS;
+    return false;
+}
+
+static Fat32BlockDevice* fdDeviceNew(const char* path, int openFlags, bool isReadOnly)
+{
+    const int fd = open(path, openFlags, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        printf("Failed to open device: %s: %s\n", path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    FdDevice* dev = calloc(1, sizeof(FdDevice));
+    assert(dev);
+    dev->base.read = fdDeviceRead;
+    dev->base.write = isReadOnly ? readOnlyDeviceWrite : fdDeviceWrite;
+    // Submitted writes to a read-only descriptor fail with EBADF
+    dev->base.submit = fdDeviceSubmit;
+    dev->base.flush = fdDeviceFlush;
+    dev->base.size = fdDeviceSize;
+    dev->base.close = fdDeviceClose;
+    dev->base.isReadOnly = isReadOnly;
+    dev->fd = fd;
+    dev->size = st.st_size;
+    return &dev->base;
+}
+
+Fat32BlockDevice* fat32FileDeviceOpen(const char* path, bool isReadOnly)
+{
+    return fdDeviceNew(path, isReadOnly ? O_RDONLY : O_RDWR, isReadOnly);
+}
+
+Fat32BlockDevice* fat32FileDeviceCreate(const char* path, u64 size)
+{
+    Fat32BlockDevice* dev = fdDeviceNew(path, O_RDWR | O_CREAT | O_TRUNC, false);
+    if (!dev)
+        return NULL;
+
+    // Size the image without touching the data area, so the file stays sparse
+    // and only the metadata regions are actually written.
+    FdDevice* fdDev = (FdDevice*)dev;
+    if (ftruncate(fdDev->fd, (off_t)size) != 0)
+    {
+        printf("Failed to resize device: %s: %s\n", path, strerror(errno));
+        fat32BlockDeviceClose(&dev);
+        return NULL;
+    }
+    fdDev->size = size;
+    return dev;
+}
+
+typedef struct MapDevice
+{
+    Fat32BlockDevice base;
+    u8* data;
+    u64 size;
+} MapDevice;
+
+static bool mapDeviceRead(Fat32BlockDevice* dev, u64 offset, void* data, size_t size)
+{
+    const MapDevice* mapDev = (const MapDevice*)dev;
+    if (offset + size > mapDev->size)
+        return false;
+    memcpy(data, mapDev->data + offset, size);
+    return true;
+}
+
+static bool mapDeviceWrite(Fat32BlockDevice* dev, u64 offset, const void* data, size_t size)
+{
+    MapDevice* mapDev = (MapDevice*)dev;
+    if (offset + size > mapDev->size)
+        return false;
+    // Data may already be in place, e.g. the primary FAT
+    if (mapDev->data + offset != data)
+        memmove(mapDev->data + offset, data, size);
+    return true;
+}
+
+static bool mapDeviceFlush(Fat32BlockDevice* dev)
+{
+    const MapDevice* mapDev = (const MapDevice*)dev;
+    return dev->isReadOnly || msync(mapDev->data, mapDev->size, MS_SYNC) == 0;
+}
+
+static u64 mapDeviceSize(const Fat32BlockDevice* dev)
+{
+    return ((const MapDevice*)dev)->size;
+}
+
+static void mapDeviceClose(Fat32BlockDevice* dev)
+{
+    MapDevice* mapDev = (MapDevice*)dev;
+    munmap(mapDev->data, mapDev->size);
+    free(dev);
+}
+
+Fat32BlockDevice* fat32MapDeviceOpen(const char* path, bool isReadOnly)
+{
+    const int fd = open(path, isReadOnly ? O_RDONLY : O_RDWR);
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        const int prot = isReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+        map = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    }
+    // The mapping stays valid without the descriptor
+    if (fd >= 0)
+        close(fd);
+    if (map == MAP_FAILED)
+    {
+        printf("Failed to map file: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    MapDevice* dev = calloc(1, sizeof(MapDevice));
+    assert(dev);
+    dev->base.read = mapDeviceRead;
+    dev->base.write = isReadOnly ? readOnlyDeviceWrite : mapDeviceWrite;
+    dev->base.submit = deviceSubmitEach;
+    dev->base.flush = mapDeviceFlush;
+    dev->base.size = mapDeviceSize;
+    dev->base.close = mapDeviceClose;
+    // A read-only mapping can't hold the in-memory FAT, so it is only copied from
+    dev->base.map = isReadOnly ? NULL : map;
+    dev->base.isReadOnly = isReadOnly;
+    dev->data = map;
+    dev->size = st.st_size;
+    return &dev->base;
+}
+
+static void ramDeviceClose(Fat32BlockDevice* dev)
+{
+    free(((MapDevice*)dev)->data);
+    free(dev);
+}
+
+static bool ramDeviceFlush(Fat32BlockDevice* dev)
+{
+    (void)dev;
+    return true;
+}
+
+Fat32BlockDevice* fat32RamDeviceNew(u64 size)
+{
+    // Untouched pages of a big calloc stay unallocated, like the holes of a sparse image
+    u8* data = calloc(1, size);
+    if (!data)
+    {
+        printf("Failed to allocate a RAM disk of %llu bytes\n", (unsigned long long)size);
+        return NULL;
+    }
+
+    MapDevice* dev = calloc(1, sizeof(MapDevice));
+    assert(dev);
+    dev->base.read = mapDeviceRead;
+    dev->base.write = mapDeviceWrite;
+    dev->base.submit = deviceSubmitEach;
+    dev->base.flush = ramDeviceFlush;
+    dev->base.size = mapDeviceSize;
+    dev->base.close = ramDeviceClose;
+    dev->data = data;
+    dev->size = size;
+    return &dev->base;
+}
+
+Fat32IoEngine fat32FileDeviceStartEngine(Fat32BlockDevice* dev, Fat32IoEngine preferred)
+{
+    if (dev->close != fdDeviceClose)
+        return FAT32_IO_SYNC;
+    FdDevice* fdDev = (FdDevice*)dev;
+    if (fdDev->engine != FAT32_IO_SYNC || preferred == FAT32_IO_SYNC)
+        return fdDev->engine;
+
+#ifdef FAT32_HAVE_URING
+    if (preferred == FAT32_IO_URING)
+    {
+        fdDev->uring = uringStart();
+        if (fdDev->uring)
+        {
+            fdDev->engine = FAT32_IO_URING;
+            return fdDev->engine;
+        }
+    }
+#endif
+    fdDev->pool = poolStart(fdDev->fd);
+    if (fdDev->pool)
+        fdDev->engine = FAT32_IO_THREADS;
+    return fdDev->engine;
+}
+
+void fat32BlockDeviceClose(Fat32BlockDevice** devP)
+{
+    if (*devP)
+        (*devP)->close(*devP);
+    *devP = NULL;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Statistics. Counters are bumped with relaxed atomics wherever the work
+ * happens, so they stay cheap and are exact also in concurrent mode.
+ * Latencies go into log2 histograms, one per public operation.
+ */
+
+static void statsAdd(u64* counter, u64 n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void statsIo(Fat32Context* cont, u64 offset, size_t size, bool isWrite)
+{
+    statsAdd(isWrite ? &cont->stats.writes : &cont->stats.reads, 1);
+    statsAdd(isWrite ? &cont->stats.bytesWritten : &cont->stats.bytesRead, size);
+    if (__atomic_exchange_n(&cont->ioPosition, offset + size, __ATOMIC_RELAXED) != offset)
+        statsAdd(&cont->stats.seeks, 1);
+}
+
+static u64 statsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void statsRecord(Fat32Context* cont, Fat32StatsOp op, u64 start)
+{
+    Fat32Histogram* histogram = &cont->stats.latency[op];
+    const u64 ns = statsNow() - start;
+    const u32 bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    statsAdd(&histogram->buckets[bucket < FAT32_HISTOGRAM_BUCKETS ? bucket : FAT32_HISTOGRAM_BUCKETS - 1], 1);
+    statsAdd(&histogram->count, 1);
+    statsAdd(&histogram->totalNs, ns);
+    u64 max = __atomic_load_n(&histogram->maxNs, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&histogram->maxNs, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void fat32StatsGet(const Fat32Context* cont, Fat32Stats* out)
+{
+    const u64* from = (const u64*)&cont->stats;
+    u64* to = (u64*)out;
+    for (size_t i = 0; i < sizeof(Fat32Stats) / sizeof(u64); ++i)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+void fat32StatsReset(Fat32Context* cont)
+{
+    u64* counters = (u64*)&cont->stats;
+    for (size_t i = 0; i < sizeof(Fat32Stats) / sizeof(u64); ++i)
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+}
+
+const char* fat32StatsOpName(Fat32StatsOp op)
+{
+    static const char* names[FAT32_STATS_OP_COUNT] = {"lookup", "create", "list", "flush"};
+    return op < FAT32_STATS_OP_COUNT ? names[op] : "unknown";
+}
+
+u64 fat32HistogramPercentile(const Fat32Histogram* histogram, double percentile)
+{
+    if (histogram->count == 0)
+        return 0;
+
+    const u64 rank = (u64)(histogram->count * percentile / 100.0);
+    u64 seen = 0;
+    for (u32 i = 0; i < FAT32_HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+            return umin(2ULL << i, histogram->maxNs);
+    }
+    return histogram->maxNs;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Write-back cache of data area clusters. Entries are found through a
+ * hash of the cluster index and kept on an LRU list, most recently used
+ * at the head. Dirty clusters are written back on eviction or on flush.
+ */
+
+// Checked by the calls that change the volume
+static bool fat32IsWritable(const Fat32Context* cont)
+{
+    if (cont->device->isReadOnly)
+    {
+        printf("The volume is read-only\n");
+        return false;
+    }
+    return true;
+}
+
+static bool fat32WriteAt(Fat32Context* cont, u64 offset, const void* data, size_t size)
+{
+    statsIo(cont, offset, size, true);
+    return cont->device->write(cont->device, offset, data, size);
+}
+
+static bool fat32ReadAt(Fat32Context* cont, u64 offset, void* data, size_t size)
+{
+    statsIo(cont, offset, size, false);
+    return cont->device->read(cont->device, offset, data, size);
+}
+
+static bool fat32Submit(Fat32Context* cont, Fat32IoRequest* requests, u32 count)
+{
+    for (u32 i = 0; i < count; ++i)
+        statsIo(cont, requests[i].offset, requests[i].size, requests[i].isWrite);
+    return count == 0 || cont->device->submit(cont->device, requests, count);
+}
+
+static u32 cacheHash(const Fat32Cache* cache, u32 cluster)
+{
+    return (cluster * 2654435761u) & (cache->bucketCount - 1);
+}
+
+static void cacheLruUnlink(Fat32Cache* cache, Fat32CacheEntry* entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cache->lruHead = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cache->lruTail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void cacheLruPushFront(Fat32Cache* cache, Fat32CacheEntry* entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->lruHead;
+    if (cache->lruHead)
+        cache->lruHead->prev = entry;
+    cache->lruHead = entry;
+    if (!cache->lruTail)
+        cache->lruTail = entry;
+}
+
+static void cacheLruPushBack(Fat32Cache* cache, Fat32CacheEntry* entry)
+{
+    entry->next = NULL;
+    entry->prev = cache->lruTail;
+    if (cache->lruTail)
+        cache->lruTail->next = entry;
+    cache->lruTail = entry;
+    if (!cache->lruHead)
+        cache->lruHead = entry;
+}
+
+static void cacheHashRemove(Fat32Cache* cache, Fat32CacheEntry* entry)
+{
+    Fat32CacheEntry** link = &cache->buckets[cacheHash(cache, entry->cluster)];
+    while (*link && *link != entry)
+        link = &(*link)->hashNext;
+    if (*link)
+        *link = entry->hashNext;
+    entry->hashNext = NULL;
+}
+
+static Fat32CacheEntry* cacheLookup(Fat32Cache* cache, u32 cluster)
+{
+    Fat32CacheEntry* entry = cache->buckets[cacheHash(cache, cluster)];
+    while (entry && entry->cluster != cluster)
+        entry = entry->hashNext;
+    return entry;
+}
+
+static bool cacheWriteBack(Fat32Context* cont, Fat32CacheEntry* entry)
+{
+    const u64 address = fat32GetClusterAddress(cont, entry->cluster);
+    if (!fat32WriteAt(cont, address, entry->data, cont->cache.clusterSize))
+    {
+        printf("Failed to write cluster %u: %s\n", entry->cluster, strerror(errno));
+        return false;
+    }
+    entry->isDirty = false;
+    return true;
+}
+
+// Forgets the cluster an entry holds, the entry becomes the first one to be reused
+static void cacheDropEntry(Fat32Cache* cache, Fat32CacheEntry* entry)
+{
+    cacheHashRemove(cache, entry);
+    cacheLruUnlink(cache, entry);
+    cacheLruPushBack(cache, entry);
+    entry->cluster = 0;
+    entry->isDirty = false;
+}
+
+// Drops the copy of a cluster that is about to be freed, its changes are not needed anymore
+static void cacheForget(Fat32Context* cont, u32 cluster)
+{
+    Fat32CacheEntry* entry = cont->map ? NULL : cacheLookup(&cont->cache, cluster);
+    if (entry)
+        cacheDropEntry(&cont->cache, entry);
+}
+
+// Takes an unused entry or evicts the least recently used one
+static Fat32CacheEntry* cacheTakeEntry(Fat32Context* cont, u32 cluster)
+{
+    Fat32Cache* cache = &cont->cache;
+    Fat32CacheEntry* entry;
+    if (cache->used < cache->capacity)
+    {
+        entry = &cache->entries[cache->used++];
+        entry->data = malloc(cache->clusterSize);
+        assert(entry->data);
+    }
+    else
+    {
+        entry = cache->lruTail;
+        if (entry->isDirty && !cacheWriteBack(cont, entry))
+            return NULL;
+        cacheLruUnlink(cache, entry);
+        cacheHashRemove(cache, entry);
+    }
+
+    entry->cluster = cluster;
+    entry->isDirty = false;
+    const u32 bucket = cacheHash(cache, cluster);
+    entry->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    cacheLruPushFront(cache, entry);
+    return entry;
+}
+
+static void cacheInit(Fat32Context* cont, u64 budgetBytes)
+{
+    Fat32Cache* cache = &cont->cache;
+    cache->clusterSize = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize;
+    cache->budgetBytes = budgetBytes;
+    cache->capacity = budgetBytes / cache->clusterSize;
+    if (cache->capacity < FAT32_MIN_CACHE_CLUSTERS)
+        cache->capacity = FAT32_MIN_CACHE_CLUSTERS;
+    cache->bucketCount = 1;
+    while (cache->bucketCount < cache->capacity * 2)
+        cache->bucketCount <<= 1;
+    cache->entries = calloc(cache->capacity, sizeof(Fat32CacheEntry));
+    cache->buckets = calloc(cache->bucketCount, sizeof(Fat32CacheEntry*));
+    assert(cache->entries && cache->buckets);
+    cache->used = 0;
+    cache->lruHead = cache->lruTail = NULL;
+}
+
+static void cacheFree(Fat32Cache* cache)
+{
+    for (u32 i = 0; i < cache->used; ++i)
+        free(cache->entries[i].data);
+    free(cache->entries);
+    free(cache->buckets);
+    cache->entries = NULL;
+    cache->buckets = NULL;
+    cache->used = cache->capacity = 0;
+}
+
+static int cacheCompareClusters(const void* a, const void* b)
+{
+    const u32 lhs = (*(Fat32CacheEntry* const*)a)->cluster;
+    const u32 rhs = (*(Fat32CacheEntry* const*)b)->cluster;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+bool fat32CacheFlush(Fat32Context* cont)
+{
+    Fat32Cache* cache = &cont->cache;
+    Fat32CacheEntry** dirty = malloc(sizeof(Fat32CacheEntry*) * (cache->used + 1));
+    u32 dirtyCount = 0;
+    for (u32 i = 0; i < cache->used; ++i)
+    {
+        if (cache->entries[i].isDirty)
+            dirty[dirtyCount++] = &cache->entries[i];
+    }
+
+    // Write in disk order
+    qsort(dirty, dirtyCount, sizeof(Fat32CacheEntry*), cacheCompareClusters);
+    bool isOk = true;
+    for (u32 i = 0; i < dirtyCount; ++i)
+        isOk &= cacheWriteBack(cont, dirty[i]);
+
+    free(dirty);
+    return isOk;
+}
+
+bool fat32CacheSetBudget(Fat32Context* cont, u64 budgetBytes)
+{
+    lockExclusive(cont, &cont->volumeLock);
+    const bool isOk = fat32CacheFlush(cont);
+    if (isOk)
+    {
+        cacheFree(&cont->cache);
+        cacheInit(cont, budgetBytes);
+    }
+    unlockRw(cont, &cont->volumeLock);
+    return isOk;
+}
+
+u8* fat32CacheGetCluster(Fat32Context* cont, u32 cluster)
+{
+    if (cluster < 2 || cluster >= cont->clusterCount + 2)
+        return NULL;
+
+    // Mapped images are accessed in place
+    if (cont->map)
+        return cont->map + fat32GetClusterAddress(cont, cluster);
+
+    Fat32Cache* cache = &cont->cache;
+    Fat32CacheEntry* entry = cacheLookup(cache, cluster);
+    if (entry)
+    {
+        statsAdd(&cont->stats.cacheHits, 1);
+        cacheLruUnlink(cache, entry);
+        cacheLruPushFront(cache, entry);
+        return entry->data;
+    }
+
+    statsAdd(&cont->stats.cacheMisses, 1);
+    entry = cacheTakeEntry(cont, cluster);
+    if (!entry)
+        return NULL;
+
+    const u64 address = fat32GetClusterAddress(cont, cluster);
+    if (!fat32ReadAt(cont, address, entry->data, cache->clusterSize))
+    {
+        printf("Failed to read cluster %u: %s\n", cluster, strerror(errno));
+        cacheDropEntry(cache, entry);
+        return NULL;
+    }
+    return entry->data;
+}
+
+// Reads the uncached clusters of a chain from firstCluster on with one batch
+static void cachePrefetchChain(Fat32Context* cont, u32 firstCluster)
+{
+    Fat32Cache* cache = &cont->cache;
+    // Mapped images aren't read, concurrent readers don't use the cache
+    if (cont->map || (cont->isConcurrent && dirWriter != cont) || cacheLookup(cache, firstCluster))
+        return;
+
+    // Stay well below the capacity, so the batch doesn't evict itself
+    const u32 limit = umin(FAT32_IO_BATCH, cache->capacity / 2);
+    Fat32IoRequest requests[FAT32_IO_BATCH];
+    Fat32CacheEntry* entries[FAT32_IO_BATCH];
+    u32 count = 0;
+    ClusterPtr cluster = firstCluster;
+    for (u32 visited = 0; count < limit && visited <= cont->clusterCount; ++visited)
+    {
+        const u32 index = clusterPtrGetIndex(cluster);
+        if (index < 2 || index >= cont->clusterCount + 2)
+            break;
+        if (!cacheLookup(cache, index))
+        {
+            Fat32CacheEntry* entry = cacheTakeEntry(cont, index);
+            if (!entry)
+                break;
+            entries[count] = entry;
+            requests[count] = (Fat32IoRequest){
+                    .offset = fat32GetClusterAddress(cont, index),
+                    .data = entry->data,
+                    .size = cache->clusterSize,
+            };
+            ++count;
+        }
+        cluster = fatGetNextClusterPtr(cont, index);
+        if (clusterPtrIsNull(cluster) || clusterPtrIsLastCluster(cluster) || clusterPtrIsBadCluster(cluster))
+            break;
+    }
+
+    fat32Submit(cont, requests, count);
+    for (u32 i = 0; i < count; ++i)
+    {
+        // Failed clusters are read again, and reported, when they are used
+        if (!requests[i].isDone)
+            cacheDropEntry(cache, entries[i]);
+    }
+}
+
+u8* fat32CacheNewCluster(Fat32Context* cont, u32 cluster)
+{
+    if (cluster < 2 || cluster >= cont->clusterCount + 2)
+        return NULL;
+
+    Fat32Cache* cache = &cont->cache;
+    if (cont->map)
+    {
+        u8* data = cont->map + fat32GetClusterAddress(cont, cluster);
+        memset(data, 0, cache->clusterSize);
+        return data;
+    }
+
+    Fat32CacheEntry* entry = cacheLookup(cache, cluster);
+    if (entry)
+    {
+        cacheLruUnlink(cache, entry);
+        cacheLruPushFront(cache, entry);
+    }
+    else
+    {
+        entry = cacheTakeEntry(cont, cluster);
+        if (!entry)
+            return NULL;
+    }
+    memset(entry->data, 0, cache->clusterSize);
+    entry->isDirty = true;
+    return entry->data;
+}
+
+void fat32CacheMarkDirty(Fat32Context* cont, u32 cluster)
+{
+    // Mapped pages are tracked by the kernel
+    if (cont->map)
+        return;
+
+    Fat32CacheEntry* entry = cacheLookup(&cont->cache, cluster);
+    assert(entry && "Marking a cluster that is not cached");
+    entry->isDirty = true;
+}
+
+u32 fat32AddressToCluster(const Fat32Context* cont, u64 address)
+{
+    const u64 sector = address / cont->bpb->sectorSize;
+    return (sector - cont->firstDataSector) / cont->bpb->sectorsPerClusters + 2;
+}
+
+u64 fat32GetClusterAddress(const Fat32Context* cont, u32 cluster)
+{
+    return (u64)fat32GetFirstSectorOfCluster(cont, cluster) * cont->bpb->sectorSize;
+}
+
+// Pointer to the cached bytes at a data area address, NULL if it can't be read
+static u8* cacheGetAddress(Fat32Context* cont, u64 address, u32* clusterOut)
+{
+    const u32 cluster = fat32AddressToCluster(cont, address);
+    u8* data = fat32CacheGetCluster(cont, cluster);
+    if (clusterOut)
+        *clusterOut = cluster;
+    return data ? data + (address - fat32GetClusterAddress(cont, cluster)) : NULL;
+}
+
+// Last directory cluster a thread read in concurrent mode
+typedef struct ReaderBuffer
+{
+    const Fat32Context* cont;
+    u32 cluster;
+    u64 generation;
+    u32 capacity;
+    u8* data;
+} ReaderBuffer;
+
+static pthread_key_t readerBufferKey;
+static pthread_once_t readerBufferOnce = PTHREAD_ONCE_INIT;
+
+static void readerBufferFree(void* arg)
+{
+    ReaderBuffer* buffer = arg;
+    free(buffer->data);
+    free(buffer);
+}
+
+static void readerBufferKeyInit(void)
+{
+    pthread_key_create(&readerBufferKey, readerBufferFree);
+}
+
+// Like cacheGetAddress, but concurrent readers use their own copy of the cluster
+static const u8* readerGetAddress(Fat32Context* cont, u64 address, u32* clusterOut)
+{
+    if (!cont->isConcurrent || cont->map || dirWriter == cont)
+        return cacheGetAddress(cont, address, clusterOut);
+
+    const u32 cluster = fat32AddressToCluster(cont, address);
+    if (clusterOut)
+        *clusterOut = cluster;
+    if (cluster < 2 || cluster >= cont->clusterCount + 2)
+        return NULL;
+
+    pthread_once(&readerBufferOnce, readerBufferKeyInit);
+    ReaderBuffer* buffer = pthread_getspecific(readerBufferKey);
+    if (!buffer)
+    {
+        buffer = calloc(1, sizeof(ReaderBuffer));
+        assert(buffer);
+        statsAdd(&cont->stats.allocations, 1);
+        pthread_setspecific(readerBufferKey, buffer);
+    }
+
+    // Writers bump the generation after their clusters reach the disk
+    const u32 clusterSize = cont->cache.clusterSize;
+    const u64 generation = __atomic_load_n(&cont->dirGeneration, __ATOMIC_ACQUIRE);
+    if (buffer->cont != cont || buffer->cluster != cluster || buffer->generation != generation)
+    {
+        statsAdd(&cont->stats.cacheMisses, 1);
+        if (buffer->capacity < clusterSize)
+        {
+            free(buffer->data);
+            buffer->data = malloc(clusterSize);
+            assert(buffer->data);
+            statsAdd(&cont->stats.allocations, 1);
+            buffer->capacity = clusterSize;
+        }
+        buffer->cont = NULL;
+        if (!fat32ReadAt(cont, fat32GetClusterAddress(cont, cluster), buffer->data, clusterSize))
+        {
+            printf("Failed to read cluster %u: %s\n", cluster, strerror(errno));
+            return NULL;
+        }
+        buffer->cont = cont;
+        buffer->cluster = cluster;
+        buffer->generation = generation;
+    }
+    else
+    {
+        statsAdd(&cont->stats.cacheHits, 1);
+    }
+    return buffer->data + (address - fat32GetClusterAddress(cont, cluster));
+}
+
+// Directory write sections, see the locking notes at the top
+static void dirWriteBegin(Fat32Context* cont, u32 dirCluster)
+{
+    lockExclusive(cont, dirLock(cont, dirCluster));
+    lockMutex(cont, &cont->cacheLock);
+    lockExclusive(cont, &cont->nameIndexLock);
+    dirWriter = cont;
+}
+
+static bool dirWriteEnd(Fat32Context* cont, u32 dirCluster)
+{
+    bool isOk = true;
+    if (cont->isConcurrent)
+    {
+        // Readers don't look at the cache, the new entries have to be on the disk
+        if (!cont->map)
+            isOk = fat32CacheFlush(cont);
+        __atomic_add_fetch(&cont->dirGeneration, 1, __ATOMIC_RELEASE);
+    }
+    dirWriter = NULL;
+    unlockRw(cont, &cont->nameIndexLock);
+    unlockMutex(cont, &cont->cacheLock);
+    unlockRw(cont, dirLock(cont, dirCluster));
+    return isOk;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Long file name codec. Long names are UCS-2 on the disk and UTF-8 in the
+ * API, both directions work on caller buffers. Decoding copies runs of ASCII
+ * characters with vector packs and only falls back to one character at a
+ * time for the rest. Names are compared case-folded to upper case, which
+ * covers Latin-1, Latin Extended-A, Greek, Cyrillic and fullwidth Latin
+ * besides ASCII. Every mapping keeps the UTF-8 length, so folding works in place.
+ */
+
+// Next code point of a UTF-8 string, -1 for an invalid sequence. Moves str past it.
+static s32 utf8Next(const u8** str)
+{
+    const u8* s = *str;
+    u32 c = s[0];
+    u32 len = 1;
+    u32 min = 0;
+    if (c >= 0xf0 && c < 0xf5)
+    {
+        c &= 0x07;
+        len = 4;
+        min = 0x10000;
+    }
+    else if (c >= 0xe0 && c < 0xf0)
+    {
+        c &= 0x0f;
+        len = 3;
+        min = 0x800;
+    }
+    else if (c >= 0xc2 && c < 0xe0)
+    {
+        c &= 0x1f;
+        len = 2;
+        min = 0x80;
+    }
+    else if (c >= 0x80)
+    {
+        return -1;
+    }
+
+    for (u32 i = 1; i < len; ++i)
+    {
+        if ((s[i] & 0xc0) != 0x80)
+            return -1;
+        c = (c << 6) | (s[i] & 0x3f);
+    }
+    if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+        return -1;
+    *str = s + len;
+    return c;
+}
+
+// Writes a code point as UTF-8, returns its length
+static u32 utf8Put(u32 c, char* out)
+{
+    if (c < 0x80)
+    {
+        out[0] = c;
+        return 1;
+    }
+    if (c < 0x800)
+    {
+        out[0] = 0xc0 | (c >> 6);
+        out[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    if (c < 0x10000)
+    {
+        out[0] = 0xe0 | (c >> 12);
+        out[1] = 0x80 | ((c >> 6) & 0x3f);
+        out[2] = 0x80 | (c & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (c >> 18);
+    out[1] = 0x80 | ((c >> 12) & 0x3f);
+    out[2] = 0x80 | ((c >> 6) & 0x3f);
+    out[3] = 0x80 | (c & 0x3f);
+    return 4;
+}
+
+static u32 unicodeToUpper(u32 c)
+{
+    if (c < 0x80)
+        return (c >= 'a' && c <= 'z') ? c - 0x20 : c;
+    if (c >= 0xe0 && c <= 0xfe && c != 0xf7)
+        return c - 0x20;
+    if (c == 0xff)
+        return 0x178;
+    if (c >= 0x100 && c < 0x180)
+    {
+        // Pairs are upper case first, except in the two ranges that are shifted by one
+        const bool isShifted = (c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e);
+        const bool isPaired = (c <= 0x137 && c != 0x130 && c != 0x131) || (c >= 0x14a && c <= 0x177) || isShifted;
+        if (isPaired && (c & 1) == (isShifted ? 0 : 1))
+            return c - 1;
+        return c;
+    }
+    if (c >= 0x3b1 && c <= 0x3cb)
+        return c == 0x3c2 ? 0x3a3 : c - 0x20;
+    if (c == 0x3ac)
+        return 0x386;
+    if (c >= 0x3ad && c <= 0x3af)
+        return c - 0x25;
+    if (c == 0x3cc)
+        return 0x38c;
+    if (c == 0x3cd || c == 0x3ce)
+        return c - 0x3f;
+    if (c >= 0x430 && c <= 0x44f)
+        return c - 0x20;
+    if (c >= 0x450 && c <= 0x45f)
+        return c - 0x50;
+    if (((c >= 0x460 && c <= 0x481) || (c >= 0x48a && c <= 0x4bf)) && (c & 1))
+        return c - 1;
+    if (c >= 0xff41 && c <= 0xff5a)
+        return c - 0x20;
+    return c;
+}
+
+static void nameFold(const char* name, char* out, size_t outSize)
+{
+    const u8* in = (const u8*)name;
+    size_t len = 0;
+    while (*in && len + 1 < outSize)
+    {
+        if (*in < 0x80)
+        {
+            out[len++] = toupper(*in++);
+            continue;
+        }
+        const u8* next = in;
+        const s32 c = utf8Next(&next);
+        if (c < 0 || len + (next - in) >= outSize)
+        {
+            // Invalid bytes are compared as they are
+            out[len++] = *in++;
+            continue;
+        }
+        len += utf8Put(unicodeToUpper(c), out + len);
+        in = next;
+    }
+    out[len] = 0;
+}
+
+// Decodes count characters, or up to a terminator, one at a time
+static u32 ucs2ToUtf8Scalar(const u16* in, u32 count, u32* consumed, char* out, size_t outSize, bool* isEnd)
+{
+    size_t len = 0;
+    u32 i = 0;
+    for (; i < count; ++i)
+    {
+        u32 c = in[i];
+        if (c == 0 || c == 0xffff)
+        {
+            *isEnd = true;
+            break;
+        }
+        u32 used = 1;
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < count && in[i + 1] >= 0xdc00 && in[i + 1] < 0xe000)
+        {
+            c = 0x10000 + ((c - 0xd800) << 10) + (in[i + 1] - 0xdc00);
+            used = 2;
+        }
+        else if (c >= 0xd800 && c < 0xe000)
+        {
+            // Unpaired surrogate
+            c = 0xfffd;
+        }
+        char encoded[4];
+        const u32 encodedLen = utf8Put(c, encoded);
+        if (len + encodedLen >= outSize)
+        {
+            *isEnd = true;
+            break;
+        }
+        memcpy(out + len, encoded, encodedLen);
+        len += encodedLen;
+        i += used - 1;
+    }
+    *consumed = i;
+    return len;
+}
+
+#ifdef FAT32_SCAN_X86
+// Lengths of the ASCII prefix and the output, the prefix is a multiple of 8 characters
+__attribute__((target("sse2")))
+static u32 ucs2AsciiPrefixSse2(const u16* in, u32 count, char* out, size_t outSize)
+{
+    const __m128i nonAscii = _mm_set1_epi16((short)0xff80);
+    const __m128i zero = _mm_setzero_si128();
+    u32 i = 0;
+    for (; i + 8 <= count && i + 8 < outSize; i += 8)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+        // Stops at anything that isn't 0x01 to 0x7f, the terminator included
+        const __m128i isSlow = _mm_or_si128(_mm_cmpeq_epi16(v, zero),
+                                            _mm_xor_si128(_mm_cmpeq_epi16(_mm_and_si128(v, nonAscii), zero),
+                                                          _mm_set1_epi16(-1)));
+        if (_mm_movemask_epi8(isSlow))
+            break;
+        _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(v, v));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static u32 ucs2AsciiPrefixAvx2(const u16* in, u32 count, char* out, size_t outSize)
+{
+    const __m256i nonAscii = _mm256_set1_epi16((short)0xff80);
+    const __m256i zero = _mm256_setzero_si256();
+    u32 i = 0;
+    for (; i + 16 <= count && i + 16 < outSize; i += 16)
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(in + i));
+        const __m256i isSlow = _mm256_or_si256(_mm256_cmpeq_epi16(v, zero),
+                                               _mm256_xor_si256(_mm256_cmpeq_epi16(_mm256_and_si256(v, nonAscii), zero),
+                                                                _mm256_set1_epi16(-1)));
+        if (_mm256_movemask_epi8(isSlow))
+            break;
+        // Packing works per 128 bit lane, the permute puts the two halves next to each other
+        const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0xd8);
+        _mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(packed));
+    }
+    return i + ucs2AsciiPrefixSse2(in + i, count - i, out + i, outSize - i);
+}
+#endif
+
+u32 fat32Ucs2ToUtf8(const u16* in, u32 count, char* out, size_t outSize)
+{
+    if (outSize == 0)
+        return 0;
+
+    u32 (*asciiPrefix)(const u16*, u32, char*, size_t) = NULL;
+#ifdef FAT32_SCAN_X86
+    if (scanLevel() == SCAN_LEVEL_AVX2)
+        asciiPrefix = ucs2AsciiPrefixAvx2;
+    else if (scanLevel() == SCAN_LEVEL_SSE2)
+        asciiPrefix = ucs2AsciiPrefixSse2;
+#endif
+
+    size_t len = 0;
+    u32 i = 0;
+    bool isEnd = false;
+    while (i < count && !isEnd)
+    {
+        if (asciiPrefix)
+        {
+            const u32 ascii = asciiPrefix(in + i, count - i, out + len, outSize - len);
+            i += ascii;
+            len += ascii;
+        }
+        // The vector kernels stopped somewhere in the next 16 characters, which must not split a surrogate pair
+        u32 chunk = umin(count - i, 16);
+        if (chunk < count - i && in[i + chunk - 1] >= 0xd800 && in[i + chunk - 1] < 0xdc00)
+            ++chunk;
+        u32 consumed;
+        len += ucs2ToUtf8Scalar(in + i, chunk, &consumed, out + len, outSize - len, &isEnd);
+        i += consumed;
+    }
+    out[len] = 0;
+    return len;
+}
+
+s32 fat32Utf8ToUcs2(const char* in, u16* out, u32 outCount)
+{
+    const u8* s = (const u8*)in;
+    u32 count = 0;
+    while (*s)
+    {
+        if (*s < 0x80)
+        {
+            if (count == outCount)
+                return -1;
+            out[count++] = *s++;
+            continue;
+        }
+        // U+FFFF pads the last long name fragment, a name can't hold it
+        const s32 c = utf8Next(&s);
+        if (c < 0 || c == 0xffff || count + (c >= 0x10000 ? 2 : 1) > outCount)
+            return -1;
+        if (c >= 0x10000)
+        {
+            out[count++] = 0xd800 + ((c - 0x10000) >> 10);
+            out[count++] = 0xdc00 + ((c - 0x10000) & 0x3ff);
+        }
+        else
+        {
+            out[count++] = c;
+        }
+    }
+    return count;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Per-directory name index. It is built on the first lookup in a directory
+ * and maps case-folded long and 8.3 names to the address of the short entry.
+ * Names live in one pool per index, so building and probing don't allocate
+ * per entry.
+ */
+
+#define NAME_INDEX_NONE 0xffffffff
+
+static u32 nameIndexHash(const char* foldedName)
+{
+    // FNV-1a, 0 marks an empty slot
+    u32 hash = 2166136261u;
+    for (const u8* c = (const u8*)foldedName; *c; ++c)
+        hash = (hash ^ *c) * 16777619u;
+    return hash ? hash : 1;
+}
+
+static u32 nameIndexPoolAdd(Fat32Context* cont, Fat32NameIndex* index, const char* str)
+{
+    const u32 len = strlen(str) + 1;
+    if (index->poolSize + len > index->poolCapacity)
+    {
+        index->poolCapacity = (index->poolCapacity + len) * 2;
+        index->pool = realloc(index->pool, index->poolCapacity);
+        assert(index->pool);
+        statsAdd(&cont->stats.allocations, 1);
+    }
+    const u32 offset = index->poolSize;
+    memcpy(index->pool + offset, str, len);
+    index->poolSize += len;
+    return offset;
+}
+
+static Fat32NameIndexSlot* nameIndexProbe(Fat32NameIndex* index, const char* foldedName, u32 hash)
+{
+    const u32 mask = index->slotCount - 1;
+    for (u32 i = hash & mask;; i = (i + 1) & mask)
+    {
+        Fat32NameIndexSlot* slot = &index->slots[i];
+        if (slot->hash == 0
+            || (slot->hash == hash && strcmp(index->pool + slot->nameOffset, foldedName) == 0))
+        {
+            return slot;
+        }
+    }
+}
+
+static void nameIndexGrow(Fat32Context* cont, Fat32NameIndex* index)
+{
+    Fat32NameIndexSlot* oldSlots = index->slots;
+    const u32 oldCount = index->slotCount;
+    index->slotCount = oldCount ? oldCount * 2 : 64;
+    index->slots = calloc(index->slotCount, sizeof(Fat32NameIndexSlot));
+    assert(index->slots);
+    statsAdd(&cont->stats.allocations, 1);
+
+    const u32 mask = index->slotCount - 1;
+    for (u32 i = 0; i < oldCount; ++i)
+    {
+        if (oldSlots[i].hash == 0)
+            continue;
+        u32 j = oldSlots[i].hash & mask;
+        while (index->slots[j].hash != 0)
+            j = (j + 1) & mask;
+        index->slots[j] = oldSlots[i];
+    }
+    free(oldSlots);
+}
+
+// Adds one key, the first entry with a given name wins like in a linear scan
+static void nameIndexInsertKey(Fat32Context* cont, Fat32NameIndex* index, const char* name, u32 longNameOffset, u64 address)
+{
+    char folded[LFE_FULL_NAME_LEN + 1];
+    nameFold(name, folded, sizeof(folded));
+    if (folded[0] == 0)
+        return;
+
+    // Keep the load factor under 1/2
+    if ((index->used + 1) * 2 > index->slotCount)
+        nameIndexGrow(cont, index);
+
+    const u32 hash = nameIndexHash(folded);
+    Fat32NameIndexSlot* slot = nameIndexProbe(index, folded, hash);
+    if (slot->hash != 0)
+        return;
+
+    slot->hash = hash;
+    slot->nameOffset = nameIndexPoolAdd(cont, index, folded);
+    slot->longNameOffset = longNameOffset;
+    slot->address = address;
+    ++index->used;
+}
+
+static void nameIndexInsertEntry(Fat32Context* cont, Fat32NameIndex* index, const DirectoryEntry* entry, const char* longFilename, u64 address)
+{
+    u32 longNameOffset = NAME_INDEX_NONE;
+    if (longFilename && longFilename[0])
+    {
+        longNameOffset = nameIndexPoolAdd(cont, index, longFilename);
+        nameIndexInsertKey(cont, index, longFilename, longNameOffset, address);
+    }
+
+    // The 8.3 name is a key too, even when there is a long name
+    char shortName[DIRENTRY_FILENAME_LEN + 2];
+    directoryEntryGetShortName(entry, shortName);
+    nameIndexInsertKey(cont, index, shortName, longNameOffset, address);
+}
+
+static void nameIndexClear(Fat32NameIndex* index)
+{
+    free(index->slots);
+    free(index->pool);
+    memset(index, 0, sizeof(Fat32NameIndex));
+}
+
+static Fat32NameIndex* nameIndexFind(Fat32Context* cont, u32 dirCluster)
+{
+    for (u32 i = 0; i < FAT32_NAME_INDEX_DIRS; ++i)
+    {
+        Fat32NameIndex* index = &cont->nameIndexes[i];
+        if (index->dirCluster == dirCluster && index->slots)
+        {
+            // Probes only hold the name index lock shared
+            __atomic_store_n(&index->lastUse, __atomic_add_fetch(&cont->nameIndexClock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+            return index;
+        }
+    }
+    return NULL;
+}
+
+static bool iteratorNextRecord(Fat32Context* cont, DirectoryIterator* it, DirectoryIteratorRecord* out);
+
+// Needs the name index lock exclusive
+static Fat32NameIndex* nameIndexBuild(Fat32Context* cont, u64 dirAddress)
+{
+    // Reuse the least recently used index
+    Fat32NameIndex* index = &cont->nameIndexes[0];
+    for (u32 i = 1; i < FAT32_NAME_INDEX_DIRS; ++i)
+    {
+        if (cont->nameIndexes[i].lastUse < index->lastUse)
+            index = &cont->nameIndexes[i];
+    }
+    nameIndexClear(index);
+    index->dirCluster = fat32AddressToCluster(cont, dirAddress);
+    index->lastUse = __atomic_add_fetch(&cont->nameIndexClock, 1, __ATOMIC_RELAXED);
+    nameIndexGrow(cont, index);
+
+    DirectoryIterator it;
+    directoryIteratorInit(&it, dirAddress);
+    DirectoryIteratorRecord record;
+    while (iteratorNextRecord(cont, &it, &record))
+    {
+        nameIndexInsertEntry(cont, index, &record.entry, record.longFilename, record.address);
+    }
+    return index;
+}
+
+// Needs the name index lock exclusive
+static void nameIndexDrop(Fat32Context* cont, u32 dirCluster)
+{
+    for (u32 i = 0; i < FAT32_NAME_INDEX_DIRS; ++i)
+    {
+        if (cont->nameIndexes[i].dirCluster == dirCluster)
+            nameIndexClear(&cont->nameIndexes[i]);
+    }
+}
+
+void fat32NameIndexInvalidate(Fat32Context* cont, u32 dirCluster)
+{
+    nameIndexLockExclusive(cont);
+    nameIndexDrop(cont, dirCluster);
+    nameIndexUnlock(cont);
+}
+
+// Keeps an already built index in sync with a new entry, called by directory writers
+static void nameIndexAddEntry(Fat32Context* cont, u64 dirAddress, const DirectoryEntry* entry, const char* longFilename, u64 address)
+{
+    Fat32NameIndex* index = nameIndexFind(cont, fat32AddressToCluster(cont, dirAddress));
+    if (index)
+        nameIndexInsertEntry(cont, index, entry, longFilename, address);
+}
+
+static void nameIndexFreeAll(Fat32Context* cont)
+{
+    for (u32 i = 0; i < FAT32_NAME_INDEX_DIRS; ++i)
+        nameIndexClear(&cont->nameIndexes[i]);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Dentry cache for path resolution. Keys are either a whole normalized path
+ * (parentCluster 0) or a single name inside a directory (parentCluster of
+ * that directory), both case-folded. Positive entries keep the address of
+ * the short entry, which is re-read on a hit so sizes are never stale.
+ * Negative entries are tagged with a generation that every create bumps,
+ * so they can't outlive a new name. Lookups copy hits out under dentryLock
+ * and tag their inserts with the generation they started at.
+ */
+
+typedef struct DentryHit
+{
+    bool isNegative;
+    u64 address;
+    u32 dirCluster;
+    char longFilename[LFE_FULL_NAME_LEN + 1];
+} DentryHit;
+
+static u32 dentryHash(u32 parentCluster, const char* key)
+{
+    return nameIndexHash(key) ^ (parentCluster * 2654435761u);
+}
+
+static void dentryLruUnlink(Fat32DentryCache* cache, Fat32Dentry* dentry)
+{
+    if (dentry->prev)
+        dentry->prev->next = dentry->next;
+    else
+        cache->lruHead = dentry->next;
+    if (dentry->next)
+        dentry->next->prev = dentry->prev;
+    else
+        cache->lruTail = dentry->prev;
+    dentry->prev = dentry->next = NULL;
+}
+
+static void dentryLruPushFront(Fat32DentryCache* cache, Fat32Dentry* dentry)
+{
+    dentry->prev = NULL;
+    dentry->next = cache->lruHead;
+    if (cache->lruHead)
+        cache->lruHead->prev = dentry;
+    cache->lruHead = dentry;
+    if (!cache->lruTail)
+        cache->lruTail = dentry;
+}
+
+static void dentryRemove(Fat32DentryCache* cache, Fat32Dentry* dentry)
+{
+    Fat32Dentry** link = &cache->buckets[dentry->hash & (FAT32_DENTRY_BUCKETS - 1)];
+    while (*link != dentry)
+        link = &(*link)->hashNext;
+    *link = dentry->hashNext;
+    dentryLruUnlink(cache, dentry);
+    free(dentry->key);
+    free(dentry->longFilename);
+    free(dentry);
+    --cache->count;
+}
+
+static Fat32Dentry* dentryLookup(Fat32DentryCache* cache, u32 parentCluster, const char* key)
+{
+    const u32 hash = dentryHash(parentCluster, key);
+    Fat32Dentry* dentry = cache->buckets[hash & (FAT32_DENTRY_BUCKETS - 1)];
+    for (; dentry; dentry = dentry->hashNext)
+    {
+        if (dentry->hash == hash && dentry->parentCluster == parentCluster && strcmp(dentry->key, key) == 0)
+            break;
+    }
+    if (!dentry)
+        return NULL;
+
+    // A negative path entry from before the last create is stale
+    if (dentry->isNegative && dentry->generation != cache->generation)
+    {
+        dentryRemove(cache, dentry);
+        return NULL;
+    }
+    dentryLruUnlink(cache, dentry);
+    dentryLruPushFront(cache, dentry);
+    return dentry;
+}
+
+static void dentryInsert(Fat32Context* cont, u32 parentCluster, const char* key, const DirectoryIteratorEntry* resolved,
+                         u32 dirCluster, u64 generation)
+{
+    Fat32DentryCache* cache = &cont->dentryCache;
+    Fat32Dentry* dentry = dentryLookup(cache, parentCluster, key);
+    if (dentry)
+        dentryRemove(cache, dentry);
+    if (cache->count >= FAT32_DENTRY_CACHE_SIZE)
+        dentryRemove(cache, cache->lruTail);
+
+    dentry = calloc(1, sizeof(Fat32Dentry));
+    assert(dentry);
+    dentry->hash = dentryHash(parentCluster, key);
+    dentry->parentCluster = parentCluster;
+    dentry->key = strdup(key);
+    statsAdd(&cont->stats.allocations, 2);
+    dentry->generation = generation;
+    dentry->isNegative = resolved == NULL;
+    if (resolved)
+    {
+        dentry->address = resolved->address;
+        dentry->dirCluster = dirCluster;
+        if (resolved->longFilename[0])
+        {
+            dentry->longFilename = strdup(resolved->longFilename);
+            statsAdd(&cont->stats.allocations, 1);
+        }
+    }
+
+    Fat32Dentry** bucket = &cache->buckets[dentry->hash & (FAT32_DENTRY_BUCKETS - 1)];
+    dentry->hashNext = *bucket;
+    *bucket = dentry;
+    dentryLruPushFront(cache, dentry);
+    ++cache->count;
+}
+
+static u64 dentryGeneration(Fat32Context* cont)
+{
+    lockMutex(cont, &cont->dentryLock);
+    const u64 generation = cont->dentryCache.generation;
+    unlockMutex(cont, &cont->dentryLock);
+    return generation;
+}
+
+static bool dentryGet(Fat32Context* cont, u32 parentCluster, const char* key, DentryHit* hit)
+{
+    lockMutex(cont, &cont->dentryLock);
+    const Fat32Dentry* dentry = dentryLookup(&cont->dentryCache, parentCluster, key);
+    if (dentry)
+    {
+        hit->isNegative = dentry->isNegative;
+        hit->address = dentry->address;
+        hit->dirCluster = dentry->dirCluster;
+        hit->longFilename[0] = 0;
+        if (dentry->longFilename)
+            snprintf(hit->longFilename, sizeof(hit->longFilename), "%s", dentry->longFilename);
+    }
+    unlockMutex(cont, &cont->dentryLock);
+    return dentry != NULL;
+}
+
+static void dentryPut(Fat32Context* cont, u32 parentCluster, const char* key, const DirectoryIteratorEntry* resolved,
+                      u32 dirCluster, u64 generation)
+{
+    lockMutex(cont, &cont->dentryLock);
+    dentryInsert(cont, parentCluster, key, resolved, dirCluster, generation);
+    unlockMutex(cont, &cont->dentryLock);
+}
+
+static DirectoryIteratorEntry* newIteratorEntry(Fat32Context* cont, const u8* data, u64 address, const char* longFilename)
+{
+    statsAdd(&cont->stats.allocations, 3);
+    DirectoryIteratorEntry* result = malloc(sizeof(DirectoryIteratorEntry));
+    assert(result);
+    result->entry = malloc(sizeof(DirectoryEntry));
+    memcpy(result->entry, data, sizeof(DirectoryEntry));
+    result->address = address;
+    // Sized to the name, long names can be several times longer than most
+    const size_t len = longFilename ? strnlen(longFilename, LFE_FULL_NAME_LEN) : 0;
+    result->longFilename = malloc(len + 1);
+    assert(result->longFilename);
+    memcpy(result->longFilename, longFilename ? longFilename : "", len);
+    result->longFilename[len] = 0;
+    return result;
+}
+
+static DirectoryIteratorEntry* dentryToEntry(Fat32Context* cont, const DentryHit* hit)
+{
+    pthread_rwlock_t* lock = dirLock(cont, hit->dirCluster);
+    lockShared(cont, lock);
+    const u8* data = readerGetAddress(cont, hit->address, NULL);
+    DirectoryIteratorEntry* result = data
+            ? newIteratorEntry(cont, data, hit->address, hit->longFilename[0] ? hit->longFilename : NULL)
+            : NULL;
+    unlockRw(cont, lock);
+    return result;
+}
+
+// Called after a name is added to a directory
+static void dentryOnCreate(Fat32Context* cont, u32 parentCluster, const char* name)
+{
+    Fat32DentryCache* cache = &cont->dentryCache;
+    char folded[LFE_FULL_NAME_LEN + 1];
+    nameFold(name, folded, sizeof(folded));
+    lockMutex(cont, &cont->dentryLock);
+    Fat32Dentry* dentry = dentryLookup(cache, parentCluster, folded);
+    if (dentry)
+        dentryRemove(cache, dentry);
+    ++cache->generation;
+    unlockMutex(cont, &cont->dentryLock);
+}
+
+void fat32DentryCacheClear(Fat32Context* cont)
+{
+    Fat32DentryCache* cache = &cont->dentryCache;
+    lockMutex(cont, &cont->dentryLock);
+    while (cache->lruHead)
+        dentryRemove(cache, cache->lruHead);
+    ++cache->generation;
+    unlockMutex(cont, &cont->dentryLock);
+}
+
+//------------------------------------------------------------------------------
+
+u32 clusterPtrGetIndex(ClusterPtr ptr)
+{
+    return ptr & 0x0fffffff;
+}
+
+bool clusterPtrIsBadCluster(ClusterPtr ptr)
+{
+    return clusterPtrGetIndex(ptr) == 0x0ffffff7;
+}
+
+bool clusterPtrIsLastCluster(ClusterPtr ptr)
+{
+    return clusterPtrGetIndex(ptr) >= 0x0ffffff8;
+}
+
+bool clusterPtrIsNull(ClusterPtr ptr)
+{
+    return clusterPtrGetIndex(ptr) == 0;
+}
+
+u32 fatGetNextClusterPtr(const Fat32Context* cont, ClusterPtr current)
+{
+    const u32 fatOffset = clusterPtrGetIndex(current) * 4;
+    // Entries change under concurrent readers one aligned word at a time
+    return __atomic_load_n((const u32*)&cont->fat[fatOffset], __ATOMIC_RELAXED);
+}
+
+static void fatSetNext(Fat32Context* cont, ClusterPtr current, ClusterPtr next, bool isAllocLocked)
+{
+    const u32 cluster = clusterPtrGetIndex(current);
+    u32* entry = (u32*)&cont->fat[cluster * 4];
+    pthread_mutex_t* regionLock = fatLock(cont, cluster);
+    lockMutex(cont, regionLock);
+    const u32 old = *entry;
+    // The 4 most significant bits are reserved and must be preserved
+    __atomic_store_n(entry, (old & 0xf0000000) | clusterPtrGetIndex(next), __ATOMIC_RELAXED);
+    unlockMutex(cont, regionLock);
+    __atomic_store_n(&cont->isFatModified, true, __ATOMIC_RELAXED);
+    const u32 sector = cluster * 4 / cont->bpb->sectorSize;
+    __atomic_fetch_or(&cont->fatDirty[sector / 64], 1ULL << (sector % 64), __ATOMIC_RELAXED);
+
+    // Clusters only become used while allocLock is held, so the free map can trail the FAT here
+    if (cluster >= 2 && cluster < cont->clusterCount + 2 && clusterPtrIsNull(old) != clusterPtrIsNull(next))
+    {
+        if (!isAllocLocked)
+            lockMutex(cont, &cont->allocLock);
+        freeMapSet(&cont->freeMap, cluster, clusterPtrIsNull(next));
+        cont->fsinfo->freeCount = cont->freeMap.freeCount;
+        cont->isFsinfoModified = true;
+        if (!isAllocLocked)
+            unlockMutex(cont, &cont->allocLock);
+    }
+}
+
+void fatSetNextClusterPtr(Fat32Context* cont, ClusterPtr current, ClusterPtr next)
+{
+    fatSetNext(cont, current, next, false);
+}
+
+u32 findFreeCluster(Fat32Context* cont)
+{
+    return freeMapFind(&cont->freeMap, cont->freeMap.hint);
+}
+
+static u32 allocateClusters(Fat32Context* cont, u32 count, u32 after);
+
+u32 fat32AllocateClusters(Fat32Context* cont, u32 count)
+{
+    lockMutex(cont, &cont->allocLock);
+    const u32 first = allocateClusters(cont, count, 0);
+    unlockMutex(cont, &cont->allocLock);
+    return first;
+}
+
+// Chains the free run [first, first + count) in order and links its last cluster to next,
+// taking each FAT region lock once. Needs allocLock.
+static void fatSetRun(Fat32Context* cont, u32 first, u32 count, ClusterPtr next)
+{
+    u32* fat = (u32*)cont->fat;
+    const u32 end = first + count;
+    u32 cluster = first;
+    while (cluster < end)
+    {
+        const u32 regionEnd = umin((cluster / FAT32_FAT_LOCK_REGION + 1) * FAT32_FAT_LOCK_REGION, end);
+        pthread_mutex_t* regionLock = fatLock(cont, cluster);
+        lockMutex(cont, regionLock);
+        for (; cluster < regionEnd; ++cluster)
+        {
+            const u32 target = cluster + 1 == end ? clusterPtrGetIndex(next) : cluster + 1;
+            // The 4 most significant bits are reserved and must be preserved
+            __atomic_store_n(&fat[cluster], (fat[cluster] & 0xf0000000) | target, __ATOMIC_RELAXED);
+        }
+        unlockMutex(cont, regionLock);
+    }
+
+    const u32 sectorSize = cont->bpb->sectorSize;
+    for (u32 sector = first * 4 / sectorSize; sector <= (end - 1) * 4 / sectorSize; ++sector)
+        __atomic_fetch_or(&cont->fatDirty[sector / 64], 1ULL << (sector % 64), __ATOMIC_RELAXED);
+    __atomic_store_n(&cont->isFatModified, true, __ATOMIC_RELAXED);
+
+    freeMapSetUsedRange(&cont->freeMap, first, end);
+    cont->fsinfo->freeCount = cont->freeMap.freeCount;
+    cont->isFsinfoModified = true;
+}
+
+// A chain growing from cluster after continues right behind it when those clusters are free
+static u32 allocateClusters(Fat32Context* cont, u32 count, u32 after)
+{
+    if (count == 0 || count > cont->freeMap.freeCount)
+    {
+        return 0;
+    }
+
+    const u32 end = cont->clusterCount + 2;
+    u32 first = 0;
+    if (after >= 2 && (u64)after + 1 + count <= end
+        && freeMapNextUsed(&cont->freeMap, after + 1, after + 1 + count) == after + 1 + count)
+        first = after + 1;
+
+    // One run if the volume has one, otherwise the free runs from the hint on are
+    // taken in address order, each as far as it goes, until the count is reached
+    if (!first)
+        first = freeMapFindRun(&cont->freeMap, count, cont->freeMap.hint, cont->allocPolicy);
+    if (first)
+    {
+        fatSetRun(cont, first, count, 0x0fffffff);
+        cont->freeMap.hint = first + count;
+    }
+    else
+    {
+        u32 remaining = count;
+        u32 previousLast = 0;
+        while (remaining)
+        {
+            const u32 runStart = freeMapFind(&cont->freeMap, cont->freeMap.hint);
+            assert(runStart != 0);
+            const u32 runEnd = freeMapNextUsed(&cont->freeMap, runStart, umin((u64)runStart + remaining, end));
+            const u32 length = runEnd - runStart;
+            fatSetRun(cont, runStart, length, 0x0fffffff);
+            if (previousLast)
+                fatSetNext(cont, previousLast, runStart, true);
+            else
+                first = runStart;
+            previousLast = runStart + length - 1;
+            remaining -= length;
+            cont->freeMap.hint = runStart + length;
+        }
+    }
+
+    cont->fsinfo->nextFree = cont->freeMap.hint < cont->clusterCount + 2 ? cont->freeMap.hint : 2;
+    cont->isFsinfoModified = true;
+    statsAdd(&cont->stats.clustersAllocated, count);
+    return first;
+}
+
+// A single run of count clusters searched from the hint, 0 if there is none.
+// A hint of 0 takes the allocation hint, which is only read under allocLock.
+static u32 allocateExtent(Fat32Context* cont, u32 count, u32 hint, Fat32AllocPolicy policy)
+{
+    lockMutex(cont, &cont->allocLock);
+    const u32 first = freeMapFindRun(&cont->freeMap, count, hint ? hint : cont->freeMap.hint, policy);
+    if (first)
+    {
+        fatSetRun(cont, first, count, 0x0fffffff);
+        cont->freeMap.hint = first + count;
+        cont->fsinfo->nextFree = cont->freeMap.hint < cont->clusterCount + 2 ? cont->freeMap.hint : 2;
+        statsAdd(&cont->stats.clustersAllocated, count);
+    }
+    unlockMutex(cont, &cont->allocLock);
+    return first;
+}
+
+u32 fat32AllocateExtent(Fat32Context* cont, u32 count, Fat32AllocPolicy policy)
+{
+    return allocateExtent(cont, count, 0, policy);
+}
+
+void fat32SetAllocPolicy(Fat32Context* cont, Fat32AllocPolicy policy)
+{
+    lockMutex(cont, &cont->allocLock);
+    cont->allocPolicy = policy;
+    unlockMutex(cont, &cont->allocLock);
+}
+
+u32 fat32AllocateCluster(Fat32Context* cont)
+{
+    return fat32AllocateClusters(cont, 1);
+}
+
+void fat32FreeClusterChain(Fat32Context* cont, u32 firstCluster)
+{
+    lockMutex(cont, &cont->allocLock);
+    ClusterPtr current = firstCluster;
+    u32 freed = 0;
+    while (!clusterPtrIsNull(current)
+           && !clusterPtrIsLastCluster(current)
+           && !clusterPtrIsBadCluster(current)
+           && clusterPtrGetIndex(current) < cont->clusterCount + 2
+           && freed <= cont->clusterCount)
+    {
+        const ClusterPtr next = fatGetNextClusterPtr(cont, current);
+        fatSetNext(cont, current, 0, true);
+        current = next;
+        ++freed;
+    }
+    unlockMutex(cont, &cont->allocLock);
+    statsAdd(&cont->stats.clustersFreed, freed);
+}
+
+bool directoryEntryIsVolumeLabel(const DirectoryEntry* entry)
+{
+    if (!directoryEntryIsLFE(entry->attributes)
+        && (entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY)) == DIRENTRY_ATTR_VOLUME_ID)
+    {
+        assert(entry->entryFirstClusterNum1 == 0);
+        assert(entry->entryFirstClusterNum2 == 0);
+        return true;
+    }
+    return false;
+}
+
+bool directoryEntryIsLFE(u8 attrs)
+{
+    return (attrs & DIRENTRY_MASK_LONG_NAME) == DIRENTRY_ATTR_LONG_NAME;
+}
+
+bool directoryEntryIsDirectory(const DirectoryEntry* entry)
+{
+    if (!directoryEntryIsLFE(entry->attributes)
+        && (entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY)) == DIRENTRY_ATTR_DIRECTORY)
+    {
+        assert(entry->fileSize == 0);
+        return true;
+    }
+    return false;
+}
+
+bool directoryEntryIsFile(const DirectoryEntry* entry)
+{
+    return (!directoryEntryIsLFE(entry->attributes)
+            && (entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY))) == 0;
+}
+
+bool directoryEntryIsEmpty(const DirectoryEntry* entry)
+{
+    return clusterPtrIsNull(directoryEntryGetClusterPtr(entry));
+}
+
+u32 directoryEntryGetClusterPtr(const DirectoryEntry* entry)
+{
+    return ((u32)entry->entryFirstClusterNum1 << 16)
+           | (u32)entry->entryFirstClusterNum2;
+}
+
+u32 directoryEntryGetFirstClusterNumber(const DirectoryEntry* input)
+{
+    return clusterPtrGetIndex(directoryEntryGetClusterPtr(input));
+}
+
+u64 directoryEntryGetDataAddress(const Fat32Context* cont, const DirectoryEntry* entry)
+{
+    return fat32GetClusterAddress(cont, directoryEntryGetFirstClusterNumber(entry));
+}
+
+char* directoryEntryAttrsToString(u8 attrs)
+{
+    char* str = malloc(7);
+
+    if (directoryEntryIsLFE(attrs))
+    {
+        strncpy(str, "__LFE_", 7);
+        return str;
+    }
+
+    str[0] = (attrs & DIRENTRY_ATTR_READONLY)  ? 'R' : '-';
+    str[1] = (attrs & DIRENTRY_ATTR_HIDDEN)    ? 'H' : '-';
+    str[2] = (attrs & DIRENTRY_ATTR_SYSTEM)    ? 'S' : '-';
+    str[3] = (attrs & DIRENTRY_ATTR_VOLUME_ID) ? 'V' : '-';
+    str[4] = (attrs & DIRENTRY_ATTR_DIRECTORY) ? 'D' : '-';
+    str[5] = (attrs & DIRENTRY_ATTR_ARCHIVE)   ? 'A' : '-';
+    str[6] = 0;
+    return str;
+}
+
+//------------------------------------------------------------------------------
+
+static void extentMapPush(Fat32Context* cont, Fat32ExtentMap* map, u32 fileCluster, u32 startCluster)
+{
+    if (map->count == map->capacity)
+    {
+        map->capacity = map->capacity ? map->capacity * 2 : 8;
+        map->extents = realloc(map->extents, map->capacity * sizeof(Fat32Extent));
+        assert(map->extents);
+        statsAdd(&cont->stats.allocations, 1);
+    }
+    Fat32Extent* extent = &map->extents[map->count++];
+    extent->fileCluster = fileCluster;
+    extent->startCluster = startCluster;
+    extent->length = 1;
+}
+
+bool fat32ExtentMapBuild(Fat32Context* cont, u32 firstCluster, Fat32ExtentMap* map)
+{
+    memset(map, 0, sizeof(Fat32ExtentMap));
+    ClusterPtr current = firstCluster;
+    while (!clusterPtrIsNull(current) && !clusterPtrIsLastCluster(current))
+    {
+        const u32 cluster = clusterPtrGetIndex(current);
+        // Bad clusters, pointers outside the volume and loops end the chain as corrupted
+        if (clusterPtrIsBadCluster(current) || cluster < 2 || cluster >= cont->clusterCount + 2
+            || map->clusterCount >= cont->clusterCount)
+        {
+            return false;
+        }
+
+        Fat32Extent* last = map->count ? &map->extents[map->count - 1] : NULL;
+        if (last && last->startCluster + last->length == cluster)
+            ++last->length;
+        else
+            extentMapPush(cont, map, map->clusterCount, cluster);
+        ++map->clusterCount;
+
+        current = fatGetNextClusterPtr(cont, cluster);
+    }
+    return true;
+}
+
+void fat32ExtentMapFree(Fat32ExtentMap* map)
+{
+    free(map->extents);
+    memset(map, 0, sizeof(Fat32ExtentMap));
+}
+
+// Index of the extent holding the given cluster of the file, count if past the end
+u32 fat32ExtentMapFind(const Fat32ExtentMap* map, u32 fileCluster)
+{
+    u32 low = 0;
+    u32 high = map->count;
+    while (low < high)
+    {
+        const u32 mid = (low + high) / 2;
+        const Fat32Extent* extent = &map->extents[mid];
+        if (fileCluster < extent->fileCluster)
+            high = mid;
+        else if (fileCluster >= extent->fileCluster + extent->length)
+            low = mid + 1;
+        else
+            return mid;
+    }
+    return map->count;
+}
+
+u64 fat32ExtentMapRead(Fat32Context* cont, const Fat32ExtentMap* map, u64 offset, u8* buffer, u64 size)
+{
+    const u32 clusterSizeBytes = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize;
+    u64 done = 0;
+    u32 i = fat32ExtentMapFind(map, offset / clusterSizeBytes);
+    // One read per contiguous run, submitted in batches
+    while (i < map->count && done < size)
+    {
+        Fat32IoRequest requests[FAT32_IO_BATCH];
+        u32 count = 0;
+        u64 planned = done;
+        for (; i < map->count && planned < size && count < FAT32_IO_BATCH; ++i)
+        {
+            const Fat32Extent* extent = &map->extents[i];
+            const u64 extentStart = (u64)extent->fileCluster * clusterSizeBytes;
+            const u64 extentSize = (u64)extent->length * clusterSizeBytes;
+            const u64 skip = offset + planned - extentStart;
+            const u64 chunk = umin(extentSize - skip, size - planned);
+            requests[count++] = (Fat32IoRequest){
+                    .offset = fat32GetClusterAddress(cont, extent->startCluster) + skip,
+                    .data = buffer + planned,
+                    .size = chunk,
+            };
+            planned += chunk;
+        }
+
+        fat32Submit(cont, requests, count);
+        // Only what comes before the first failure counts
+        for (u32 j = 0; j < count && requests[j].isDone; ++j)
+            done += requests[j].size;
+        if (done < planned)
+            break;
+    }
+    return done;
+}
+
+u64 directoryEntryReadFileData(Fat32Context* cont, const DirectoryEntry* entry, u8* buffer, size_t bufferSize)
+{
+    assert(directoryEntryIsFile(entry));
+
+    // Don't do anything if the file is empty
+    // or it is on a bad cluster
+    if (directoryEntryIsEmpty(entry) || clusterPtrIsBadCluster(directoryEntryGetClusterPtr(entry)))
+    {
+        return 0;
+    }
+
+    Fat32ExtentMap map;
+    if (!fat32ExtentMapBuild(cont, directoryEntryGetFirstClusterNumber(entry), &map))
+    {
+        printf("Corrupted cluster chain at cluster %u\n", directoryEntryGetFirstClusterNumber(entry));
+    }
+
+    // Whatever could be mapped is still readable
+    const u64 size = umin(bufferSize, entry->fileSize);
+    const u64 readBytes = fat32ExtentMapRead(cont, &map, 0, buffer, size);
+    fat32ExtentMapFree(&map);
+    return readBytes;
+}
+
+DirectoryEntryTime toDirectoryEntryTime(u16 input)
+{
+    DirectoryEntryTime time =
+            {
+            .hour = (input & 0xf800) >> 11,
+            .min  = (input & 0x07e0) >> 5,
+            .sec  = (input & 0x001f) * 2
+    };
+    return time;
+}
+
+char* directoryEntryTimeToString(const DirectoryEntryTime* input)
+{
+    char* buffer = malloc(9);
+    if (input->hour > 23
+        || input->min > 59
+        || input->sec > 59
+        || snprintf(buffer, 9, "%02i:%02i:%02i", input->hour+1, input->min+1, input->sec) > 8)
+    {
+        // If no space for time, fill the output with ?s
+        strcpy(buffer, "\?\?:\?\?:\?\?");
+    }
+    return buffer;
+}
+
+
+DirectoryEntryDate toDirectoryEntryDate(u16 input)
+{
+    DirectoryEntryDate date = {
+            .year  = (input & 0xfe00) >> 9,
+            .month = (input & 0x01e0) >> 5,
+            .day   = (input & 0x001f)
+    };
+    return date;
+}
+
+char* directoryEntryDateToString(const DirectoryEntryDate* input)
+{
+    char* buffer = malloc(11);
+    if (input->month == 0 || input->month > 12
+        || input->day == 0 || input->day > 31
+        || snprintf(buffer, 11, "%04i-%02i-%02i", 1980+input->year, input->month, input->day) > 10)
+    {
+        // If invalid, fill the output with ?s
+        strcpy(buffer, "\?\?\?\?-\?\?-\?\?");
+    }
+    return buffer;
+}
+
+// Gathers the three pieces of a fragment's name
+static void lfeEntryCopyName(const LfeEntry* entry, u16 out[LFE_ENTRY_NAME_LEN])
+{
+    memcpy(out, entry->name0, sizeof(entry->name0));
+    memcpy(out + 5, entry->name1, sizeof(entry->name1));
+    memcpy(out + 11, entry->name2, sizeof(entry->name2));
+}
+
+u32 lfeEntryGetNameUCS2(const LfeEntry* entry, u16 out[LFE_ENTRY_NAME_LEN])
+{
+    lfeEntryCopyName(entry, out);
+    u32 len = 0;
+    while (len < LFE_ENTRY_NAME_LEN && out[len] != 0 && out[len] != 0xffff)
+        ++len;
+    return len;
+}
+
+u32 lfeEntryGetNameUTF8(const LfeEntry* entry, char* out, size_t outSize)
+{
+    u16 name[LFE_ENTRY_NAME_LEN];
+    lfeEntryCopyName(entry, name);
+    return fat32Ucs2ToUtf8(name, LFE_ENTRY_NAME_LEN, out, outSize);
+}
+
+void directoryIteratorEntryFree(DirectoryIteratorEntry** entryP)
+{
+    free((*entryP)->entry);
+    free((*entryP)->longFilename);
+    free(*entryP);
+    *entryP = NULL;
+}
+
+void directoryEntryGetShortName(const DirectoryEntry* entry, char out[DIRENTRY_FILENAME_LEN + 2])
+{
+    const u8* name = entry->fileName;
+    // Directories written by older versions use all 11 characters as the name, those are the ones
+    // with lower case letters. Everything else is split into base name and extension.
+    bool isSplit = directoryEntryIsFile(entry);
+    if ((entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY)) == DIRENTRY_ATTR_DIRECTORY)
+    {
+        isSplit = true;
+        for (int i = 0; i < DIRENTRY_FILENAME_LEN; ++i)
+            isSplit &= !islower(name[i]);
+    }
+    if (isSplit)
+    {
+        // Base name and extension are padded with spaces separately
+        int baseLen = 8;
+        while (baseLen > 0 && name[baseLen-1] == ' ')
+            --baseLen;
+        int extLen = 3;
+        while (extLen > 0 && name[8+extLen-1] == ' ')
+            --extLen;
+
+        memcpy(out, name, baseLen);
+        int outLen = baseLen;
+        if (entry->ntReserved & DIRENTRY_NT_LOWER_BASE)
+        {
+            for (int i = 0; i < baseLen; ++i)
+                out[i] = tolower((u8)out[i]);
+        }
+        if (extLen)
+        {
+            out[outLen++] = '.';
+            for (int i = 0; i < extLen; ++i)
+                out[outLen++] = (entry->ntReserved & DIRENTRY_NT_LOWER_EXT) ? tolower(name[8 + i]) : name[8 + i];
+        }
+        out[outLen] = 0;
+    }
+    else
+    {
+        memcpy(out, name, DIRENTRY_FILENAME_LEN);
+        out[DIRENTRY_FILENAME_LEN] = 0;
+        // Strip padding spaces
+        for (int i=DIRENTRY_FILENAME_LEN-1; i > 0 && out[i] == ' '; --i)
+            out[i] = 0;
+    }
+}
+
+const char* directoryIteratorRecordGetFileName(const DirectoryIteratorRecord* record)
+{
+    return record->longFilename[0] ? record->longFilename : record->shortFilename;
+}
+
+char* directoryIteratorEntryGetFileName(DirectoryIteratorEntry* entry)
+{
+    char shortName[DIRENTRY_FILENAME_LEN + 2];
+    const char* name = entry->longFilename;
+    // If we have a long filename, return it
+    if (name[0] == 0)
+    {
+        directoryEntryGetShortName(entry->entry, shortName);
+        name = shortName;
+    }
+    const size_t len = strlen(name);
+    char* fileName = malloc(len+1);
+    memcpy(fileName, name, len+1);
+    return fileName;
+}
+
+void directoryIteratorInit(DirectoryIterator* it, u64 addr)
+{
+    it->initAddress = addr;
+    it->address = addr;
+    it->lfeFragments = 0;
+}
+
+DirectoryIterator* directoryIteratorNew(u64 addr)
+{
+    DirectoryIterator* it = malloc(sizeof(DirectoryIterator));
+    directoryIteratorInit(it, addr);
+    return it;
+}
+
+static u8 calcShortNameChecksum(u8 name[DIRENTRY_FILENAME_LEN])
+{
+    uint8_t sum = 0;
+    for (int i=0; i < DIRENTRY_FILENAME_LEN; ++i)
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + name[i];
+    return sum;
+}
+
+bool directoryIteratorNextRecord(Fat32Context* cont, DirectoryIterator* it, DirectoryIteratorRecord* out)
+{
+    pthread_rwlock_t* lock = dirLock(cont, fat32AddressToCluster(cont, it->initAddress));
+    lockShared(cont, &cont->volumeLock);
+    lockShared(cont, lock);
+    const bool hasRecord = iteratorNextRecord(cont, it, out);
+    unlockRw(cont, lock);
+    unlockRw(cont, &cont->volumeLock);
+    return hasRecord;
+}
+
+// Needs the directory lock of the iterated directory
+static bool iteratorNextRecord(Fat32Context* cont, DirectoryIterator* it, DirectoryIteratorRecord* out)
+{
+    const u32 clusterSizeBytes = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize;
+    while (true)
+    {
+        if (it->address == 0) // Reached the end of the cluster chain
+        {
+            return false;
+        }
+
+        // Entering a cluster, read the rest of the chain in one batch
+        const u32 firstCluster = fat32AddressToCluster(cont, it->address);
+        if (it->address == fat32GetClusterAddress(cont, firstCluster))
+            cachePrefetchChain(cont, firstCluster);
+
+        u32 cluster;
+        const u8* data = readerGetAddress(cont, it->address, &cluster);
+        if (!data)
+        {
+            it->address = 0;
+            return false;
+        }
+        const DirectoryEntry* directory = (const DirectoryEntry*)data;
+
+        u64 newAddr = it->address + sizeof(DirectoryEntry);
+        const u64 clusterAddr = fat32GetClusterAddress(cont, cluster);
+        if (newAddr - clusterAddr == clusterSizeBytes)
+        {
+            // Continue in the next cluster of the chain, wherever it is
+            const ClusterPtr nextCluster = fatGetNextClusterPtr(cont, cluster);
+            assert(!clusterPtrIsBadCluster(nextCluster));
+            if (clusterPtrIsLastCluster(nextCluster) || clusterPtrIsNull(nextCluster))
+            {
+                newAddr = 0;
+            }
+            else
+            {
+                newAddr = fat32GetClusterAddress(cont, clusterPtrGetIndex(nextCluster));
+            }
+        }
+
+        if (directory->fileName[0] == 0) // End of directory
+        {
+            it->address = 0;
+            return false;
+        }
+
+        if (directory->fileName[0] == 0xe5) // Unused entry, skip
+        {
+            it->address = newAddr;
+            continue;
+        }
+
+        if (directoryEntryIsLFE(directory->attributes)) // LFE Entry
+        {
+            const LfeEntry* lfeEntry = (const LfeEntry*)directory;
+            const u8 fragIndex = lfeEntry->nameStrIndex & LFE_INDEX_MASK;
+
+            // The last fragment comes first, it starts a new name even if an earlier one was left unfinished
+            if (lfeEntry->nameStrIndex & LFE_LAST_FRAGMENT)
+                it->lfeFragments = 0;
+
+            // Fragment 0 is not valid, ignore it instead of writing before the buffer
+            if (fragIndex != 0 && fragIndex <= LFE_MAX_FRAGMENTS)
+            {
+                const size_t fragI = fragIndex - 1;
+                if (it->lfeFragments & (1u << fragI))
+                {
+                    assert(false && "Duplicate LFE entry");
+                }
+
+                it->lfeFragments |= 1u << fragI;
+                it->lfeChecksums[fragI] = lfeEntry->checksum;
+                lfeEntryCopyName(lfeEntry, it->longName + fragI * LFE_ENTRY_NAME_LEN);
+            }
+        }
+        else // Regular directory entry
+        {
+            memcpy(&out->entry, directory, sizeof(DirectoryEntry));
+            out->address = it->address;
+            directoryEntryGetShortName(&out->entry, out->shortFilename);
+
+            out->longFilename[0] = 0;
+            if (it->lfeFragments)
+            {
+                // Fragments 1 to n all have to be there, with the checksum of this entry
+                const u32 fragCount = 32 - __builtin_clz(it->lfeFragments);
+                const u8 calcedChecksum = calcShortNameChecksum(out->entry.fileName);
+                bool isValid = it->lfeFragments == (u32)((1ull << fragCount) - 1);
+                for (u32 i = 0; isValid && i < fragCount; ++i)
+                    isValid = it->lfeChecksums[i] == calcedChecksum;
+
+                // Throw away long filename on checksum mismatch
+                if (isValid)
+                    fat32Ucs2ToUtf8(it->longName, fragCount * LFE_ENTRY_NAME_LEN, out->longFilename, sizeof(out->longFilename));
+                it->lfeFragments = 0;
+            }
+            it->address = newAddr;
+            return true;
+        }
+
+        it->address = newAddr;
+    }
+}
+
+DirectoryIteratorEntry* directoryIteratorNext(Fat32Context* cont,DirectoryIterator* it)
+{
+    DirectoryIteratorRecord record;
+    if (!directoryIteratorNextRecord(cont, it, &record))
+    {
+        return NULL;
+    }
+
+    return newIteratorEntry(cont, (const u8*)&record.entry, record.address, record.longFilename);
+}
+
+void directoryIteratorSetAddress(DirectoryIterator* it, uint64_t addr)
+{
+    it->initAddress = addr;
+    it->address = addr;
+}
+
+void directoryIteratorRewind(DirectoryIterator* it)
+{
+    it->address = it->initAddress;
+}
+
+void directoryIteratorFree(DirectoryIterator** itP)
+{
+    free(*itP);
+    *itP = NULL;
+}
+
+Fat32Context* fat32Initialize(const char* devFilePath,bool *isFAT32)
+{
+    return fat32Open(devFilePath, 0, isFAT32);
+}
+
+Fat32Context* fat32Open(const char* devFilePath, u32 flags, bool *isFAT32)
+{
+    const bool isReadOnly = (flags & FAT32_OPEN_READONLY) != 0;
+    Fat32BlockDevice* dev = (flags & FAT32_OPEN_MMAP)
+            ? fat32MapDeviceOpen(devFilePath, isReadOnly)
+            : fat32FileDeviceOpen(devFilePath, isReadOnly);
+    if (!dev)
+        return NULL;
+    if (flags & FAT32_OPEN_ASYNC_IO)
+        fat32FileDeviceStartEngine(dev, FAT32_IO_URING);
+    return fat32OpenDevice(dev, flags, isFAT32);
+}
+
+Fat32Context* fat32OpenDevice(Fat32BlockDevice* dev, u32 flags, bool *isFAT32)
+{
+    Fat32Context* context = malloc(sizeof(Fat32Context));
+    context->device = dev;
+    memset(&context->stats, 0, sizeof(Fat32Stats));
+    context->ioPosition = 0;
+    context->allocPolicy = FAT32_ALLOC_NEXT_FIT;
+    context->map = dev->map;
+    context->mapSize = dev->size(dev);
+
+    context->bpb = malloc(sizeof(BPB));
+    fat32ReadAt(context, 0, context->bpb, sizeof(BPB));
+    context->isBpbModified = false;
+
+    context->ebpb = malloc(sizeof(EBPB));
+    fat32ReadAt(context, sizeof(BPB), context->ebpb, sizeof(EBPB));
+    context->isEbpbModified = false;
+
+    context->fsinfo = malloc(sizeof(FSInfo));
+    const u64 fsinfoStart = context->ebpb->fsInfoSectorNumber * context->bpb->sectorSize;
+    fat32ReadAt(context, fsinfoStart, context->fsinfo, sizeof(FSInfo));
+    context->isFsinfoModified = false;
+
+    context->fatSizeBytes = (u64)context->ebpb->sectorsPerFat * context->bpb->sectorSize;
+    const u64 fatStart = context->bpb->reservedSectorCount * context->bpb->sectorSize;
+    if (context->map)
+    {
+        // Use the primary FAT in place
+        assert(fatStart + context->fatSizeBytes <= context->mapSize);
+        context->fat = context->map + fatStart;
+    }
+    else
+    {
+        context->fat = malloc(context->fatSizeBytes);
+        assert(context->fat);
+        fat32ReadAt(context, fatStart, context->fat, context->fatSizeBytes);
+    }
+    context->isFatModified = false;
+    context->fatDirty = calloc((context->ebpb->sectorsPerFat + 63) / 64, sizeof(u64));
+    assert(context->fatDirty);
+
+    context->firstDataSector = context->bpb->reservedSectorCount + (context->bpb->fatCount*context->ebpb->sectorsPerFat);
+    context->rootDirectoryAddress = fat32GetClusterAddress(context, context->ebpb->rootDirectoryClusterNumber);
+    context->clusterCount = fat32CalcClusterCount(context);
+    freeMapBuild(context);
+    cacheInit(context, FAT32_DEFAULT_CACHE_SIZE);
+    memset(context->nameIndexes, 0, sizeof(context->nameIndexes));
+    context->nameIndexClock = 0;
+    memset(&context->dentryCache, 0, sizeof(Fat32DentryCache));
+    concurrencyInit(context, (flags & FAT32_OPEN_CONCURRENT) != 0);
+
+    // Keep FSInfo in line with the actual FAT contents
+    context->isFsinfoBad = context->fsinfo->leadSignature != FSINFO_LEAD_SIG
+            || context->fsinfo->signature != FSINFO_SIG
+            || context->fsinfo->freeCount != context->freeMap.freeCount;
+    if (context->fsinfo->freeCount != context->freeMap.freeCount)
+    {
+        context->fsinfo->freeCount = context->freeMap.freeCount;
+        context->isFsinfoModified = true;
+    }
+    if (context->fsinfo->nextFree != context->freeMap.hint)
+    {
+        context->fsinfo->nextFree = context->freeMap.hint;
+        context->isFsinfoModified = true;
+    }
+    // Nothing can be written back, the fixed values only live in memory
+    if (dev->isReadOnly)
+        context->isFsinfoModified = false;
+
+    if(context->clusterCount >= 65526)
+    {
+        *isFAT32 = true;
+    }
+    else
+    {
+        *isFAT32 = false;
+    }
+
+    return context;
+
+}
+
+
+// Sectors per cluster for a given volume size, following the table
+// from the Microsoft FAT specification for 512 byte sectors.
+static u16 fat32DefaultSectorsPerCluster(u64 diskSize)
+{
+    const u64 mb = 1024 * 1024;
+    if (diskSize <= 260 * mb)
+        return DEFAULT_SECTORS_PER_CLUSTER;
+    if (diskSize <= 8192 * mb)
+        return 8;
+    if (diskSize <= 16384 * mb)
+        return 16;
+    if (diskSize <= 32768 * mb)
+        return 32;
+    return 64;
+}
+
+static bool isDiskSizeValid(u64 diskSize)
+{
+    if (diskSize < FAT32_MIN_DISK_SIZE)
+    {
+        printf("Disk size %llu is too small, minimum is %llu bytes\n",
+               (unsigned long long)diskSize, (unsigned long long)FAT32_MIN_DISK_SIZE);
+        return false;
+    }
+    return true;
+}
+
+Fat32Context* fat32Create(const char* devFilePath, u64 diskSize)
+{
+    // Checked before the file is truncated
+    if (!isDiskSizeValid(diskSize))
+        return NULL;
+
+    Fat32BlockDevice* dev = fat32FileDeviceCreate(devFilePath, diskSize);
+    if (!dev)
+        return NULL;
+    return fat32CreateOnDevice(dev);
+}
+
+static Fat32Context* formatDevice(Fat32BlockDevice* dev, bool isZeroed);
+
+Fat32Context* fat32CreateOnDevice(Fat32BlockDevice* dev)
+{
+    return formatDevice(dev, true);
+}
+
+// Writes only the metadata, a device that doesn't read as zeros gets whole FATs
+static Fat32Context* formatDevice(Fat32BlockDevice* dev, bool isZeroed)
+{
+    const u64 diskSize = dev->size(dev);
+    if (dev->isReadOnly || !isDiskSizeValid(diskSize))
+    {
+        if (dev->isReadOnly)
+            printf("Can't create a filesystem on a read-only device\n");
+        fat32BlockDeviceClose(&dev);
+        return NULL;
+    }
+
+    Fat32Context* context = malloc(sizeof(Fat32Context));
+    context->device = dev;
+    memset(&context->stats, 0, sizeof(Fat32Stats));
+    context->ioPosition = 0;
+    context->allocPolicy = FAT32_ALLOC_NEXT_FIT;
+    context->map = NULL;
+    context->mapSize = diskSize;
+
+    context->bpb = malloc(sizeof(BPB));
+
+    const u32 totalSectors = diskSize / DEFAULT_SECTOR_SIZE;
+    const u16 sectorsPerCluster = fat32DefaultSectorsPerCluster(diskSize);
+
+    context->bpb->reserved0[0]=0xEB;
+    context->bpb->reserved0[1]=0x58;
+    context->bpb->reserved0[2]=0x90;
+    memcpy(context->bpb->oemIdentifier,"MSDOS4.1",BPB_OEM_LEN);
+
+    context->bpb->sectorSize = DEFAULT_SECTOR_SIZE;
+    context->bpb->sectorsPerClusters = sectorsPerCluster;
+    context->bpb->reservedSectorCount = 32;//According to specification, they use 32
+    context->bpb->fatCount = 2;
+    context->bpb->directoryEntryCount = 0; //fat32 doesn't use this and it must be 0
+    context->bpb->sectorCount = 0; //not for fat32
+    context->bpb->mediaType = 0xF8; //fixed, non-removable drive*/
+    context->bpb->sectorsPerFat = 0; //not for fat32
+    context->bpb->sectorsPerTrack = 0;
+    context->bpb->headCount = 0;
+    context->bpb->hiddenSectCount = 0;
+    context->bpb->largeSectCount = totalSectors;
+    context->isBpbModified = false;
+
+    context->ebpb = malloc(sizeof(EBPB));
+
+    // FAT size calculation from the Microsoft FAT specification
+    const u32 tmp1 = totalSectors - context->bpb->reservedSectorCount;
+    const u32 tmp2 = (256 * sectorsPerCluster + context->bpb->fatCount) / 2;
+    context->ebpb->sectorsPerFat = (tmp1 + tmp2 - 1) / tmp2;
+
+    const u32 clusters = (totalSectors - context->bpb->reservedSectorCount
+                          - context->bpb->fatCount * context->ebpb->sectorsPerFat) / sectorsPerCluster;
+
+    //this emulation  of fat32 ,so set dummy numbers
+
+    context->ebpb->flags = 0x04; //no mirroring, and fat 0 is the active fat
+    context->ebpb->fatVersion = 0; //fat32 version 0:0
+    context->ebpb->rootDirectoryClusterNumber = 0x2; /*there are no clusters 0 and 1 */
+    context->ebpb->fsInfoSectorNumber = 1;
+    context->ebpb->backupSectorNumber = 6;
+
+    memset(context->ebpb->reserved0, 0xA, 12);
+
+    context->ebpb->driveNumber = 1;
+    context->ebpb->ntFlags = 0x1 | 0x3 | 0xB;
+    context->ebpb->signature = 0x29; //from fat specification indicate that the following fields are present
+    context->ebpb->serialNumber = (u32)time(NULL); /*take a unique volume id*/
+
+    memcpy(context->ebpb->label,"MSDOS 4.1  ",11);
+    memcpy(context->ebpb->systemId,"FAT32   ",8);
+    context->isEbpbModified = false;
+
+    const u32 sectorSize = context->bpb->sectorSize;
+    const u64 backupOffs = context->ebpb->backupSectorNumber * sectorSize;
+    bool isWritten = true;
+
+    // Boot sector and its backup
+    {
+        u8 sector[DEFAULT_SECTOR_SIZE] = {0};
+        memcpy(sector, context->bpb, sizeof(BPB));
+        memcpy(sector + sizeof(BPB), context->ebpb, sizeof(EBPB));
+        sector[DEFAULT_SECTOR_SIZE - 2] = 0x55;
+        sector[DEFAULT_SECTOR_SIZE - 1] = 0xAA;
+        isWritten &= fat32WriteAt(context, 0, sector, sizeof(sector));
+        isWritten &= fat32WriteAt(context, backupOffs, sector, sizeof(sector));
+    }
 
     context->fsinfo = malloc(sizeof(FSInfo));
-    const u64 fsinfoStart = context->ebpb->fsInfoSectorNumber * context->bpb->sectorSize;
-    fseek(context->file, fsinfoStart, SEEK_SET);
-    fread(context->fsinfo, sizeof(FSInfo), 1, context->file);
+
+    /*make the fs_info structure*/
+    context->fsinfo->leadSignature = FSINFO_LEAD_SIG;
+    context->fsinfo->signature = FSINFO_SIG;
+    context->fsinfo->freeCount = clusters - 1; //cluster 2 is used for the root directory
+    context->fsinfo->nextFree = 3; //sectors start at number 2 is the rootCluster
+    context->fsinfo->trailSig = FSINFO_TRAIL_SIG;
+
+    memset(context->fsinfo->reserved0, 0xA, 480);
+    memset(context->fsinfo->reserved1, 0xA, 12);
+
+    const u64 fsinfoStart = context->ebpb->fsInfoSectorNumber * sectorSize;
+    isWritten &= fat32WriteAt(context, fsinfoStart, context->fsinfo, sizeof(FSInfo));
+    isWritten &= fat32WriteAt(context, fsinfoStart + backupOffs, context->fsinfo, sizeof(FSInfo));
     context->isFsinfoModified = false;
+    context->isFsinfoBad = false;
+
+    context->fatSizeBytes = (u64)context->ebpb->sectorsPerFat * sectorSize;
+    context->fat = calloc(context->fatSizeBytes, 1);
+
+    assert(context->fat);
+
+    // Media descriptor, reserved entry and the end of the root directory chain
+    u32* fatEntries = (u32*)context->fat;
+    fatEntries[0] = 0x0fffff00 | context->bpb->mediaType;
+    fatEntries[1] = 0x0fffffff;
+    fatEntries[context->ebpb->rootDirectoryClusterNumber] = 0x0fffffff;
+
+    // Everything past the first FAT sector is zero, which a new sparse file already holds
+    for (u32 i = 0; i < context->bpb->fatCount; ++i)
+    {
+        const u64 fatStart = ((u64)context->bpb->reservedSectorCount + (u64)i * context->ebpb->sectorsPerFat) * sectorSize;
+        isWritten &= fat32WriteAt(context, fatStart, context->fat, isZeroed ? sectorSize : context->fatSizeBytes);
+    }
+    context->isFatModified = false;
+    context->fatDirty = calloc((context->ebpb->sectorsPerFat + 63) / 64, sizeof(u64));
+    assert(context->fatDirty);
+
+    context->firstDataSector = context->bpb->reservedSectorCount + (context->bpb->fatCount*context->ebpb->sectorsPerFat);
+    context->rootDirectoryAddress = (u64)context->firstDataSector * sectorSize;
+    context->clusterCount = clusters;
+    freeMapBuild(context);
+    cacheInit(context, FAT32_DEFAULT_CACHE_SIZE);
+    memset(context->nameIndexes, 0, sizeof(context->nameIndexes));
+    context->nameIndexClock = 0;
+    memset(&context->dentryCache, 0, sizeof(Fat32DentryCache));
+    concurrencyInit(context, false);
+
+    // Root directory cluster holding only the volume label
+    {
+        const u32 clusterSizeBytes = sectorsPerCluster * sectorSize;
+        u8* rootCluster = calloc(clusterSizeBytes, 1);
+        DirectoryEntry* label = (DirectoryEntry*)rootCluster;
+        memcpy(label->fileName, context->ebpb->label, DIRENTRY_FILENAME_LEN);
+        label->attributes = DIRENTRY_ATTR_VOLUME_ID;
+        isWritten &= fat32WriteAt(context, context->rootDirectoryAddress, rootCluster, clusterSizeBytes);
+        free(rootCluster);
+    }
+
+    if (!isWritten || !dev->flush(dev))
+    {
+        printf("Failed to write filesystem metadata: %s\n", strerror(errno));
+        fat32ContextCloseAndFree(&context);
+        return NULL;
+    }
+
+    return context;
+
+}
+// Writes runs of modified FAT sectors to every FAT copy
+static bool fatFlushDirtySectors(Fat32Context* context)
+{
+    const u32 sectorSize = context->bpb->sectorSize;
+    const u32 sectorCount = context->ebpb->sectorsPerFat;
+    const u32 wordCount = (sectorCount + 63) / 64;
+    bool isOk = true;
+    // Runs of every FAT copy go out in batches
+    Fat32IoRequest requests[FAT32_IO_BATCH];
+    u32 requestCount = 0;
+
+    u32 sector = 0;
+    while (sector < sectorCount)
+    {
+        // Find the start of the next dirty run
+        u32 word = sector / 64;
+        u64 bits = context->fatDirty[word] & (~0ULL << (sector % 64));
+        while (!bits && ++word < wordCount)
+            bits = context->fatDirty[word];
+        if (!bits)
+            break;
+        const u32 first = word * 64 + __builtin_ctzll(bits);
+
+        // And its end
+        u32 end = first;
+        while (end < sectorCount && (context->fatDirty[end / 64] & (1ULL << (end % 64))))
+        {
+            context->fatDirty[end / 64] &= ~(1ULL << (end % 64));
+            ++end;
+        }
+
+        u8* data = context->fat + (u64)first * sectorSize;
+        const u64 size = (u64)(end - first) * sectorSize;
+        statsAdd(&context->stats.fatSectorsFlushed, (u64)(end - first) * context->bpb->fatCount);
+        for (u32 i = 0; i < context->bpb->fatCount; ++i)
+        {
+            if (requestCount == FAT32_IO_BATCH)
+            {
+                isOk &= fat32Submit(context, requests, requestCount);
+                requestCount = 0;
+            }
+            requests[requestCount++] = (Fat32IoRequest){
+                    .offset = (context->bpb->reservedSectorCount + (u64)i * sectorCount + first) * sectorSize,
+                    .data = data,
+                    .size = size,
+                    .isWrite = true,
+            };
+        }
+        sector = end;
+    }
+    isOk &= fat32Submit(context, requests, requestCount);
+    return isOk;
+}
+
+static bool flushVolume(Fat32Context* context);
+static void contextFree(Fat32Context** contextP);
+
+bool fat32Flush(Fat32Context* context)
+{
+    const u64 start = statsNow();
+    lockExclusive(context, &context->volumeLock);
+    const bool isOk = flushVolume(context);
+    unlockRw(context, &context->volumeLock);
+    statsRecord(context, FAT32_STATS_FLUSH, start);
+    return isOk;
+}
+
+// Needs the volume lock exclusive
+static bool flushVolume(Fat32Context* context)
+{
+    bool isOk = fat32CacheFlush(context);
+    const u32 backupOffs = context->ebpb->backupSectorNumber*context->bpb->sectorSize;
+
+    if (context->isBpbModified)
+    {
+        u64 pos = 0;
+        isOk &= fat32WriteAt(context, pos, context->bpb, sizeof(BPB));
+
+        // Write to backup sector
+        pos += backupOffs;
+        isOk &= fat32WriteAt(context, pos, context->bpb, sizeof(BPB));
+        context->isBpbModified = false;
+    }
+
+    if (context->isEbpbModified)
+    {
+        u64 pos = sizeof(BPB);
+        isOk &= fat32WriteAt(context, pos, context->ebpb, sizeof(EBPB));
+
+        // Write to backup sector
+        pos += backupOffs;
+        isOk &= fat32WriteAt(context, pos, context->ebpb, sizeof(EBPB));
+        context->isEbpbModified = false;
+    }
+
+    if (context->isFsinfoModified)
+    {
+        u64 pos = context->ebpb->fsInfoSectorNumber * context->bpb->sectorSize;
+        isOk &= fat32WriteAt(context, pos, context->fsinfo, sizeof(FSInfo));
+
+        // Write to backup sector
+        pos += backupOffs;
+        isOk &= fat32WriteAt(context, pos, context->fsinfo, sizeof(FSInfo));
+        context->isFsinfoModified = false;
+    }
+
+    if (context->isFatModified)
+    {
+        isOk &= fatFlushDirtySectors(context);
+        context->isFatModified = false;
+    }
+
+    isOk &= context->device->flush(context->device);
+    return isOk;
+}
+
+void fat32ContextCloseAndFree(Fat32Context** contextP)
+{
+    Fat32Context* context = *contextP;
+    if (!context)
+        return;
+    if (!fat32Flush(context))
+    {
+        printf("Failed to flush filesystem changes: %s\n", strerror(errno));
+    }
+    fat32BlockDeviceClose(&context->device);
+    contextFree(contextP);
+}
+
+// Frees a context without flushing it, its device must be closed or taken over already
+static void contextFree(Fat32Context** contextP)
+{
+    Fat32Context* context = *contextP;
+    // A mapped FAT is part of the device
+    if (!context->map)
+        free(context->fat);
+    free(context->bpb);
+    free(context->ebpb);
+    free(context->fsinfo);
+    free(context->fatDirty);
+    freeMapFree(&context->freeMap);
+    cacheFree(&context->cache);
+    nameIndexFreeAll(context);
+    fat32DentryCacheClear(context);
+    concurrencyDestroy(context);
+    free(context);
+    *contextP = NULL;
+}
+
+uint32_t fat32GetFirstSectorOfCluster(const Fat32Context* cont, uint32_t cluster)
+{
+    return (cluster - 2) * cont->bpb->sectorsPerClusters + cont->firstDataSector;
+}
+
+
+void fat32ListDirectory(Fat32Context* cont, u64 addr)
+{
+    const u64 start = statsNow();
+    // Print table heading
+    printf("%-11.11s  |  %50s  |  %10s  |  %s  |  %s\n",
+          "FILE NAME", "LONG FILE NAME", "SIZE", "ATTRS.", "CREAT. DATE & TIME");
+    for (int i=0; i < 116; ++i)
+    {
+        printf((i == 13 || i == 68 || i == 83 || i == 94) ? "|" : "-");
+    }
+    printf("\n");
+
+    // List directory
+    DirectoryIterator it;
+    directoryIteratorInit(&it, addr);
+    DirectoryIteratorRecord record;
+    int fileCount = 0;
+    while (directoryIteratorNextRecord(cont, &it, &record))
+    {
+        const DirectoryEntry* entry = &record.entry;
+        char* attrs = directoryEntryAttrsToString(entry->attributes);
+
+        DirectoryEntryDate cDate = toDirectoryEntryDate(entry->creationDate);
+
+        char* cDateStr = directoryEntryDateToString(&cDate);
+
+        DirectoryEntryTime cTime = toDirectoryEntryTime(entry->creationTime);
+
+        char* cTimeStr = directoryEntryTimeToString(&cTime);
+
+        printf("%-12.12s |  %50s  |  ", record.shortFilename, record.longFilename);
+
+        if (directoryEntryIsDirectory(entry))
+        {
+            printf("     <DIR>");
+        }
+        else
+        {
+            printf("%10i", entry->fileSize);
+        }
+        printf("  |  %s  |  %s %s\n", attrs, cDateStr, cTimeStr);
+
+        free(attrs);
+        free(cDateStr);
+        free(cTimeStr);
+        statsAdd(&cont->stats.allocations, 3);
+
+        ++fileCount;
+    }
+
+    printf("%i items in directory\n", fileCount);
+    statsRecord(cont, FAT32_STATS_LIST, start);
+}
+
+static char* strtToUpper(const char* str)
+{
+    const size_t len = strlen(str);
+    char* output = malloc(len+1);
+    for (size_t i=0; i <= len; ++i)
+        output[i] = toupper(str[i]);
+    return output;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * 8.3 lookups in directories that don't have a name index yet. The search
+ * name is turned into its padded on-disk form once, then every cluster of
+ * the directory is classified with vector compares of the name field:
+ * records are case-folded, deleted and long name records are skipped, and
+ * the scan stops at the end marker.
+ */
+
+#define SHORT_SCAN_END (1 << 0) // Hit the 0x00 end of directory marker
+#define SHORT_SCAN_LFE (1 << 1) // Saw a long name record before the returned index
+
+// Match pattern of the record, 0 if it doesn't match. Case-folds the record, not the pattern.
+static bool shortScanMatchScalar(const u8* record, const u8 pattern[16])
+{
+    for (int i = 0; i < DIRENTRY_FILENAME_LEN; ++i)
+    {
+        const u8 c = (record[i] >= 'a' && record[i] <= 'z') ? record[i] - 0x20 : record[i];
+        if (c != pattern[i])
+            return false;
+    }
+    return true;
+}
+
+// Index of the first record matching one of the patterns, or of the end marker, count if neither
+static u32 shortScanScalar(const u8* records, u32 count, const u8 patterns[2][16], u32* flags)
+{
+    for (u32 i = 0; i < count; ++i)
+    {
+        const u8* record = records + i * sizeof(DirectoryEntry);
+        if (record[0] == 0)
+        {
+            *flags |= SHORT_SCAN_END;
+            return i;
+        }
+        if (record[0] == 0xe5)
+            continue;
+        if (directoryEntryIsLFE(record[11]))
+        {
+            *flags |= SHORT_SCAN_LFE;
+            continue;
+        }
+        if (shortScanMatchScalar(record, patterns[0]) || shortScanMatchScalar(record, patterns[1]))
+            return i;
+    }
+    return count;
+}
+
+// Decides one record from the compare masks of its first 16 bytes, true if the scan stops there
+static inline bool shortScanClassify(u32 match0, u32 match1, u32 zero, u32 deleted, u32 lfe, u32* flags)
+{
+    if (zero & 1)
+    {
+        *flags |= SHORT_SCAN_END;
+        return true;
+    }
+    if (deleted & 1)
+        return false;
+    if (lfe & (1 << 11))
+    {
+        *flags |= SHORT_SCAN_LFE;
+        return false;
+    }
+    return (match0 & 0x7ff) == 0x7ff || (match1 & 0x7ff) == 0x7ff;
+}
+
+#ifdef FAT32_SCAN_X86
+__attribute__((target("sse2")))
+static u32 shortScanSse2(const u8* records, u32 count, const u8 patterns[2][16], u32* flags)
+{
+    const __m128i pattern0 = _mm_loadu_si128((const __m128i*)patterns[0]);
+    const __m128i pattern1 = _mm_loadu_si128((const __m128i*)patterns[1]);
+    const __m128i beforeA = _mm_set1_epi8('a' - 1);
+    const __m128i afterZ = _mm_set1_epi8('z' + 1);
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i deleted = _mm_set1_epi8((char)0xe5);
+    const __m128i lfeMask = _mm_set1_epi8(DIRENTRY_MASK_LONG_NAME);
+    const __m128i lfe = _mm_set1_epi8(DIRENTRY_ATTR_LONG_NAME);
+    for (u32 i = 0; i < count; ++i)
+    {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(records + i * sizeof(DirectoryEntry)));
+        const __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(v, beforeA), _mm_cmplt_epi8(v, afterZ));
+        const __m128i folded = _mm_sub_epi8(v, _mm_and_si128(isLower, caseBit));
+        if (shortScanClassify(_mm_movemask_epi8(_mm_cmpeq_epi8(folded, pattern0)),
+                              _mm_movemask_epi8(_mm_cmpeq_epi8(folded, pattern1)),
+                              _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)),
+                              _mm_movemask_epi8(_mm_cmpeq_epi8(v, deleted)),
+                              _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, lfeMask), lfe)), flags))
+            return i;
+    }
+    return count;
+}
+
+// Two records per compare, one in each 128 bit lane
+__attribute__((target("avx2")))
+static u32 shortScanAvx2(const u8* records, u32 count, const u8 patterns[2][16], u32* flags)
+{
+    const __m256i pattern0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)patterns[0]));
+    const __m256i pattern1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)patterns[1]));
+    const __m256i beforeA = _mm256_set1_epi8('a' - 1);
+    const __m256i afterZ = _mm256_set1_epi8('z' + 1);
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i deleted = _mm256_set1_epi8((char)0xe5);
+    const __m256i lfeMask = _mm256_set1_epi8(DIRENTRY_MASK_LONG_NAME);
+    const __m256i lfe = _mm256_set1_epi8(DIRENTRY_ATTR_LONG_NAME);
+    u32 i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        const u8* record = records + i * sizeof(DirectoryEntry);
+        const __m256i v = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)record)),
+                _mm_loadu_si128((const __m128i*)(record + sizeof(DirectoryEntry))), 1);
+        const __m256i isLower = _mm256_and_si256(_mm256_cmpgt_epi8(v, beforeA), _mm256_cmpgt_epi8(afterZ, v));
+        const __m256i folded = _mm256_sub_epi8(v, _mm256_and_si256(isLower, caseBit));
+        const u32 match0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(folded, pattern0));
+        const u32 match1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(folded, pattern1));
+        const u32 zeroMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        const u32 deletedMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, deleted));
+        const u32 lfeBits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, lfeMask), lfe));
+        if (shortScanClassify(match0, match1, zeroMask, deletedMask, lfeBits, flags))
+            return i;
+        if (shortScanClassify(match0 >> 16, match1 >> 16, zeroMask >> 16, deletedMask >> 16, lfeBits >> 16, flags))
+            return i + 1;
+    }
+    return i + shortScanScalar(records + i * sizeof(DirectoryEntry), count - i, patterns, flags);
+}
+#endif
+
+// Padded, upper case on-disk forms of an 8.3 name: split into base and extension
+// like files are stored, and as is like directories are stored. False if neither fits.
+static bool shortScanMakePatterns(const char* name, u8 patterns[2][16])
+{
+    const size_t len = strlen(name);
+    if (len == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return false;
+    // Generated 8.3 names are ASCII, anything else can only be a long name
+    for (size_t i = 0; i < len; ++i)
+    {
+        if ((u8)name[i] >= 0x80)
+            return false;
+    }
+
+    const char* dot = strrchr(name, '.');
+    const size_t baseLen = dot ? (size_t)(dot - name) : len;
+    const size_t extLen = dot ? len - baseLen - 1 : 0;
+    const bool isFileForm = baseLen > 0 && baseLen <= 8 && extLen <= 3;
+    const bool isRawForm = len <= DIRENTRY_FILENAME_LEN;
+    if (!isFileForm && !isRawForm)
+        return false;
+
+    memset(patterns, ' ', 2 * 16);
+    for (size_t i = 0; isRawForm && i < len; ++i)
+        patterns[1][i] = toupper((u8)name[i]);
+    for (size_t i = 0; isFileForm && i < baseLen; ++i)
+        patterns[0][i] = toupper((u8)name[i]);
+    for (size_t i = 0; isFileForm && i < extLen; ++i)
+        patterns[0][8 + i] = toupper((u8)dot[1 + i]);
+
+    // A form that doesn't fit would match truncated names, compare the other one twice
+    if (!isFileForm)
+        memcpy(patterns[0], patterns[1], 16);
+    if (!isRawForm)
+        memcpy(patterns[1], patterns[0], 16);
+    return true;
+}
+
+/*
+ * Looks up an 8.3 name by scanning the directory clusters. Returns false when
+ * the answer needs the name index instead: the name is not 8.3, the entry has
+ * a long name that the caller would miss, or a long name may match the name.
+ */
+static bool shortScanFind(Fat32Context* cont, u64 dirAddress, const char* name, u64* entryAddress)
+{
+    u8 patterns[2][16];
+    if (!shortScanMakePatterns(name, patterns))
+        return false;
+
+    u32 (*scan)(const u8*, u32, const u8[2][16], u32*) = shortScanScalar;
+#ifdef FAT32_SCAN_X86
+    if (scanLevel() == SCAN_LEVEL_AVX2)
+        scan = shortScanAvx2;
+    else if (scanLevel() == SCAN_LEVEL_SSE2)
+        scan = shortScanSse2;
+#endif
+
+    const u32 recordsPerCluster = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize / sizeof(DirectoryEntry);
+    ClusterPtr cluster = fat32AddressToCluster(cont, dirAddress);
+    bool isLastRecordLfe = false;
+    bool sawLfe = false;
+    for (u32 visited = 0; visited <= cont->clusterCount; ++visited)
+    {
+        cachePrefetchChain(cont, clusterPtrGetIndex(cluster));
+        const u8* records = readerGetAddress(cont, fat32GetClusterAddress(cont, clusterPtrGetIndex(cluster)), NULL);
+        if (!records)
+            return false;
+
+        u32 flags = 0;
+        const u32 found = scan(records, recordsPerCluster, patterns, &flags);
+        sawLfe |= (flags & SHORT_SCAN_LFE) != 0;
+        if (flags & SHORT_SCAN_END)
+            break;
+        if (found < recordsPerCluster)
+        {
+            const bool isAfterLfe = found == 0
+                    ? isLastRecordLfe
+                    : directoryEntryIsLFE(records[(found - 1) * sizeof(DirectoryEntry) + 11]);
+            if (isAfterLfe)
+                return false;
+            *entryAddress = fat32GetClusterAddress(cont, clusterPtrGetIndex(cluster)) + found * sizeof(DirectoryEntry);
+            return true;
+        }
+        isLastRecordLfe = directoryEntryIsLFE(records[(recordsPerCluster - 1) * sizeof(DirectoryEntry) + 11]);
+
+        cluster = fatGetNextClusterPtr(cont, cluster);
+        if (clusterPtrIsNull(cluster) || clusterPtrIsLastCluster(cluster) || clusterPtrIsBadCluster(cluster))
+            break;
+    }
+
+    // Not found. Only certain when no long name could match instead.
+    *entryAddress = 0;
+    return !sawLfe;
+}
+
+// Copies the entry a name index slot points at, NULL if there is none
+static DirectoryIteratorEntry* nameIndexGetEntry(Fat32Context* cont, Fat32NameIndex* index, const char* toFind)
+{
+    char folded[LFE_FULL_NAME_LEN + 1];
+    nameFold(toFind, folded, sizeof(folded));
+    const Fat32NameIndexSlot* slot = nameIndexProbe(index, folded, nameIndexHash(folded));
+    if (slot->hash == 0)
+        return NULL;
+
+    const u8* data = readerGetAddress(cont, slot->address, NULL);
+    if (!data)
+        return NULL;
+
+    return newIteratorEntry(cont, data, slot->address,
+                            slot->longNameOffset != NAME_INDEX_NONE ? index->pool + slot->longNameOffset : NULL);
+}
+
+// Needs the directory lock
+static DirectoryIteratorEntry* findInDirectory(Fat32Context* cont, u64 addr, const char* toFind)
+{
+    const u32 dirCluster = fat32AddressToCluster(cont, addr);
+    nameIndexLockShared(cont);
+    Fat32NameIndex* index = nameIndexFind(cont, dirCluster);
+    DirectoryIteratorEntry* result = index ? nameIndexGetEntry(cont, index, toFind) : NULL;
+    nameIndexUnlock(cont);
+    if (index)
+        return result;
+
+    // Cold directory, try to answer an 8.3 lookup without building the index
+    u64 entryAddress;
+    if (shortScanFind(cont, addr, toFind, &entryAddress))
+    {
+        const u8* data = entryAddress ? readerGetAddress(cont, entryAddress, NULL) : NULL;
+        return data ? newIteratorEntry(cont, data, entryAddress, NULL) : NULL;
+    }
+
+    // Another reader may have built it in the meantime
+    nameIndexLockExclusive(cont);
+    index = nameIndexFind(cont, dirCluster);
+    if (!index)
+        index = nameIndexBuild(cont, addr);
+    result = nameIndexGetEntry(cont, index, toFind);
+    nameIndexUnlock(cont);
+    return result;
+}
+
+DirectoryIteratorEntry* fat32FindInDirectory(Fat32Context* cont, u64 addr, const char* toFind)
+{
+    const u64 start = statsNow();
+    pthread_rwlock_t* lock = dirLock(cont, fat32AddressToCluster(cont, addr));
+    lockShared(cont, &cont->volumeLock);
+    lockShared(cont, lock);
+    DirectoryIteratorEntry* result = findInDirectory(cont, addr, toFind);
+    unlockRw(cont, lock);
+    unlockRw(cont, &cont->volumeLock);
+    statsRecord(cont, FAT32_STATS_LOOKUP, start);
+    return result;
+}
+
+// Case-folded path without leading, trailing or repeated separators
+static void normalizePath(const char* path, char* out, size_t outSize)
+{
+    size_t len = 0;
+    for (const char* c = path; *c && len + 1 < outSize; ++c)
+    {
+        if (*c == PATH_SEP && (len == 0 || out[len-1] == PATH_SEP))
+            continue;
+        out[len++] = *c;
+    }
+    if (len && out[len-1] == PATH_SEP)
+        --len;
+    out[len] = 0;
+    nameFold(out, out, outSize);
+}
+
+// dirClusterOut receives the directory holding the found entry
+static DirectoryIteratorEntry* findPath(Fat32Context* cont, const char* path, uint64_t parentAddr, u32* dirClusterOut)
+{
+    char normalized[FAT32_MAX_PATH_LEN];
+    normalizePath(path, normalized, sizeof(normalized));
+    if (normalized[0] == 0)
+        return NULL;
+
+    // Taken before reading anything, a create from now on makes our negative entries stale
+    const u64 generation = dentryGeneration(cont);
+    const u32 rootCluster = fat32AddressToCluster(cont, parentAddr);
+    // Whole paths are only cached when resolved from the root
+    const bool isFromRoot = parentAddr == cont->rootDirectoryAddress;
+    DentryHit hit;
+    if (isFromRoot && dentryGet(cont, 0, normalized, &hit))
+    {
+        if (hit.isNegative)
+            return NULL;
+        if (dirClusterOut)
+            *dirClusterOut = hit.dirCluster;
+        return dentryToEntry(cont, &hit);
+    }
+
+    DirectoryIteratorEntry* entry = NULL;
+    u32 parentCluster = rootCluster;
+    u64 addr = parentAddr;
+    char* component = normalized;
+    while (true)
+    {
+        char* sep = strchr(component, PATH_SEP);
+        if (sep)
+            *sep = 0;
+
+        if (dentryGet(cont, parentCluster, component, &hit))
+        {
+            entry = hit.isNegative ? NULL : dentryToEntry(cont, &hit);
+        }
+        else
+        {
+            pthread_rwlock_t* lock = dirLock(cont, parentCluster);
+            lockShared(cont, lock);
+            entry = findInDirectory(cont, addr, component);
+            unlockRw(cont, lock);
+            dentryPut(cont, parentCluster, component, entry, parentCluster, generation);
+        }
+
+        if (entry == NULL || !sep)
+            break;
+
+        // Only directories can have more components after them
+        if (!directoryEntryIsDirectory(entry->entry))
+        {
+            directoryIteratorEntryFree(&entry);
+            break;
+        }
+        parentCluster = directoryEntryGetFirstClusterNumber(entry->entry);
+        addr = directoryEntryGetDataAddress(cont, entry->entry);
+        directoryIteratorEntryFree(&entry);
+
+        *sep = PATH_SEP;
+        component = sep + 1;
+    }
+
+    if (isFromRoot)
+    {
+        normalizePath(path, normalized, sizeof(normalized));
+        dentryPut(cont, 0, normalized, entry, parentCluster, generation);
+    }
+    if (entry && dirClusterOut)
+        *dirClusterOut = parentCluster;
+    return entry;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Format. The quick one rewrites the boot sectors, FSInfo, the FATs and the
+ * root cluster of the device in place. The surface scan then reads the data
+ * area in chunks spread over threads; a chunk that fails is read again one
+ * cluster at a time, and the clusters that still fail are marked bad.
+ */
+
+typedef struct SurfaceScan
+{
+    Fat32Context* cont;
+    u32 clustersPerChunk;
+    u32 chunkCount;
+    u32 nextChunk;
+    pthread_mutex_t lock;
+    u32* bad;
+    u32 badCount;
+    u32 badCapacity;
+} SurfaceScan;
+
+static void* surfaceScanWorker(void* arg)
+{
+    SurfaceScan* scan = arg;
+    Fat32Context* cont = scan->cont;
+    const u32 clusterSize = cont->cache.clusterSize;
+    u8* buffer = malloc((u64)scan->clustersPerChunk * clusterSize);
+    assert(buffer);
+
+    u32 chunk;
+    while ((chunk = __atomic_fetch_add(&scan->nextChunk, 1, __ATOMIC_RELAXED)) < scan->chunkCount)
+    {
+        const u32 first = 2 + chunk * scan->clustersPerChunk;
+        const u32 count = umin(scan->clustersPerChunk, cont->clusterCount + 2 - first);
+        if (fat32ReadAt(cont, fat32GetClusterAddress(cont, first), buffer, (u64)count * clusterSize))
+            continue;
+
+        for (u32 cluster = first; cluster < first + count; ++cluster)
+        {
+            if (fat32ReadAt(cont, fat32GetClusterAddress(cont, cluster), buffer, clusterSize))
+                continue;
+            pthread_mutex_lock(&scan->lock);
+            if (scan->badCount == scan->badCapacity)
+            {
+                scan->badCapacity = scan->badCapacity ? scan->badCapacity * 2 : 64;
+                scan->bad = realloc(scan->bad, scan->badCapacity * sizeof(u32));
+                assert(scan->bad);
+            }
+            scan->bad[scan->badCount++] = cluster;
+            pthread_mutex_unlock(&scan->lock);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Marks the unreadable clusters bad, returns how many there were or -1 when the root cluster is one of them
+static s64 surfaceScan(Fat32Context* cont, u32 threadCount)
+{
+    if (threadCount == 0)
+    {
+        const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = cores > 0 ? cores : 1;
+    }
+
+    const u32 chunkClusters = FAT32_SCAN_CHUNK_SIZE / cont->cache.clusterSize;
+    SurfaceScan scan = {
+            .cont = cont,
+            .clustersPerChunk = chunkClusters ? chunkClusters : 1,
+    };
+    scan.chunkCount = (cont->clusterCount + scan.clustersPerChunk - 1) / scan.clustersPerChunk;
+    pthread_mutex_init(&scan.lock, NULL);
+
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    assert(threads);
+    u32 started = 0;
+    for (; started < threadCount; ++started)
+    {
+        if (pthread_create(&threads[started], NULL, surfaceScanWorker, &scan) != 0)
+            break;
+    }
+    // Run on the calling thread if no worker could start
+    if (started == 0)
+        surfaceScanWorker(&scan);
+    for (u32 i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&scan.lock);
+
+    s64 result = scan.badCount;
+    for (u32 i = 0; i < scan.badCount; ++i)
+    {
+        if (scan.bad[i] == cont->ebpb->rootDirectoryClusterNumber)
+            result = -1;
+        fatSetNext(cont, scan.bad[i], 0x0ffffff7, false);
+    }
+    free(scan.bad);
+    return result;
+}
+
+ChError fat32Format(Fat32Context** contextP, const char* diskName, u32 flags, u32 threadCount)
+{
+    // Reuse the device of the open context, otherwise the image file as it is
+    Fat32BlockDevice* dev;
+    if (*contextP)
+    {
+        if (!fat32IsWritable(*contextP))
+            return ERROR_READ_ONLY;
+        // Whatever the old context still had cached is overwritten anyway
+        dev = (*contextP)->device;
+        contextFree(contextP);
+    }
+    else
+    {
+        struct stat st;
+        dev = stat(diskName, &st) == 0 ? fat32FileDeviceOpen(diskName, false) : NULL;
+        if (dev && dev->size(dev) < FAT32_MIN_DISK_SIZE)
+            fat32BlockDeviceClose(&dev);
+        if (!dev)
+            dev = fat32FileDeviceCreate(diskName, DISK_SIZE);
+        if (!dev)
+            return ERROR_IO;
+    }
+
+    Fat32Context* context = formatDevice(dev, false);
+    if (!context)
+        return ERROR_IO;
+
+    if (flags & FAT32_FORMAT_SURFACE_SCAN)
+    {
+        const s64 badCount = surfaceScan(context, threadCount);
+        if (badCount < 0)
+        {
+            printf("The root directory cluster is unreadable\n");
+            fat32ContextCloseAndFree(&context);
+            return ERROR_IO;
+        }
+        printf("Surface scan marked %lld bad clusters\n", (long long)badCount);
+        if (!fat32Flush(context))
+        {
+            fat32ContextCloseAndFree(&context);
+            return ERROR_IO;
+        }
+    }
+
+    *contextP = context;
+    printf("Disk succesfully formated\n");
+    return ERROR_OK;
+}
+
+
+
+/* How a new name is stored: an 8.3 entry, with long name fragments in front when it doesn't fit */
+typedef struct NewName
+{
+    u8 shortName[DIRENTRY_FILENAME_LEN];
+    u8 caseFlags; // ntReserved of the short entry
+    u32 fragmentCount; // 0 when the short entry holds the whole name
+    u32 unitCount;
+    u16 units[LFE_MAX_NAME_UNITS];
+    // Alias basis, kept in shortName
+    u32 baseLen;
+    bool needsTail;
+} NewName;
+
+static bool isShortNameChar(u32 c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != 0 && c < 0x80 && strchr("$%'-_@~`!(){}^#&", c));
+}
+
+// Splits a name into what goes on the disk, false if it can't be stored
+static bool newNameEncode(const char* name, NewName* out)
+{
+    const s32 unitCount = fat32Utf8ToUcs2(name, out->units, LFE_MAX_NAME_UNITS);
+    if (unitCount <= 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return false;
+    out->unitCount = unitCount;
+
+    // The extension starts after the last dot, a leading dot doesn't start one
+    u32 dot = unitCount;
+    for (u32 i = 0; i < out->unitCount; ++i)
+    {
+        const u16 c = out->units[i];
+        if (c < 0x20 || (c < 0x80 && strchr("\"*/:<>?\\|", c)))
+            return false;
+        if (c == '.' && i > 0)
+            dot = i;
+    }
+
+    // Upper case 8.3 parts, spaces and other dots are dropped and what 8.3 can't hold becomes '_'
+    memset(out->shortName, ' ', DIRENTRY_FILENAME_LEN);
+    u32 baseLen = 0;
+    u32 extLen = 0;
+    u32 lowerParts = 0;
+    u32 upperParts = 0;
+    bool isLossy = false;
+    for (u32 i = 0; i < out->unitCount; ++i)
+    {
+        if (i == dot)
+            continue;
+        const u32 part = i > dot ? 2 : 1;
+        u32 c = out->units[i];
+        if (c == ' ' || c == '.')
+        {
+            isLossy = true;
+            continue;
+        }
+        if (c >= 'a' && c <= 'z')
+        {
+            lowerParts |= part;
+            c -= 0x20;
+        }
+        else if (c >= 'A' && c <= 'Z')
+        {
+            upperParts |= part;
+        }
+        if (!isShortNameChar(c))
+        {
+            c = '_';
+            isLossy = true;
+        }
+
+        if (part == 2 && extLen++ < 3)
+            out->shortName[8 + extLen - 1] = c;
+        else if (part == 1 && baseLen++ < 8)
+            out->shortName[baseLen - 1] = c;
+    }
+
+    // A name that fits 8.3 needs no long name, as long as each part is in one case
+    const bool isTruncated = baseLen > 8 || extLen > 3 || (dot < out->unitCount && extLen == 0);
+    if (!isLossy && !isTruncated && baseLen > 0 && (lowerParts & upperParts) == 0)
+    {
+        out->caseFlags = ((lowerParts & 1) ? DIRENTRY_NT_LOWER_BASE : 0) | ((lowerParts & 2) ? DIRENTRY_NT_LOWER_EXT : 0);
+        out->fragmentCount = 0;
+        return true;
+    }
+
+    out->caseFlags = 0;
+    out->fragmentCount = (out->unitCount + LFE_ENTRY_NAME_LEN - 1) / LFE_ENTRY_NAME_LEN;
+    out->baseLen = umin(baseLen, 8);
+    out->needsTail = isLossy || isTruncated;
+    if (out->baseLen == 0)
+    {
+        out->shortName[0] = '_';
+        out->baseLen = 1;
+        out->needsTail = true;
+    }
+    return true;
+}
+
+// Needs a directory write section on the directory, builds its name index if there is none
+static bool dirHasName(Fat32Context* cont, u64 dirAddress, const char* name)
+{
+    Fat32NameIndex* index = nameIndexFind(cont, fat32AddressToCluster(cont, dirAddress));
+    if (!index)
+        index = nameIndexBuild(cont, dirAddress);
+    char folded[LFE_FULL_NAME_LEN + 1];
+    nameFold(name, folded, sizeof(folded));
+    return nameIndexProbe(index, folded, nameIndexHash(folded))->hash != 0;
+}
+
+// Picks the 8.3 alias of a long name, the basis itself when nothing was lost, else the first free ~N.
+// Needs a directory write section on the directory.
+static bool newNameMakeAlias(Fat32Context* cont, u64 dirAddress, NewName* name, u8 attributes)
+{
+    char basis[8];
+    memcpy(basis, name->shortName, sizeof(basis));
+
+    // From ~5 on the basis is 2 characters and a hash of the long name, so similar names don't probe every number
+    u32 hash = 2166136261u;
+    for (u32 i = 0; i < name->unitCount; ++i)
+        hash = (hash ^ name->units[i]) * 16777619u;
+    char hashed[8];
+    const u32 hashedPrefix = umin(name->baseLen, 2);
+    memcpy(hashed, basis, hashedPrefix);
+    snprintf(hashed + hashedPrefix, sizeof(hashed) - hashedPrefix, "%04X", (hash ^ (hash >> 16)) & 0xffff);
+    const u32 hashedLen = hashedPrefix + 4;
+
+    DirectoryEntry probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.attributes = attributes;
+    for (u32 n = name->needsTail ? 1 : 0; n < 1000000; ++n)
+    {
+        memset(name->shortName, ' ', 8);
+        if (n == 0)
+        {
+            memcpy(name->shortName, basis, name->baseLen);
+        }
+        else
+        {
+            char tail[8];
+            const u32 tailLen = snprintf(tail, sizeof(tail), "~%u", n);
+            const u32 keep = umin(n < 5 ? name->baseLen : hashedLen, 8 - tailLen);
+            memcpy(name->shortName, n < 5 ? basis : hashed, keep);
+            memcpy(name->shortName + keep, tail, tailLen);
+        }
+
+        char shortName[DIRENTRY_FILENAME_LEN + 2];
+        memcpy(probe.fileName, name->shortName, DIRENTRY_FILENAME_LEN);
+        directoryEntryGetShortName(&probe, shortName);
+        if (!dirHasName(cont, dirAddress, shortName))
+            return true;
+    }
+    return false;
+}
+
+// Fragments are numbered from 1, each holds 13 characters padded with 0xFFFF after the terminator
+static void newNameFillFragment(const NewName* name, u32 fragment, u8 checksum, LfeEntry* out)
+{
+    u16 chars[LFE_ENTRY_NAME_LEN];
+    for (u32 i = 0; i < LFE_ENTRY_NAME_LEN; ++i)
+    {
+        const u32 pos = (fragment - 1) * LFE_ENTRY_NAME_LEN + i;
+        chars[i] = pos < name->unitCount ? name->units[pos] : pos == name->unitCount ? 0 : 0xffff;
+    }
+    out->nameStrIndex = fragment | (fragment == name->fragmentCount ? LFE_LAST_FRAGMENT : 0);
+    out->attributes = DIRENTRY_ATTR_LONG_NAME;
+    out->type = 0;
+    out->checksum = checksum;
+    out->alwaysZero = 0;
+    memcpy(out->name0, chars, sizeof(out->name0));
+    memcpy(out->name1, chars + 5, sizeof(out->name1));
+    memcpy(out->name2, chars + 11, sizeof(out->name2));
+}
+
+// Cluster of the directory a create goes into, 0 if it doesn't exist
+static u32 resolveParentDirectory(Fat32Context* cont, const char* currentFolder)
+{
+    if (currentFolder[0] == PATH_SEP)
+        currentFolder++;
+    if (currentFolder[0] == 0)
+        return cont->ebpb->rootDirectoryClusterNumber;
+
+    DirectoryIteratorEntry* found = fat32OpenFile(cont, currentFolder);
+    if (!found)
+    {
+        printf("Directory '%s' not found\n", currentFolder);
+        return 0;
+    }
+    u32 cluster = 0;
+    if (!directoryEntryIsDirectory(found->entry))
+        printf("'%s' is not a directory\n", currentFolder);
+    else
+        cluster = directoryEntryGetFirstClusterNumber(found->entry);
+    directoryIteratorEntryFree(&found);
+    return cluster;
+}
+
+static void fillDirectoryEntry(DirectoryEntry* directoryEntry, const Fat32NewEntry* newEntry, const NewName* name, u32 cluster)
+{
+    memcpy(directoryEntry->fileName, name->shortName, DIRENTRY_FILENAME_LEN);
+    directoryEntry->attributes = newEntry->attributes;
+    directoryEntry->ntReserved = name->caseFlags;
+    directoryEntry->creationTimeTenthSec = 0x25;
+    directoryEntry->creationTime = 0x7e3c;
+    directoryEntry->creationDate = 0x4262;
+    directoryEntry->accessDate  = 0x4262;
+    directoryEntry->entryFirstClusterNum1 = (cluster >> 16) & 0xffff;
+    directoryEntry->modificationTime = 0x7e3c;
+    directoryEntry->modificationDate = 0x4262;
+    directoryEntry->entryFirstClusterNum2 = cluster & 0xffff;
+    directoryEntry->fileSize = (newEntry->attributes & DIRENTRY_ATTR_DIRECTORY) ? 0 : newEntry->size;
+}
+
+// Cuts the first count clusters off an allocated chain, returns the first of them
+static u32 chainTake(Fat32Context* cont, ClusterPtr* chain, u64 count)
+{
+    if (count == 0)
+        return 0;
+
+    const u32 first = clusterPtrGetIndex(*chain);
+    u32 tail = first;
+    for (u64 i = 1; i < count; ++i)
+        tail = clusterPtrGetIndex(fatGetNextClusterPtr(cont, tail));
+    *chain = fatGetNextClusterPtr(cont, tail);
+    if (clusterPtrIsLastCluster(*chain))
+        *chain = 0;
+    fatSetNextClusterPtr(cont, tail, 0x0fffffff);
+    return first;
+}
+
+static u64 newEntryClusterCount(const Fat32NewEntry* entry, u32 clusterSizeBytes)
+{
+    if (entry->attributes & DIRENTRY_ATTR_DIRECTORY)
+        return 1;
+    return ((u64)entry->size + clusterSizeBytes - 1) / clusterSizeBytes;
+}
+
+/* Where createDirectoryEntries puts an entry: a run of deleted slots or the end of the directory */
+typedef struct NewEntryPlan
+{
+    u32 slotCount;
+    u32 reuse; // First of its slots in the reused ones, NEW_ENTRY_AT_END if it is appended
+} NewEntryPlan;
+
+#define NEW_ENTRY_AT_END 0xffffffff
+
+// Needs a directory write section on dirCluster
+static u32 createDirectoryEntries(Fat32Context* cont, u32 dirCluster, const Fat32NewEntry* entries, u32 count)
+{
+    const u64 dirAddress = fat32GetClusterAddress(cont, dirCluster);
+    const u32 clusterSizeBytes = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize;
+    const u32 entriesPerCluster = clusterSizeBytes / sizeof(DirectoryEntry);
+
+    // Upper bounds, names that turn out to exist are skipped while writing
+    NewEntryPlan* plans = malloc(count * sizeof(NewEntryPlan));
+    assert(plans);
+    NewName name;
+    u64 slotsNeeded = 0;
+    u64 dataClusters = 0;
+    for (u32 i = 0; i < count; ++i)
+    {
+        plans[i].slotCount = newNameEncode(entries[i].name, &name) ? name.fragmentCount + 1 : 1;
+        plans[i].reuse = NEW_ENTRY_AT_END;
+        slotsNeeded += plans[i].slotCount;
+        dataClusters += newEntryClusterCount(&entries[i], clusterSizeBytes);
+    }
+
+    // Walk the directory once for the runs of deleted slots to reuse, its first unused slot and the end of its chain.
+    // A long name has to be in one run, which can go on into the next cluster.
+    const u32 reuseCapacity = umin(slotsNeeded, (u64)cont->clusterCount * entriesPerCluster);
+    u64* reuse = malloc(reuseCapacity * sizeof(u64));
+    u32* runStarts = malloc(reuseCapacity * sizeof(u32) * 2);
+    assert(reuse && runStarts);
+    u32* runLengths = runStarts + reuseCapacity;
+    u32 reuseCount = 0;
+    u32 runCount = 0;
+    bool isInRun = false;
+    u32 lastCluster = dirCluster;
+    u32 chainLength = 0;
+    u32 endCluster = 0;
+    u32 endIndex = 0;
+    u32 endSlot = 0;
+    bool isOk = true;
+    while (true)
+    {
+        const u8* data = fat32CacheGetCluster(cont, lastCluster);
+        if (!data || chainLength > cont->clusterCount)
+        {
+            isOk = false;
+            break;
+        }
+        for (u32 slot = 0; endCluster == 0 && slot < entriesPerCluster; ++slot)
+        {
+            const u8 first = data[slot * sizeof(DirectoryEntry)];
+            if (first == 0)
+            {
+                endCluster = lastCluster;
+                endIndex = chainLength;
+                endSlot = slot;
+            }
+            else if (first == 0xe5 && reuseCount < reuseCapacity)
+            {
+                if (!isInRun)
+                {
+                    runStarts[runCount] = reuseCount;
+                    runLengths[runCount++] = 0;
+                    isInRun = true;
+                }
+                ++runLengths[runCount - 1];
+                reuse[reuseCount++] = fat32GetClusterAddress(cont, lastCluster) + slot * sizeof(DirectoryEntry);
+            }
+            else
+            {
+                isInRun = false;
+            }
+        }
+        ++chainLength;
+
+        const ClusterPtr next = fatGetNextClusterPtr(cont, lastCluster);
+        if (clusterPtrIsNull(next) || clusterPtrIsLastCluster(next) || clusterPtrIsBadCluster(next))
+            break;
+        lastCluster = clusterPtrGetIndex(next);
+    }
+    if (!isOk)
+    {
+        free(runStarts);
+        free(reuse);
+        free(plans);
+        return 0;
+    }
+    if (endCluster == 0)
+    {
+        // Every slot is used, the entries start in a new cluster
+        endCluster = lastCluster;
+        endIndex = chainLength - 1;
+        endSlot = entriesPerCluster;
+    }
+
+    // Entries go into the first run with room for them, the rest is appended
+    u64 endSlotsNeeded = 0;
+    for (u32 i = 0; i < count; ++i)
+    {
+        for (u32 run = 0; run < runCount && plans[i].reuse == NEW_ENTRY_AT_END; ++run)
+        {
+            if (runLengths[run] >= plans[i].slotCount)
+            {
+                plans[i].reuse = runStarts[run];
+                runStarts[run] += plans[i].slotCount;
+                runLengths[run] -= plans[i].slotCount;
+            }
+        }
+        if (plans[i].reuse == NEW_ENTRY_AT_END)
+            endSlotsNeeded += plans[i].slotCount;
+    }
+    free(runStarts);
+
+    const u64 freeSlots = (u64)(entriesPerCluster - endSlot) + (u64)(chainLength - endIndex - 1) * entriesPerCluster;
+    const u32 newDirClusters = endSlotsNeeded > freeSlots
+            ? (endSlotsNeeded - freeSlots + entriesPerCluster - 1) / entriesPerCluster
+            : 0;
+
+    // One allocation for the directory growth and the data of every new entry
+    const u64 totalClusters = newDirClusters + dataClusters;
+    ClusterPtr chain = 0;
+    if (totalClusters > __atomic_load_n(&cont->freeMap.freeCount, __ATOMIC_RELAXED)
+        || (totalClusters && clusterPtrIsNull(chain = fat32AllocateClusters(cont, totalClusters))))
+    {
+        // Another thread may have taken the clusters since the check
+        printf("No free clusters left on the disk\n");
+        free(reuse);
+        free(plans);
+        return 0;
+    }
+
+    // The growth is zeroed before it is linked, entries that end up skipped must not leave stale data in the directory
+    const u32 growth = chainTake(cont, &chain, newDirClusters);
+    for (ClusterPtr current = growth; isOk && !clusterPtrIsNull(current) && !clusterPtrIsLastCluster(current);
+         current = fatGetNextClusterPtr(cont, clusterPtrGetIndex(current)))
+    {
+        isOk = fat32CacheNewCluster(cont, clusterPtrGetIndex(current)) != NULL;
+    }
+    if (growth && isOk)
+        fatSetNextClusterPtr(cont, lastCluster, growth);
+    else if (growth)
+        fat32FreeClusterChain(cont, growth);
+
+    u32 cluster = endCluster;
+    u32 slot = endSlot;
+    u32 usedTail = lastCluster; // Last directory cluster that was there before or holds a new entry
+    u32 created = 0;
+    for (u32 i = 0; i < count && isOk; ++i)
+    {
+        // The name index sees every entry written so far, so this also catches repeats inside the batch
+        if (entries[i].name[0] == 0)
+        {
+            printf("Empty name\n");
+            continue;
+        }
+        if (!newNameEncode(entries[i].name, &name))
+        {
+            printf("'%s' is not a valid name\n", entries[i].name);
+            continue;
+        }
+        DirectoryIteratorEntry* existing = findInDirectory(cont, dirAddress, entries[i].name);
+        if (existing)
+        {
+            printf("'%s' already exists\n", entries[i].name);
+            directoryIteratorEntryFree(&existing);
+            continue;
+        }
+        if (name.fragmentCount && !newNameMakeAlias(cont, dirAddress, &name, entries[i].attributes))
+        {
+            printf("No free short name for '%s'\n", entries[i].name);
+            continue;
+        }
+
+        // Long name fragments first, the short entry last
+        u64 addresses[LFE_MAX_FRAGMENTS + 1];
+        for (u32 j = 0; j < plans[i].slotCount; ++j)
+        {
+            if (plans[i].reuse != NEW_ENTRY_AT_END)
+            {
+                addresses[j] = reuse[plans[i].reuse + j];
+                continue;
+            }
+            if (slot == entriesPerCluster)
+            {
+                // Everything past the end of the directory is free, so the next cluster starts zeroed
+                const bool isGrowth = usedTail != lastCluster || cluster == lastCluster;
+                cluster = clusterPtrGetIndex(fatGetNextClusterPtr(cont, cluster));
+                if (!fat32CacheNewCluster(cont, cluster))
+                {
+                    isOk = false;
+                    break;
+                }
+                if (isGrowth)
+                    usedTail = cluster;
+                slot = 0;
+            }
+            addresses[j] = fat32GetClusterAddress(cont, cluster) + slot * sizeof(DirectoryEntry);
+            ++slot;
+        }
+        if (!isOk)
+            break;
+
+        const u32 first = chainTake(cont, &chain, newEntryClusterCount(&entries[i], clusterSizeBytes));
+        // A new directory starts with an empty cluster
+        isOk = !(entries[i].attributes & DIRENTRY_ATTR_DIRECTORY) || fat32CacheNewCluster(cont, first);
+
+        // Fetched last, the new cluster above may have evicted the directory's
+        const u8 checksum = calcShortNameChecksum(name.shortName);
+        for (u32 j = 0; isOk && j < name.fragmentCount; ++j)
+        {
+            u32 slotCluster;
+            LfeEntry* lfe = (LfeEntry*)cacheGetAddress(cont, addresses[j], &slotCluster);
+            isOk = lfe != NULL;
+            if (lfe)
+            {
+                newNameFillFragment(&name, name.fragmentCount - j, checksum, lfe);
+                fat32CacheMarkDirty(cont, slotCluster);
+            }
+        }
+        const u64 address = addresses[name.fragmentCount];
+        u32 entryCluster;
+        DirectoryEntry* directoryEntry = isOk ? (DirectoryEntry*)cacheGetAddress(cont, address, &entryCluster) : NULL;
+        if (!directoryEntry)
+        {
+            if (first)
+                fat32FreeClusterChain(cont, first);
+            isOk = false;
+            break;
+        }
+        fillDirectoryEntry(directoryEntry, &entries[i], &name, first);
+        fat32CacheMarkDirty(cont, entryCluster);
+
+        nameIndexAddEntry(cont, dirAddress, directoryEntry, name.fragmentCount ? entries[i].name : NULL, address);
+        dentryOnCreate(cont, dirCluster, entries[i].name);
+        ++created;
+    }
+    free(reuse);
+    free(plans);
+
+    // Growth and data clusters reserved for skipped entries
+    const ClusterPtr unused = growth ? fatGetNextClusterPtr(cont, usedTail) : 0;
+    if (!clusterPtrIsNull(unused) && !clusterPtrIsLastCluster(unused) && !clusterPtrIsBadCluster(unused))
+    {
+        for (ClusterPtr current = unused; !clusterPtrIsNull(current) && !clusterPtrIsLastCluster(current);
+             current = fatGetNextClusterPtr(cont, clusterPtrGetIndex(current)))
+        {
+            cacheForget(cont, clusterPtrGetIndex(current));
+        }
+        fatSetNextClusterPtr(cont, usedTail, 0x0fffffff);
+        fat32FreeClusterChain(cont, clusterPtrGetIndex(unused));
+    }
+    if (!clusterPtrIsNull(chain))
+        fat32FreeClusterChain(cont, chain);
+    return created;
+}
+
+u32 fat32CreateDirectoryEntries(Fat32Context* cont, const char* currentFolder, const Fat32NewEntry* entries, u32 count)
+{
+    if (!fat32IsWritable(cont))
+        return 0;
+
+    const u64 start = statsNow();
+    lockShared(cont, &cont->volumeLock);
+    const u32 dirCluster = resolveParentDirectory(cont, currentFolder);
+    u32 created = 0;
+    if (dirCluster != 0 && count != 0)
+    {
+        dirWriteBegin(cont, dirCluster);
+        created = createDirectoryEntries(cont, dirCluster, entries, count);
+        if (!dirWriteEnd(cont, dirCluster))
+            printf("Failed to write directory changes: %s\n", strerror(errno));
+    }
+    unlockRw(cont, &cont->volumeLock);
+    statsRecord(cont, FAT32_STATS_CREATE, start);
+    return created;
+}
+
+void fat32CreateDirectoryEntry(Fat32Context* cont, const char* currentFolder,const char* entryName,u32 size,u8 attributes)
+{
+    const Fat32NewEntry entry = {
+            .name = entryName,
+            .size = size,
+            .attributes = attributes,
+    };
+    fat32CreateDirectoryEntries(cont, currentFolder, &entry, 1);
+}
+
+
+DirectoryIteratorEntry* fat32OpenFile(Fat32Context* cont, const char* path)
+{
+    const u64 start = statsNow();
+    lockShared(cont, &cont->volumeLock);
+    DirectoryIteratorEntry* entry = findPath(cont, path, cont->rootDirectoryAddress, NULL);
+    unlockRw(cont, &cont->volumeLock);
+    statsRecord(cont, FAT32_STATS_LOOKUP, start);
+    return entry;
+}
+
+static bool hasLower(const char* str)
+{
+    for (size_t i=0; i < strlen(str); ++i)
+        if (islower(str[i]))
+            return true;
+    return false;
+}
+
+ChError fsRenameVolume(Fat32Context* cont, const char* name)
+{
+    const size_t nameLen = strlen(name);
+    if (nameLen > EBPB_LABEL_LEN)
+    {
+        printf("New volume label is too long (%i chars), max is %i\n", nameLen, EBPB_LABEL_LEN);
+        return ERROR_INVALID_ARG;
+    }
+    if (!fat32IsWritable(cont))
+        return ERROR_READ_ONLY;
+    char* nameUpper = strtToUpper(name);
+    if (hasLower(name))
+    {
+        printf("New volume label is not lowercase: '%s', using uppercase: '%s'\n", name, nameUpper);
+    }
+
+    uint8_t buffer[DIRENTRY_FILENAME_LEN];
+    memset(buffer, ' ', DIRENTRY_FILENAME_LEN); // Write padding
+    memcpy((char*)buffer, nameUpper, strlen(nameUpper)); // Copy string without null terminator
 
-    context->fatSizeBytes = context->ebpb->sectorsPerFat * context->bpb->sectorSize;
-    context->fat = malloc(context->fatSizeBytes);
-    assert(context->fat);
+    // Change entry value in root directory, its write section also covers the EBPB label
+    const u32 rootCluster = fat32AddressToCluster(cont, cont->rootDirectoryAddress);
+    lockShared(cont, &cont->volumeLock);
+    dirWriteBegin(cont, rootCluster);
+    {
+        DirectoryIterator it;
+        directoryIteratorInit(&it, cont->rootDirectoryAddress);
+        DirectoryIteratorRecord labelEntry;
+        bool isFound = false;
+        while (iteratorNextRecord(cont, &it, &labelEntry))
+        {
+            if (directoryEntryIsVolumeLabel(&labelEntry.entry))
+            {
+                isFound = true;
+                break;
+            }
+        }
 
-    const u64 fatStart = context->bpb->reservedSectorCount * context->bpb->sectorSize;
-    fseek(context->file, fatStart, SEEK_SET);
+        if (!isFound)
+        {
+            printf("BUG: Failed to find volume label entry\n");
+            assert(false);
+            abort();
+        }
 
-    fread(context->fat, 1, context->fatSizeBytes, context->file);
-    context->isFatModified = false;
+        u32 labelCluster;
+        u8* labelData = cacheGetAddress(cont, labelEntry.address, &labelCluster);
+        assert(labelData);
+        memcpy(labelData, buffer, DIRENTRY_FILENAME_LEN);
+        fat32CacheMarkDirty(cont, labelCluster);
+    }
 
-    context->firstDataSector = context->bpb->reservedSectorCount + (context->bpb->fatCount*context->ebpb->sectorsPerFat);
-    context->rootDirectoryAddress = context->firstDataSector*context->bpb->sectorSize;
-    u64 dataSectors = context->ebpb->sectorsPerFat - context->firstDataSector;
+    // Change EBPB value
+    {
+        memcpy(cont->ebpb->label, buffer, DIRENTRY_FILENAME_LEN);
+        cont->isEbpbModified = true;
+    }
+    const bool isWritten = dirWriteEnd(cont, rootCluster);
+    unlockRw(cont, &cont->volumeLock);
+
+    free(nameUpper);
+    return isWritten ? ERROR_OK : ERROR_IO;
+}
+
+//------------------------------------------------------------------------------
 
-    u64 countOfClusters  = dataSectors / context->bpb->sectorsPerClusters;
+/*
+ * Deleting and compacting. A delete marks the short entry and the long name
+ * fragments in front of it as unused (0xE5) and frees its chain, creates take
+ * those slots again before they grow the directory. Compaction moves the live
+ * entries of a directory to its start and frees the clusters behind them.
+ * Neither looks at open handles.
+ */
 
-    if(countOfClusters >= 65526)
+// Addresses of the slots of a directory up to its end marker, NULL if a cluster can't be read
+static u64* dirSlotAddresses(Fat32Context* cont, u32 dirCluster, u32* countOut, u32* clustersOut)
+{
+    const u32 clusterSizeBytes = cont->cache.clusterSize;
+    const u32 entriesPerCluster = clusterSizeBytes / sizeof(DirectoryEntry);
+
+    u32 capacity = entriesPerCluster;
+    u32 count = 0;
+    u32 clusters = 0;
+    u64* slots = malloc(capacity * sizeof(u64));
+    assert(slots);
+    bool isEnd = false;
+    ClusterPtr current = dirCluster;
+    while (!clusterPtrIsNull(current) && !clusterPtrIsLastCluster(current) && !clusterPtrIsBadCluster(current))
     {
-        *isFAT32 = true;
+        const u32 cluster = clusterPtrGetIndex(current);
+        const u8* data = isEnd ? NULL : fat32CacheGetCluster(cont, cluster);
+        if ((!isEnd && !data) || clusters > cont->clusterCount)
+        {
+            free(slots);
+            return NULL;
+        }
+        for (u32 slot = 0; !isEnd && slot < entriesPerCluster; ++slot)
+        {
+            if (data[slot * sizeof(DirectoryEntry)] == 0)
+            {
+                isEnd = true;
+                break;
+            }
+            if (count == capacity)
+            {
+                capacity *= 2;
+                slots = realloc(slots, capacity * sizeof(u64));
+                assert(slots);
+            }
+            slots[count++] = fat32GetClusterAddress(cont, cluster) + slot * sizeof(DirectoryEntry);
+        }
+        ++clusters;
+        current = fatGetNextClusterPtr(cont, cluster);
     }
-    else
+    *countOut = count;
+    if (clustersOut)
+        *clustersOut = clusters;
+    return slots;
+}
+
+static bool directoryIsEmpty(Fat32Context* cont, u64 address)
+{
+    DirectoryIterator it;
+    directoryIteratorInit(&it, address);
+    DirectoryIteratorRecord record;
+    while (iteratorNextRecord(cont, &it, &record))
     {
-        *isFAT32 = false;
+        if (record.entry.fileName[0] != '.')
+            return false;
     }
+    return true;
+}
 
-    return context;
+// Needs a directory write section on dirCluster
+static ChError deleteEntry(Fat32Context* cont, u32 dirCluster, const DirectoryIteratorEntry* found)
+{
+    u32 slotCount;
+    u64* slots = dirSlotAddresses(cont, dirCluster, &slotCount, NULL);
+    if (!slots)
+        return ERROR_IO;
+
+    u32 index = 0;
+    while (index < slotCount && slots[index] != found->address)
+        ++index;
+    u32 cluster;
+    DirectoryEntry* entry = index < slotCount ? (DirectoryEntry*)cacheGetAddress(cont, slots[index], &cluster) : NULL;
+    // Someone else deleted it since the lookup
+    if (!entry || memcmp(entry, found->entry, sizeof(DirectoryEntry)) != 0)
+    {
+        free(slots);
+        return ERROR_NOT_FOUND;
+    }
+    const u8 checksum = calcShortNameChecksum(entry->fileName);
+    entry->fileName[0] = 0xe5;
+    fat32CacheMarkDirty(cont, cluster);
+
+    // The long name fragments belonging to it come right before
+    while (index-- > 0)
+    {
+        LfeEntry* lfe = (LfeEntry*)cacheGetAddress(cont, slots[index], &cluster);
+        if (!lfe || lfe->nameStrIndex == 0xe5 || !directoryEntryIsLFE(lfe->attributes) || lfe->checksum != checksum)
+            break;
+        lfe->nameStrIndex = 0xe5;
+        fat32CacheMarkDirty(cont, cluster);
+    }
+    free(slots);
 
+    const u32 first = directoryEntryGetFirstClusterNumber(found->entry);
+    if (first >= 2)
+    {
+        if (directoryEntryIsDirectory(found->entry))
+        {
+            // Its cached clusters must not reach the disk once they belong to something else
+            for (ClusterPtr current = first;
+                 !clusterPtrIsNull(current) && !clusterPtrIsLastCluster(current) && !clusterPtrIsBadCluster(current);
+                 current = fatGetNextClusterPtr(cont, clusterPtrGetIndex(current)))
+            {
+                cacheForget(cont, clusterPtrGetIndex(current));
+            }
+            nameIndexDrop(cont, first);
+        }
+        fat32FreeClusterChain(cont, first);
+    }
+    nameIndexDrop(cont, dirCluster);
+    return ERROR_OK;
 }
 
+ChError fat32DeleteEntry(Fat32Context* cont, const char* path)
+{
+    if (!fat32IsWritable(cont))
+        return ERROR_READ_ONLY;
+
+    // Deleting a directory also keeps creates out of it until it is gone
+    lockExclusive(cont, &cont->volumeLock);
+    u32 dirCluster = 0;
+    DirectoryIteratorEntry* found = findPath(cont, path, cont->rootDirectoryAddress, &dirCluster);
+    ChError result = ERROR_OK;
+    if (!found)
+    {
+        printf("'%s' not found\n", path);
+        result = ERROR_NOT_FOUND;
+    }
+    else if (found->entry->fileName[0] == '.' || directoryEntryIsVolumeLabel(found->entry))
+    {
+        printf("Can't delete '%s'\n", path);
+        result = ERROR_INVALID_ARG;
+    }
+    else if (directoryEntryIsDirectory(found->entry)
+             && !directoryIsEmpty(cont, fat32GetClusterAddress(cont, directoryEntryGetFirstClusterNumber(found->entry))))
+    {
+        printf("Directory '%s' is not empty\n", path);
+        result = ERROR_NOT_EMPTY;
+    }
+    else
+    {
+        dirWriteBegin(cont, dirCluster);
+        result = deleteEntry(cont, dirCluster, found);
+        if (!dirWriteEnd(cont, dirCluster) && result == ERROR_OK)
+            result = ERROR_IO;
+        fat32DentryCacheClear(cont);
+    }
+    if (found)
+        directoryIteratorEntryFree(&found);
+    unlockRw(cont, &cont->volumeLock);
+    return result;
+}
 
-Fat32Context* fat32Create(const char* devFilePath)
+// Needs a directory write section on dirCluster
+static ChError compactDirectory(Fat32Context* cont, u32 dirCluster, u32* freedClusters)
 {
-    Fat32Context* context = malloc(sizeof(Fat32Context));
-    context->file = fopen(devFilePath, "w+b");
+    const u32 clusterSizeBytes = cont->cache.clusterSize;
+    const u32 entriesPerCluster = clusterSizeBytes / sizeof(DirectoryEntry);
+
+    u32 slotCount;
+    u32 clusterCount;
+    u64* slots = dirSlotAddresses(cont, dirCluster, &slotCount, &clusterCount);
+    if (!slots)
+        return ERROR_IO;
+
+    // Copy out the live slots in order, long name fragments stay in front of their entry
+    DirectoryEntry* live = malloc((slotCount + 1) * sizeof(DirectoryEntry));
+    assert(live);
+    u32 liveCount = 0;
+    for (u32 i = 0; i < slotCount; ++i)
+    {
+        const u8* data = cacheGetAddress(cont, slots[i], NULL);
+        if (!data)
+        {
+            free(live);
+            free(slots);
+            return ERROR_IO;
+        }
+        if (data[0] != 0xe5)
+            memcpy(&live[liveCount++], data, sizeof(DirectoryEntry));
+    }
 
-    if (!context->file)
+    // Rewrite the slots packed, the rest up to the old end becomes the end marker
+    for (u32 i = 0; i < slotCount; ++i)
     {
-        printf("Failed to open device: %s: %s\n", devFilePath, strerror(errno));
-        free(context);
-        return NULL;
+        u32 cluster;
+        u8* data = cacheGetAddress(cont, slots[i], &cluster);
+        if (!data)
+        {
+            free(live);
+            free(slots);
+            return ERROR_IO;
+        }
+        if (i < liveCount)
+            memcpy(data, &live[i], sizeof(DirectoryEntry));
+        else
+            memset(data, 0, sizeof(DirectoryEntry));
+        fat32CacheMarkDirty(cont, cluster);
     }
+    free(live);
+    free(slots);
+
+    // Keep the clusters the entries fill, plus the one holding the end marker when they fill them exactly
+    u32 keep = liveCount / entriesPerCluster + 1;
+    if (keep > clusterCount)
+        keep = clusterCount;
+    u32 freed = 0;
+    if (keep < clusterCount)
+    {
+        u32 last = dirCluster;
+        for (u32 i = 1; i < keep; ++i)
+            last = clusterPtrGetIndex(fatGetNextClusterPtr(cont, last));
+        const u32 rest = clusterPtrGetIndex(fatGetNextClusterPtr(cont, last));
+        for (ClusterPtr current = rest;
+             !clusterPtrIsNull(current) && !clusterPtrIsLastCluster(current) && !clusterPtrIsBadCluster(current);
+             current = fatGetNextClusterPtr(cont, clusterPtrGetIndex(current)))
+        {
+            cacheForget(cont, clusterPtrGetIndex(current));
+        }
+        fatSetNextClusterPtr(cont, last, 0x0fffffff);
+        fat32FreeClusterChain(cont, rest);
+        freed = clusterCount - keep;
+    }
+    nameIndexDrop(cont, dirCluster);
+    if (freedClusters)
+        *freedClusters = freed;
+    return ERROR_OK;
+}
 
-    u64 diskSize = DISK_SIZE;
-    for(int i = 0;i  < diskSize;i++)
+ChError fat32CompactDirectory(Fat32Context* cont, const char* path, u32* freedClusters)
+{
+    if (freedClusters)
+        *freedClusters = 0;
+    if (!fat32IsWritable(cont))
+        return ERROR_READ_ONLY;
+
+    lockShared(cont, &cont->volumeLock);
+    const u32 dirCluster = resolveParentDirectory(cont, path);
+    ChError result = ERROR_NOT_FOUND;
+    if (dirCluster != 0)
     {
-        fwrite("\0",sizeof(u8),1,context->file);
+        dirWriteBegin(cont, dirCluster);
+        result = compactDirectory(cont, dirCluster, freedClusters);
+        if (!dirWriteEnd(cont, dirCluster) && result == ERROR_OK)
+            result = ERROR_IO;
+        // Every entry in it has moved
+        fat32DentryCacheClear(cont);
     }
+    unlockRw(cont, &cont->volumeLock);
+    return result;
+}
 
-    rewind(context->file);
+//------------------------------------------------------------------------------
 
-    context->bpb = malloc(sizeof(BPB));
+/*
+ * File handles. A handle remembers the cluster it last touched, so moving
+ * forward never walks the chain from the start again. Sequential reads grow
+ * a readahead window up to FAT32_READAHEAD_MAX, writes allocate clusters in
+ * batches and the unused tail of the last batch is released on close.
+ */
 
-    u32 clusters;
-    u32 clusterSize;
+static u32 fileClusterSize(const Fat32File* file)
+{
+    return file->cont->bpb->sectorsPerClusters * file->cont->bpb->sectorSize;
+}
 
-    u64 actualFatSize = diskSize/DEFAULT_SECTOR_SIZE;
+// Cluster holding the given cluster index of the file, 0 past the end of the chain
+static u32 fileClusterAt(Fat32File* file, u32 index)
+{
+    if (index >= file->clusterCount)
+        return 0;
 
-    context->bpb->reserved0[0]=0xEB;
-    context->bpb->reserved0[1]=0x58;
-    context->bpb->reserved0[2]=0x90;
-    memcpy(context->bpb->oemIdentifier,"MSDOS4.1",BPB_OEM_LEN);
+    if (file->currentCluster == 0 || index < file->currentIndex)
+    {
+        file->currentCluster = file->firstCluster;
+        file->currentIndex = 0;
+    }
+    while (file->currentIndex < index)
+    {
+        const ClusterPtr next = fatGetNextClusterPtr(file->cont, file->currentCluster);
+        if (clusterPtrIsNull(next) || clusterPtrIsLastCluster(next) || clusterPtrIsBadCluster(next))
+            return 0;
+        file->currentCluster = clusterPtrGetIndex(next);
+        ++file->currentIndex;
+    }
+    return file->currentCluster;
+}
 
-    context->bpb->sectorSize = DEFAULT_SECTOR_SIZE;
-    context->bpb->sectorsPerClusters = DEFAULT_SECTORS_PER_CLUSTER;
-    context->bpb->reservedSectorCount = 32;//According to specification, they use 32
-    context->bpb->fatCount = 2;
-    context->bpb->directoryEntryCount = 0; //fat32 doesn't use this and it must be 0
-    context->bpb->sectorCount = 0; //not for fat32
-    context->bpb->mediaType = 0xF8; //fixed, non-removable drive*/
-    context->bpb->sectorsPerFat = 0; //not for fat32
-    context->bpb->headCount = 0;
-    context->bpb->hiddenSectCount = 0;
-    context->bpb->largeSectCount = actualFatSize;
+// Reads or writes a range inside the allocated chain, one request per contiguous run
+static u64 fileTransfer(Fat32File* file, u64 offset, u8* buffer, u64 size, bool isWrite)
+{
+    Fat32Context* cont = file->cont;
+    const u32 clusterSize = fileClusterSize(file);
+    u64 done = 0;
+    while (done < size)
+    {
+        // Runs of a fragmented range go out together
+        Fat32IoRequest requests[FAT32_IO_BATCH];
+        u32 count = 0;
+        u64 planned = done;
+        while (planned < size && count < FAT32_IO_BATCH)
+        {
+            const u64 pos = offset + planned;
+            const u32 index = pos / clusterSize;
+            const u32 startCluster = fileClusterAt(file, index);
+            if (startCluster == 0)
+                break;
+
+            const u64 skip = pos % clusterSize;
+            u64 runBytes = clusterSize - skip;
+            // Extend the run while the chain stays contiguous
+            for (u32 runLength = 1; runBytes < size - planned; ++runLength)
+            {
+                if (fileClusterAt(file, index + runLength) != startCluster + runLength)
+                    break;
+                runBytes += clusterSize;
+            }
 
+            const u64 chunk = umin(runBytes, size - planned);
+            requests[count++] = (Fat32IoRequest){
+                    .offset = fat32GetClusterAddress(cont, startCluster) + skip,
+                    .data = buffer + planned,
+                    .size = chunk,
+                    .isWrite = isWrite,
+            };
+            planned += chunk;
+        }
+        if (count == 0)
+            break;
 
-    fwrite(context->bpb, sizeof(BPB), 1, context->file);
-    context->isBpbModified = false;
+        fat32Submit(cont, requests, count);
+        // Only what comes before the first failure counts
+        for (u32 i = 0; i < count && requests[i].isDone; ++i)
+            done += requests[i].size;
+        if (done < planned)
+            break;
+    }
+    return done;
+}
 
-    context->ebpb = malloc(sizeof(EBPB));
-    clusters = (u32)((actualFatSize - 2)/( 1 + 2 * 4.0 / DEFAULT_SECTOR_SIZE));
+static void fileUpdateEntry(Fat32File* file)
+{
+    Fat32Context* cont = file->cont;
+    dirWriteBegin(cont, file->parentCluster);
+    u32 cluster;
+    u8* data = cacheGetAddress(cont, file->entryAddress, &cluster);
+    if (data)
+    {
+        DirectoryEntry* entry = (DirectoryEntry*)data;
+        entry->fileSize = file->size;
+        entry->entryFirstClusterNum1 = (file->firstCluster >> 16) & 0xffff;
+        entry->entryFirstClusterNum2 = file->firstCluster & 0xffff;
+        fat32CacheMarkDirty(cont, cluster);
+        file->isEntryModified = false;
+    }
+    dirWriteEnd(cont, file->parentCluster);
+}
 
-    context->ebpb->sectorsPerFat = (clusters * 4 + DEFAULT_SECTOR_SIZE -1) / DEFAULT_SECTOR_SIZE;
+// Makes the chain at least clusterCount long, allocating in batches unless isExact
+static bool fileReserveClusters(Fat32File* file, u32 clusterCount, bool isExact)
+{
+    if (clusterCount <= file->clusterCount)
+        return true;
 
-    //this emulation  of fat32 ,so set dummy numbers
+    Fat32Context* cont = file->cont;
+    const u32 needed = clusterCount - file->clusterCount;
+    u32 batch = needed;
+    if (!isExact && batch < FAT32_WRITE_BATCH_CLUSTERS)
+        batch = FAT32_WRITE_BATCH_CLUSTERS;
+    if (!isExact && batch < file->clusterCount / 2)
+        batch = file->clusterCount / 2;
+    const u32 freeCount = __atomic_load_n(&cont->freeMap.freeCount, __ATOMIC_RELAXED);
+    if (batch > freeCount)
+        batch = freeCount;
+    if (batch < needed)
+        return false;
+
+    lockMutex(cont, &cont->allocLock);
+    const u32 first = allocateClusters(cont, batch, file->lastCluster);
+    unlockMutex(cont, &cont->allocLock);
+    if (first == 0)
+        return false;
+
+    if (file->clusterCount == 0)
+    {
+        file->firstCluster = first;
+    }
+    else
+    {
+        fatSetNextClusterPtr(cont, file->lastCluster, first);
+    }
 
-    context->ebpb->flags = 0x04; //no mirroring, and fat 0 is the active fat
-    context->ebpb->fatVersion = 0; //fat32 version 0:0
-    context->ebpb->rootDirectoryClusterNumber = 0x2; /*there are no clusters 0 and 1 */
-    context->ebpb->fsInfoSectorNumber = 1;
-    context->ebpb->backupSectorNumber = 6;
+    // Find the new tail, the batch was just allocated so this stays in the new run
+    u32 last = first;
+    for (u32 i = 1; i < batch; ++i)
+        last = clusterPtrGetIndex(fatGetNextClusterPtr(cont, last));
+    file->lastCluster = last;
+    file->clusterCount += batch;
+    file->isEntryModified = true;
+    return true;
+}
 
-    memset(context->ebpb->reserved0, 0xA, 12);
+// Cuts the chain down to clusterCount clusters
+static void fileReleaseClusters(Fat32File* file, u32 clusterCount)
+{
+    if (clusterCount >= file->clusterCount)
+        return;
 
-    context->ebpb->driveNumber = 1;
-    context->ebpb->ntFlags = 0x1 | 0x3 | 0xB;
-    context->ebpb->signature = 0x29; //from fat specification indicate that the following fields are present
-    context->ebpb->serialNumber = (u32)time(NULL); /*take a unique volume id*/
+    Fat32Context* cont = file->cont;
+    if (clusterCount == 0)
+    {
+        fat32FreeClusterChain(cont, file->firstCluster);
+        file->firstCluster = 0;
+        file->lastCluster = 0;
+    }
+    else
+    {
+        const u32 newLast = fileClusterAt(file, clusterCount - 1);
+        const ClusterPtr rest = fatGetNextClusterPtr(cont, newLast);
+        fatSetNextClusterPtr(cont, newLast, 0x0fffffff);
+        fat32FreeClusterChain(cont, rest);
+        file->lastCluster = newLast;
+    }
+    file->clusterCount = clusterCount;
+    file->currentCluster = 0;
+    file->currentIndex = 0;
+    file->readaheadSize = 0;
+    file->isEntryModified = true;
+}
 
-    memcpy(context->ebpb->label,"MSDOS 4.1  ",11);
-    memcpy(context->ebpb->systemId,"FAT32   ",8);
+static Fat32File* fileOpen(Fat32Context* cont, const char* path, u32 flags);
+static u64 fileRead(Fat32File* file, void* buffer, u64 size);
+static u64 fileWrite(Fat32File* file, const void* buffer, u64 size);
+static ChError fileTruncate(Fat32File* file, u64 size);
 
-    fseek(context->file, sizeof(BPB), SEEK_SET);
-    fwrite(context->ebpb, sizeof(EBPB), 1, context->file);
-    context->isEbpbModified = false;
+Fat32File* fat32FileOpen(Fat32Context* cont, const char* path, u32 flags)
+{
+    if ((flags & (FAT32_FILE_WRITE | FAT32_FILE_CREATE)) && !fat32IsWritable(cont))
+        return NULL;
 
-    context->fsinfo = malloc(sizeof(FSInfo));
+    lockShared(cont, &cont->volumeLock);
+    Fat32File* file = fileOpen(cont, path, flags);
+    unlockRw(cont, &cont->volumeLock);
+    return file;
+}
 
-    /*make the fs_info structure*/
-    context->fsinfo->leadSignature = FSINFO_LEAD_SIG;
-    context->fsinfo->signature = FSINFO_SIG;
-    context->fsinfo->freeCount = clusters - 1; //cluster 2 is used for the root directory
-    context->fsinfo->nextFree = 3; //sectors start at number 2 is the rootCluster
-    context->fsinfo->trailSig = FSINFO_TRAIL_SIG;
+static Fat32File* fileOpen(Fat32Context* cont, const char* path, u32 flags)
+{
+    u32 parentCluster = 0;
+    DirectoryIteratorEntry* found = findPath(cont, path, cont->rootDirectoryAddress, &parentCluster);
+    if (!found && (flags & FAT32_FILE_CREATE))
+    {
+        // Split into the parent directory and the new name
+        char parent[FAT32_MAX_PATH_LEN] = "/";
+        const char* name = path;
+        const char* sep = strrchr(path, PATH_SEP);
+        if (sep)
+        {
+            const size_t len = umin(sep - path, sizeof(parent) - 2);
+            memcpy(parent + 1, path, len);
+            parent[len + 1] = 0;
+            name = sep + 1;
+        }
+        fat32CreateDirectoryEntry(cont, parent, name, 0, DIRENTRY_ATTR_ARCHIVE);
+        found = findPath(cont, path, cont->rootDirectoryAddress, &parentCluster);
+    }
+    if (!found)
+    {
+        return NULL;
+    }
+    if (!directoryEntryIsFile(found->entry))
+    {
+        printf("'%s' is not a file\n", path);
+        directoryIteratorEntryFree(&found);
+        return NULL;
+    }
 
-    memset(context->fsinfo->reserved0, 0xA, 480);
-    memset(context->fsinfo->reserved1, 0xA, 12);
+    Fat32File* file = calloc(1, sizeof(Fat32File));
+    assert(file);
+    statsAdd(&cont->stats.allocations, 1);
+    file->cont = cont;
+    file->flags = flags;
+    file->entryAddress = found->address;
+    file->parentCluster = parentCluster;
+    file->firstCluster = directoryEntryGetFirstClusterNumber(found->entry);
+    file->size = found->entry->fileSize;
+    directoryIteratorEntryFree(&found);
+
+    // Walk the chain once to know its length and tail
+    if (file->firstCluster)
+    {
+        Fat32ExtentMap map;
+        fat32ExtentMapBuild(cont, file->firstCluster, &map);
+        file->clusterCount = map.clusterCount;
+        if (map.count)
+        {
+            const Fat32Extent* last = &map.extents[map.count - 1];
+            file->lastCluster = last->startCluster + last->length - 1;
+        }
+        fat32ExtentMapFree(&map);
+    }
+    file->readaheadWindow = FAT32_READAHEAD_MIN;
+    return file;
+}
 
-    const u64 fsinfoStart = context->ebpb->fsInfoSectorNumber * context->bpb->sectorSize;
-    fseek(context->file, fsinfoStart, SEEK_SET);
-    fwrite(context->fsinfo, sizeof(FSInfo), 1, context->file);
-    context->isFsinfoModified = false;
+u64 fat32FileRead(Fat32File* file, void* buffer, u64 size)
+{
+    lockShared(file->cont, &file->cont->volumeLock);
+    const u64 readBytes = fileRead(file, buffer, size);
+    unlockRw(file->cont, &file->cont->volumeLock);
+    return readBytes;
+}
 
-    context->fatSizeBytes = context->ebpb->sectorsPerFat * context->bpb->sectorSize;
-    context->fat = malloc(context->fatSizeBytes);
+static u64 fileRead(Fat32File* file, void* buffer, u64 size)
+{
+    if (!(file->flags & FAT32_FILE_READ) || file->position >= file->size)
+        return 0;
 
-    assert(context->fat);
+    size = umin(size, file->size - file->position);
+    u8* out = buffer;
 
-    const u64 fatStart = context->bpb->reservedSectorCount * context->bpb->sectorSize;
-    fseek(context->file, fatStart, SEEK_SET);
+    // Sequential access doubles the readahead window, a jump resets it
+    if (file->position == file->lastReadEnd)
+        file->readaheadWindow = umin(file->readaheadWindow * 2, FAT32_READAHEAD_MAX);
+    else
+        file->readaheadWindow = FAT32_READAHEAD_MIN;
 
-    fwrite(context->fat, 1, context->fatSizeBytes, context->file);
-    context->isFatModified = false;
+    u64 done = 0;
+    while (done < size)
+    {
+        const u64 pos = file->position + done;
+        if (pos >= file->readaheadOffset && pos < file->readaheadOffset + file->readaheadSize)
+        {
+            const u64 chunk = umin(file->readaheadOffset + file->readaheadSize - pos, size - done);
+            memcpy(out + done, file->readahead + (pos - file->readaheadOffset), chunk);
+            done += chunk;
+            continue;
+        }
 
-    context->firstDataSector = context->bpb->reservedSectorCount + (context->bpb->fatCount*context->ebpb->sectorsPerFat);
-    context->rootDirectoryAddress = context->firstDataSector * context->bpb->sectorSize;
+        // Reads bigger than the window go straight to the caller
+        if (size - done >= file->readaheadWindow)
+        {
+            const u64 readBytes = fileTransfer(file, pos, out + done, size - done, false);
+            done += readBytes;
+            break;
+        }
 
-    return context;
+        if (file->readaheadCapacity < file->readaheadWindow)
+        {
+            free(file->readahead);
+            file->readahead = malloc(file->readaheadWindow);
+            assert(file->readahead);
+            statsAdd(&file->cont->stats.allocations, 1);
+            file->readaheadCapacity = file->readaheadWindow;
+        }
+        const u64 fill = umin(file->readaheadWindow, file->size - pos);
+        file->readaheadOffset = pos;
+        file->readaheadSize = fileTransfer(file, pos, file->readahead, fill, false);
+        if (file->readaheadSize == 0)
+            break;
+    }
 
+    file->position += done;
+    file->lastReadEnd = file->position;
+    return done;
 }
-void fat32ContextCloseAndFree(Fat32Context** contextP)
+
+u64 fat32FileWrite(Fat32File* file, const void* buffer, u64 size)
 {
-    Fat32Context* context = *contextP;
-    const u32 backupOffs = context->ebpb->backupSectorNumber*context->bpb->sectorSize;
+    lockShared(file->cont, &file->cont->volumeLock);
+    const u64 written = fileWrite(file, buffer, size);
+    unlockRw(file->cont, &file->cont->volumeLock);
+    return written;
+}
 
-    if (context->isBpbModified)
-    {
-        u64 pos = 0;
-        fseek(context->file, pos, SEEK_SET);
-        fwrite(context->bpb, sizeof(BPB), 1, context->file);
+static u64 fileWrite(Fat32File* file, const void* buffer, u64 size)
+{
+    if (!(file->flags & FAT32_FILE_WRITE) || size == 0)
+        return 0;
 
-        // Write to backup sector
-        pos += backupOffs;
-        fseek(context->file, pos, SEEK_SET);
-        fwrite(context->bpb, sizeof(BPB), 1, context->file);
-    }
+    // FAT file sizes are 32 bit
+    if (file->position + size > 0xffffffffULL)
+        size = file->position < 0xffffffffULL ? 0xffffffffULL - file->position : 0;
 
-    if (context->isEbpbModified)
-    {
-        u64 pos = sizeof(BPB);
-        fseek(context->file, pos, SEEK_SET);
-        fwrite(context->ebpb, sizeof(EBPB), 1, context->file);
+    // Fill a gap left by seeking past the end with zeros
+    if (file->position > file->size && fileTruncate(file, file->position) != ERROR_OK)
+        return 0;
 
-        // Write to backup sector
-        pos += backupOffs;
-        fseek(context->file, pos, SEEK_SET);
-        fwrite(context->ebpb, sizeof(EBPB), 1, context->file);
+    const u32 clusterSize = fileClusterSize(file);
+    const u64 end = file->position + size;
+    if (!fileReserveClusters(file, (end + clusterSize - 1) / clusterSize, false))
+    {
+        printf("No free clusters left on the disk\n");
+        return 0;
     }
 
-    if (context->isFsinfoModified)
-    {
-        u64 pos = context->ebpb->fsInfoSectorNumber * context->bpb->sectorSize;
-        fseek(context->file, pos, SEEK_SET);
-        fread(context->fsinfo, sizeof(FSInfo), 1, context->file);
+    const u64 written = fileTransfer(file, file->position, (u8*)buffer, size, true);
 
-        // Write to backup sector
-        pos += backupOffs;
-        fseek(context->file, pos, SEEK_SET);
-        fwrite(context->fsinfo, sizeof(FSInfo), 1, context->file);
+    // Drop readahead that overlaps the written range
+    if (file->readaheadSize && file->position < file->readaheadOffset + file->readaheadSize
+        && file->position + written > file->readaheadOffset)
+    {
+        file->readaheadSize = 0;
     }
 
-    if (context->isFatModified)
+    file->position += written;
+    if (file->position > file->size)
     {
-        u64 pos = context->bpb->reservedSectorCount*context->bpb->sectorSize;
-        fseek(context->file, pos, SEEK_SET);
-        fwrite(context->fat, 1, context->fatSizeBytes, context->file);
-
-        // Write to backup sector
-        pos += backupOffs;
-        fseek(context->file, pos, SEEK_SET);
-        fwrite(context->fat, 1, context->fatSizeBytes, context->file);
+        file->size = file->position;
+        file->isEntryModified = true;
     }
+    return written;
+}
 
-    fclose(context->file);
-    free(context->bpb);
-    free(context->ebpb);
-    free(context->fat);
-    free(context->fsinfo);
-    free(context);
-    *contextP = NULL;
+s64 fat32FileSeek(Fat32File* file, s64 offset, int whence)
+{
+    s64 base;
+    switch (whence)
+    {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = file->position; break;
+        case SEEK_END: base = file->size; break;
+        default: return -1;
+    }
+    if (base + offset < 0)
+        return -1;
+    file->position = base + offset;
+    return file->position;
 }
 
-uint32_t fat32GetFirstSectorOfCluster(const Fat32Context* cont, uint32_t cluster)
+ChError fat32FileTruncate(Fat32File* file, u64 size)
 {
-    return (cluster - 2) * cont->bpb->sectorsPerClusters + cont->firstDataSector;
+    lockShared(file->cont, &file->cont->volumeLock);
+    const ChError error = fileTruncate(file, size);
+    unlockRw(file->cont, &file->cont->volumeLock);
+    return error;
 }
 
+ChError fat32FileReserve(Fat32File* file, u64 size)
+{
+    if (!(file->flags & FAT32_FILE_WRITE) || size > 0xffffffffULL)
+        return ERROR_INVALID_ARG;
+
+    lockShared(file->cont, &file->cont->volumeLock);
+    const u32 clusterSize = fileClusterSize(file);
+    const bool isReserved = fileReserveClusters(file, (size + clusterSize - 1) / clusterSize, true);
+    unlockRw(file->cont, &file->cont->volumeLock);
+    return isReserved ? ERROR_OK : ERROR_NO_SPACE;
+}
 
-void fat32ListDirectory(Fat32Context* cont, u64 addr)
+static ChError fileTruncate(Fat32File* file, u64 size)
 {
-    // Print table heading
-    printf("%-11.11s  |  %50s  |  %10s  |  %s  |  %s\n",
-          "FILE NAME", "LONG FILE NAME", "SIZE", "ATTRS.", "CREAT. DATE & TIME");
-    for (int i=0; i < 116; ++i)
+    if (!(file->flags & FAT32_FILE_WRITE) || size > 0xffffffffULL)
+        return ERROR_INVALID_ARG;
+
+    const u32 clusterSize = fileClusterSize(file);
+    if (size < file->size)
     {
-        printf((i == 13 || i == 68 || i == 83 || i == 94) ? "|" : "-");
+        fileReleaseClusters(file, (size + clusterSize - 1) / clusterSize);
+        file->size = size;
+        file->isEntryModified = true;
+        return ERROR_OK;
     }
-    printf("\n");
 
-    // List directory
-    DirectoryIterator* it = directoryIteratorNew(addr);
-    int fileCount = 0;
-    while (true)
+    // Growing, the new bytes read as zeros
+    if (!fileReserveClusters(file, (size + clusterSize - 1) / clusterSize, false))
+        return ERROR_NO_SPACE;
+
+    u8* zeros = calloc(1, clusterSize);
+    assert(zeros);
+    u64 pos = file->size;
+    while (pos < size)
     {
-        DirectoryIteratorEntry* dirEntry = directoryIteratorNext(cont, it);
-        if (dirEntry == NULL)
+        const u64 chunk = umin(clusterSize - pos % clusterSize, size - pos);
+        if (fileTransfer(file, pos, zeros, chunk, true) != chunk)
             break;
+        pos += chunk;
+    }
+    free(zeros);
 
-        char* attrs = directoryEntryAttrsToString(dirEntry->entry->attributes);
+    file->size = pos;
+    file->isEntryModified = true;
+    return pos == size ? ERROR_OK : ERROR_IO;
+}
 
-        DirectoryEntryDate cDate = toDirectoryEntryDate(dirEntry->entry->creationDate);
+void fat32FileClose(Fat32File** fileP)
+{
+    Fat32File* file = *fileP;
+    if (!file)
+        return;
+
+    // Give back what the last write batch didn't use
+    Fat32Context* cont = file->cont;
+    lockShared(cont, &cont->volumeLock);
+    const u32 clusterSize = fileClusterSize(file);
+    fileReleaseClusters(file, ((u64)file->size + clusterSize - 1) / clusterSize);
+    if (file->isEntryModified)
+        fileUpdateEntry(file);
+    unlockRw(cont, &cont->volumeLock);
+
+    free(file->readahead);
+    free(file);
+    *fileP = NULL;
+}
 
-        char* cDateStr = directoryEntryDateToString(&cDate);
+//------------------------------------------------------------------------------
 
-        DirectoryEntryTime cTime = toDirectoryEntryTime(dirEntry->entry->creationTime);
+/*
+ * Consistency check. Workers split the FAT into chunks to compare the FAT
+ * copies and count free entries, then walk the directory tree from a shared
+ * queue, claiming every cluster for the chain that reaches it first. A claim
+ * that fails shows a loop or a cross-link, and used clusters nobody claimed
+ * are lost. Workers read the image with positional reads, never through the
+ * cache. Repairs are applied afterwards on the calling thread.
+ */
 
-        char* cTimeStr = directoryEntryTimeToString(&cTime);
+#define FSCK_CHUNK_ENTRIES (64 * 1024)
+
+typedef enum FsckProblem
+{
+    FSCK_CHAIN_OK,
+    FSCK_CHAIN_CROSS_LINK,
+    FSCK_CHAIN_LOOP,
+    FSCK_CHAIN_BAD_LINK,
+} FsckProblem;
+
+// Chain walked from a directory entry, or a problem to repair in it
+typedef struct FsckChain
+{
+    u64 entryAddress; // 0 for the root directory
+    u32 first;
+    u32 last;         // Last cluster claimed, 0 if none
+    u32 length;       // Clusters claimed
+    u32 size;
+    bool isDirectory;
+    FsckProblem problem;
+} FsckChain;
+
+typedef struct FsckState
+{
+    Fat32Context* cont;
+    const u32* fat;
+    u32 fatEntries;
+    u32 end; // Valid cluster indices are [2, end)
+    u32 clusterSize;
+    u32 fatCopies;
+    u32* owner; // Chain id that claimed each cluster, 0 if none
+    u32 nextChainId;
+    u32 nextChunk;
+    u32 freeCount;
+    Fat32FsckReport* report;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FsckChain* queue; // Directories left to walk
+    u32 queueCount;
+    u32 queueCapacity;
+    u32 busyWorkers;
+    FsckChain* fixes;
+    u32 fixCount;
+    u32 fixCapacity;
+    // One bit per FAT sector that differs from a copy
+    u64* fatDiverged;
+} FsckState;
+
+static void fsckCount(u32* counter, u32 value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
 
-        printf("%-11.11s  |  %50s  |  ", dirEntry->entry->fileName, dirEntry->longFilename);
+// Appends to one of the shared lists, the lock must be held
+static void fsckPush(FsckChain** list, u32* count, u32* capacity, const FsckChain* chain)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *list = realloc(*list, *capacity * sizeof(FsckChain));
+        assert(*list);
+    }
+    (*list)[(*count)++] = *chain;
+}
 
-        if (directoryEntryIsDirectory(dirEntry->entry))
+// Claims the clusters of the chain starting at chain->first, stops at the end or at the first problem
+static void fsckClaimChain(FsckState* st, FsckChain* chain)
+{
+    const u32 chainId = __atomic_add_fetch(&st->nextChainId, 1, __ATOMIC_RELAXED);
+    u32 cluster = chain->first;
+    chain->last = 0;
+    chain->length = 0;
+    chain->problem = FSCK_CHAIN_OK;
+    while (true)
+    {
+        if (cluster < 2 || cluster >= st->end)
         {
-            printf("     <DIR>");
+            chain->problem = FSCK_CHAIN_BAD_LINK;
+            return;
         }
-        else
+        const u32 next = clusterPtrGetIndex(st->fat[cluster]);
+        if (next == 0 || clusterPtrIsBadCluster(next))
         {
-            printf("%10i", dirEntry->entry->fileSize);
+            // Free or bad clusters can't be part of a chain
+            chain->problem = FSCK_CHAIN_BAD_LINK;
+            return;
         }
-        printf("  |  %s  |  %s %s\n", attrs, cDateStr, cTimeStr);
 
-        free(attrs);
-        free(cDateStr);
-        free(cTimeStr);
+        u32 expected = 0;
+        if (!__atomic_compare_exchange_n(&st->owner[cluster], &expected, chainId, false,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            chain->problem = expected == chainId ? FSCK_CHAIN_LOOP : FSCK_CHAIN_CROSS_LINK;
+            return;
+        }
+        chain->last = cluster;
+        ++chain->length;
+        if (clusterPtrIsLastCluster(next))
+            return;
+        cluster = next;
+    }
+}
 
-        directoryIteratorEntryFree(&dirEntry);
-        ++fileCount;
+static void fsckRecordChain(FsckState* st, const FsckChain* chain)
+{
+    Fat32FsckReport* report = st->report;
+    switch (chain->problem)
+    {
+        case FSCK_CHAIN_CROSS_LINK:
+            fsckCount(&report->crossLinks, 1);
+            break;
+        case FSCK_CHAIN_LOOP:
+            fsckCount(&report->loops, 1);
+            break;
+        case FSCK_CHAIN_BAD_LINK:
+            fsckCount(&report->badLinks, 1);
+            break;
+        default:
+            break;
     }
 
-    directoryIteratorFree(&it);
-    printf("%i items in directory\n", fileCount);
+    const u32 neededClusters = ((u64)chain->size + st->clusterSize - 1) / st->clusterSize;
+    const bool isSizeMismatch = !chain->isDirectory && chain->length != neededClusters;
+    if (isSizeMismatch)
+        fsckCount(&report->sizeMismatches, 1);
+
+    if (chain->problem != FSCK_CHAIN_OK || isSizeMismatch)
+    {
+        pthread_mutex_lock(&st->lock);
+        fsckPush(&st->fixes, &st->fixCount, &st->fixCapacity, chain);
+        pthread_mutex_unlock(&st->lock);
+    }
 }
 
-static char* strtToUpper(const char* str)
+static void fsckCheckEntry(FsckState* st, const DirectoryEntry* entry, u64 entryAddress)
 {
-    const size_t len = strlen(str);
-    char* output = malloc(len+1);
-    for (size_t i=0; i <= len; ++i)
-        output[i] = toupper(str[i]);
-    return output;
+    FsckChain chain = {
+            .entryAddress = entryAddress,
+            .first = directoryEntryGetFirstClusterNumber(entry),
+            .size = entry->fileSize,
+            .isDirectory = directoryEntryIsDirectory(entry),
+    };
+    fsckCount(chain.isDirectory ? &st->report->directories : &st->report->files, 1);
+
+    if (chain.first == 0)
+    {
+        // Empty files have no chain, directories always have one
+        chain.problem = chain.isDirectory ? FSCK_CHAIN_BAD_LINK : FSCK_CHAIN_OK;
+    }
+    else
+    {
+        fsckClaimChain(st, &chain);
+    }
+    fsckRecordChain(st, &chain);
+
+    if (chain.isDirectory && chain.length > 0)
+    {
+        pthread_mutex_lock(&st->lock);
+        fsckPush(&st->queue, &st->queueCount, &st->queueCapacity, &chain);
+        pthread_cond_signal(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
 }
 
-DirectoryIteratorEntry* fat32FindInDirectory(Fat32Context* cont, u64 addr, const char* toFind)
+static void fsckWalkDirectory(FsckState* st, const FsckChain* dir, u8* buffer)
 {
-    DirectoryIterator* it = directoryIteratorNew(addr);
-    char* toFindUpper = strtToUpper(toFind);
-    while (true)
+    Fat32Context* cont = st->cont;
+    u32 cluster = dir->first;
+    // Only the clusters this directory claimed, the rest belongs to a problem
+    for (u32 i = 0; i < dir->length; ++i)
     {
-        DirectoryIteratorEntry* result = directoryIteratorNext(cont, it);
-        if (result == NULL)
+        // Read the next FAT32_IO_BATCH clusters of the chain at once
+        const u32 slot = i % FAT32_IO_BATCH;
+        if (slot == 0)
         {
-            free(toFindUpper);
-            directoryIteratorFree(&it);
-            return NULL;
+            Fat32IoRequest requests[FAT32_IO_BATCH];
+            const u32 count = umin(FAT32_IO_BATCH, dir->length - i);
+            u32 next = cluster;
+            for (u32 j = 0; j < count; ++j)
+            {
+                requests[j] = (Fat32IoRequest){
+                        .offset = fat32GetClusterAddress(cont, next),
+                        .data = buffer + (u64)j * st->clusterSize,
+                        .size = st->clusterSize,
+                };
+                next = clusterPtrGetIndex(st->fat[next]);
+            }
+            if (!fat32Submit(cont, requests, count))
+                return;
         }
 
-        char* entryFileName = directoryIteratorEntryGetFileName(result);
-        char* entryFileNameUpper = strtToUpper(entryFileName);
-
-        if (strcmp(entryFileNameUpper, toFindUpper) == 0)
+        const u64 clusterAddress = fat32GetClusterAddress(cont, cluster);
+        const u8* data = buffer + (u64)slot * st->clusterSize;
+        for (u32 offset = 0; offset < st->clusterSize; offset += sizeof(DirectoryEntry))
         {
-            free(toFindUpper);
-            free(entryFileName);
-            free(entryFileNameUpper);
-            directoryIteratorFree(&it);
-            return result;
+            const DirectoryEntry* entry = (const DirectoryEntry*)(data + offset);
+            if (entry->fileName[0] == 0)
+                return;
+            if (entry->fileName[0] == 0xe5
+                || directoryEntryIsLFE(entry->attributes)
+                || (entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY)) == DIRENTRY_ATTR_VOLUME_ID)
+                continue;
+            // Dot entries point back into the tree
+            if (entry->fileName[0] == '.'
+                && (entry->fileName[1] == ' ' || (entry->fileName[1] == '.' && entry->fileName[2] == ' ')))
+                continue;
+            fsckCheckEntry(st, entry, clusterAddress + offset);
         }
+        cluster = clusterPtrGetIndex(st->fat[cluster]);
+    }
+}
+
+static void* fsckDirectoryWorker(void* arg)
+{
+    FsckState* st = arg;
+    u8* buffer = malloc((u64)st->clusterSize * FAT32_IO_BATCH);
+    assert(buffer);
+
+    pthread_mutex_lock(&st->lock);
+    while (true)
+    {
+        while (st->queueCount == 0 && st->busyWorkers > 0)
+            pthread_cond_wait(&st->cond, &st->lock);
+        if (st->queueCount == 0)
+            break;
+
+        const FsckChain dir = st->queue[--st->queueCount];
+        ++st->busyWorkers;
+        pthread_mutex_unlock(&st->lock);
 
-        directoryIteratorEntryFree(&result);
-        free(entryFileName);
-        free(entryFileNameUpper);
+        fsckWalkDirectory(st, &dir, buffer);
+
+        pthread_mutex_lock(&st->lock);
+        --st->busyWorkers;
+        if (st->queueCount == 0 && st->busyWorkers == 0)
+            pthread_cond_broadcast(&st->cond);
     }
+    pthread_mutex_unlock(&st->lock);
 
-    assert(false); // Unreachable
+    free(buffer);
     return NULL;
 }
 
-static size_t findChar(const char* str, char c)
+// Counts free entries and compares the FAT copies on disk with the FAT in memory
+static void* fsckFatWorker(void* arg)
 {
-    const size_t len = strlen(str);
-    for (size_t i=0; i < len; ++i)
+    FsckState* st = arg;
+    Fat32Context* cont = st->cont;
+    const u32 sectorSize = cont->bpb->sectorSize;
+    u8* buffer = malloc(FSCK_CHUNK_ENTRIES * 4);
+    assert(buffer);
+
+    u32 chunk;
+    while ((chunk = __atomic_fetch_add(&st->nextChunk, 1, __ATOMIC_RELAXED)) * (u64)FSCK_CHUNK_ENTRIES < st->fatEntries)
     {
-        if (str[i] == c)
-            return i; // Found
+        const u32 start = chunk * FSCK_CHUNK_ENTRIES;
+        const u32 end = umin((u64)start + FSCK_CHUNK_ENTRIES, st->fatEntries);
+        const u32 clusterStart = start < 2 ? 2 : start;
+        const u32 clusterEnd = umin(end, st->end);
+        if (clusterStart < clusterEnd)
+            fsckCount(&st->freeCount, fatScanKernels()->countFree(st->fat, clusterStart, clusterEnd));
+
+        const u64 bytes = (u64)(end - start) * 4;
+        for (u32 copy = 0; copy < st->fatCopies; ++copy)
+        {
+            const u64 copyOffset = ((u64)cont->bpb->reservedSectorCount + (u64)copy * cont->ebpb->sectorsPerFat) * sectorSize;
+            const u8* expected = (const u8*)(st->fat + start);
+            if (cont->map && (const u8*)st->fat == cont->map + copyOffset)
+                continue; // The primary FAT is used in place
+            if (!fat32ReadAt(cont, copyOffset + (u64)start * 4, buffer, bytes))
+                continue;
+            for (u64 offset = 0; offset < bytes; offset += sectorSize)
+            {
+                if (memcmp(buffer + offset, expected + offset, umin(sectorSize, bytes - offset)) == 0)
+                    continue;
+                const u64 sector = ((u64)start * 4 + offset) / sectorSize;
+                __atomic_fetch_or(&st->fatDiverged[sector / 64], 1ULL << (sector % 64), __ATOMIC_RELAXED);
+            }
+        }
     }
-    return len; // Not found, end reached
+
+    free(buffer);
+    return NULL;
 }
 
-static DirectoryIteratorEntry* findPath(Fat32Context* cont, const char* path, uint64_t parentAddr)
+// Finds used clusters that no chain claimed
+static void* fsckLostWorker(void* arg)
 {
-    const size_t pathLen = strlen(path);
-    const size_t subpathLen = findChar(path, PATH_SEP);
-    char* subpath = malloc(subpathLen+1);
-    strncpy(subpath, path, subpathLen);
-    subpath[subpathLen] = 0;
-
-    DirectoryIteratorEntry* entry = fat32FindInDirectory(cont, parentAddr, subpath);
-    if (entry == NULL)
+    FsckState* st = arg;
+    u32 chunk;
+    while ((chunk = __atomic_fetch_add(&st->nextChunk, 1, __ATOMIC_RELAXED)) * (u64)FSCK_CHUNK_ENTRIES < st->end)
     {
-        free(subpath);
-        return NULL;
+        const u32 start = chunk == 0 ? 2 : chunk * FSCK_CHUNK_ENTRIES;
+        const u32 end = umin((u64)chunk * FSCK_CHUNK_ENTRIES + FSCK_CHUNK_ENTRIES, st->end);
+        u32 lost = 0;
+        for (u32 cluster = start; cluster < end; ++cluster)
+        {
+            const u32 next = clusterPtrGetIndex(st->fat[cluster]);
+            if (next != 0 && !clusterPtrIsBadCluster(next) && st->owner[cluster] == 0)
+                ++lost;
+        }
+        fsckCount(&st->report->lostClusters, lost);
     }
-    const u64 addr = directoryEntryGetDataAddress(cont, entry->entry);
-
-    free(subpath);
+    return NULL;
+}
 
-    const size_t nextSep = findChar(path, PATH_SEP);
-    if (nextSep == pathLen) // If end of path
+static void fsckRunWorkers(FsckState* st, void* (*worker)(void*), u32 threadCount)
+{
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    assert(threads);
+    u32 started = 0;
+    for (; started < threadCount; ++started)
     {
-        return entry; // The current entry is the result
+        if (pthread_create(&threads[started], NULL, worker, st) != 0)
+            break;
     }
-    directoryIteratorEntryFree(&entry);
-    return findPath(cont, path+nextSep+1, addr);
+    // Run on the calling thread if no worker could start
+    if (started == 0)
+        worker(st);
+    for (u32 i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
 }
 
-void fat32Format(Fat32Context* context,const char* diskName)
+static void fsckSetEntryChain(Fat32Context* cont, u64 entryAddress, u32 first, u32 size)
 {
-    context = fat32Create(diskName);
-    printf("Disk succesfully formated\n.");
+    u32 cluster;
+    DirectoryEntry* entry = (DirectoryEntry*)cacheGetAddress(cont, entryAddress, &cluster);
+    if (!entry)
+        return;
+    entry->entryFirstClusterNum1 = (first >> 16) & 0xffff;
+    entry->entryFirstClusterNum2 = first & 0xffff;
+    entry->fileSize = size;
+    fat32CacheMarkDirty(cont, cluster);
 }
 
-
-
-void fat32CreateDirectoryEntry(Fat32Context* cont, const char* currentFolder,const char* entryName,u32 size,u8 attributes)
+// Ends the chain where it went wrong and makes file sizes match the chain
+static void fsckRepairChain(FsckState* st, const FsckChain* chain)
 {
-    DirectoryEntry directoryEntry;
-    u64 address = 0;
-    bool isEmpty = true;
+    Fat32Context* cont = st->cont;
+    u32 first = chain->first;
+    u32 size = chain->size;
 
-    if(currentFolder[0] == '/' && currentFolder[1] =='\0')
+    if (chain->problem != FSCK_CHAIN_OK)
     {
-        address = cont->rootDirectoryAddress;
+        if (chain->last)
+            fatSetNextClusterPtr(cont, chain->last, 0x0fffffff);
+        else
+            first = 0;
     }
-    else
+
+    if (!chain->isDirectory)
     {
-        currentFolder++;
-        DirectoryIteratorEntry* found = fat32OpenFile(cont, currentFolder);
-        if(found)
+        const u32 neededClusters = ((u64)size + st->clusterSize - 1) / st->clusterSize;
+        if (chain->length > neededClusters)
+        {
+            // Free the clusters past the end of the file
+            if (neededClusters == 0)
+            {
+                fat32FreeClusterChain(cont, first);
+                first = 0;
+            }
+            else
+            {
+                u32 last = first;
+                for (u32 i = 1; i < neededClusters; ++i)
+                    last = clusterPtrGetIndex(fatGetNextClusterPtr(cont, last));
+                fat32FreeClusterChain(cont, clusterPtrGetIndex(fatGetNextClusterPtr(cont, last)));
+                fatSetNextClusterPtr(cont, last, 0x0fffffff);
+            }
+        }
+        else if (chain->length < neededClusters)
         {
-            address = directoryEntryGetDataAddress(cont, found->entry);
-            directoryIteratorEntryFree(&found);
+            size = chain->length * st->clusterSize;
         }
     }
 
-    DirectoryIterator* iterator = directoryIteratorNew(address);
-    DirectoryIteratorEntry* result = NULL;
-    while (true)
+    // The root directory has no entry to update
+    if (chain->entryAddress && chain->isDirectory && first == 0)
     {
-        result = directoryIteratorNext(cont, iterator);
-        if(result == NULL)
+        // A directory without clusters can't hold anything, delete its entry
+        u32 cluster;
+        u8* entry = cacheGetAddress(cont, chain->entryAddress, &cluster);
+        if (entry)
         {
-            break;
+            entry[0] = 0xe5;
+            fat32CacheMarkDirty(cont, cluster);
         }
-        address = result->address;
-        isEmpty = false;
     }
-    if(!isEmpty)
+    else if (chain->entryAddress && (first != chain->first || size != chain->size))
+    {
+        fsckSetEntryChain(cont, chain->entryAddress, first, size);
+    }
+    ++st->report->repaired;
+}
+
+static ChError fsckVolume(Fat32Context* cont, u32 flags, u32 threadCount, Fat32FsckReport* report);
+
+ChError fat32Fsck(Fat32Context* cont, u32 flags, u32 threadCount, Fat32FsckReport* report)
+{
+    if (!cont || !report)
+        return ERROR_INVALID_ARG;
+    if ((flags & FAT32_FSCK_REPAIR) && !fat32IsWritable(cont))
+        return ERROR_READ_ONLY;
+
+    lockExclusive(cont, &cont->volumeLock);
+    const ChError error = fsckVolume(cont, flags, threadCount, report);
+    // Repairs went around the directory write sections
+    if (flags & FAT32_FSCK_REPAIR)
+        __atomic_add_fetch(&cont->dirGeneration, 1, __ATOMIC_RELEASE);
+    unlockRw(cont, &cont->volumeLock);
+    return error;
+}
+
+// Needs the volume lock exclusive
+static ChError fsckVolume(Fat32Context* cont, u32 flags, u32 threadCount, Fat32FsckReport* report)
+{
+    memset(report, 0, sizeof(Fat32FsckReport));
+    if (threadCount == 0)
+    {
+        const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = cores > 0 ? cores : 1;
+    }
+
+    // Workers read the image directly, so it has to be up to date
+    if (!flushVolume(cont))
+        return ERROR_IO;
+    FSInfo diskFsinfo;
+    const u64 fsinfoOffset = (u64)cont->ebpb->fsInfoSectorNumber * cont->bpb->sectorSize;
+    if (!fat32ReadAt(cont, fsinfoOffset, &diskFsinfo, sizeof(FSInfo)))
+        return ERROR_IO;
+
+    FsckState st = {
+            .cont = cont,
+            .fat = (const u32*)cont->fat,
+            .fatEntries = cont->fatSizeBytes / 4,
+            .end = cont->clusterCount + 2,
+            .clusterSize = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize,
+            .fatCopies = cont->bpb->fatCount,
+            .report = report,
+    };
+    const u32 fatSectors = cont->ebpb->sectorsPerFat;
+    st.owner = calloc(st.end, sizeof(u32));
+    st.fatDiverged = calloc((fatSectors + 63) / 64, sizeof(u64));
+    if (!st.owner || !st.fatDiverged)
+    {
+        free(st.owner);
+        free(st.fatDiverged);
+        return ERROR_NO_SPACE;
+    }
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+
+    fsckRunWorkers(&st, fsckFatWorker, threadCount);
+    for (u32 i = 0; i < (fatSectors + 63) / 64; ++i)
+        report->fatCopyMismatches += __builtin_popcountll(st.fatDiverged[i]);
+
+    // Mount corrects FSInfo in memory, so also report what it found
+    report->isFsinfoBad = cont->isFsinfoBad
+            || diskFsinfo.leadSignature != FSINFO_LEAD_SIG
+            || diskFsinfo.signature != FSINFO_SIG
+            || diskFsinfo.freeCount != st.freeCount;
+
+    // Walk the tree from the root directory
+    FsckChain root = {
+            .first = cont->ebpb->rootDirectoryClusterNumber,
+            .isDirectory = true,
+    };
+    fsckClaimChain(&st, &root);
+    ++report->directories;
+    fsckRecordChain(&st, &root);
+    if (root.length > 0)
+        fsckPush(&st.queue, &st.queueCount, &st.queueCapacity, &root);
+    fsckRunWorkers(&st, fsckDirectoryWorker, threadCount);
+
+    st.nextChunk = 0;
+    fsckRunWorkers(&st, fsckLostWorker, threadCount);
+
+    if (flags & FAT32_FSCK_REPAIR)
     {
-        u64 newAddress =  address + sizeof(DirectoryEntry);
-        fseek(cont->file, newAddress, SEEK_SET);
-        if(result != NULL)
+        for (u32 i = 0; i < st.fixCount; ++i)
+            fsckRepairChain(&st, &st.fixes[i]);
+
+        // Nothing references lost clusters, give them back
+        for (u32 cluster = 2; report->lostClusters && cluster < st.end; ++cluster)
+        {
+            const u32 next = clusterPtrGetIndex(st.fat[cluster]);
+            if (next != 0 && !clusterPtrIsBadCluster(next) && st.owner[cluster] == 0)
+                fatSetNextClusterPtr(cont, cluster, 0);
+        }
+        if (report->lostClusters)
+            ++report->repaired;
+
+        // Rewriting the sectors from memory brings every copy back in line
+        if (report->fatCopyMismatches)
+        {
+            for (u32 i = 0; i < (fatSectors + 63) / 64; ++i)
+                cont->fatDirty[i] |= st.fatDiverged[i];
+            cont->isFatModified = true;
+            ++report->repaired;
+        }
+        if (report->isFsinfoBad)
         {
-            directoryIteratorEntryFree(result);
+            cont->fsinfo->leadSignature = FSINFO_LEAD_SIG;
+            cont->fsinfo->signature = FSINFO_SIG;
+            cont->fsinfo->freeCount = cont->freeMap.freeCount;
+            cont->isFsinfoModified = true;
+            cont->isFsinfoBad = false;
+            ++report->repaired;
         }
-        directoryIteratorFree(iterator);
+
+        // Entries and chains changed under the lookup caches
+        fat32DentryCacheClear(cont);
+        nameIndexFreeAll(cont);
     }
-    else
+
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+    free(st.queue);
+    free(st.fixes);
+    free(st.owner);
+    free(st.fatDiverged);
+
+    if ((flags & FAT32_FSCK_REPAIR) && !flushVolume(cont))
+        return ERROR_IO;
+    return ERROR_OK;
+}
+
+//------------------------------------------------------------------------------
+
+/*
+ * Offline defragmentation. The tree is walked once to measure every chain,
+ * then the fragmented ones are moved in batches, in the order they were
+ * found, so a directory is placed first and its children right behind it.
+ * A batch never writes to a cluster that is in use: new runs are allocated
+ * and filled, the volume is flushed, the entries are pointed at the new
+ * runs, the volume is flushed again and only then are the old chains freed.
+ * An interrupted run leaves at most lost clusters behind, which fsck -r
+ * gives back.
+ */
+
+typedef struct DefragChain
+{
+    u64 entryAddress; // Where the entry was found, 0 for the root directory
+    u32 parent;       // Index of the directory holding the entry
+    u32 entryIndex;   // Position of the entry's cluster in the parent's chain
+    u32 first;
+    u32 length;
+    u32 fragments;
+    u32 childStart;   // Directories only, their entries follow each other in the list
+    u32 childCount;
+    bool isDirectory;
+    u32 newFirst;     // Run the chain is copied to in the current batch
+} DefragChain;
+
+typedef struct DefragState
+{
+    Fat32Context* cont;
+    u32 clusterSize;
+    u64* claimed; // One bit per cluster reached by a chain, to refuse cross-linked volumes
+    DefragChain* chains;
+    u32 chainCount;
+    u32 chainCapacity;
+    u8* buffer; // FAT32_SCAN_CHUNK_SIZE bytes, at least one cluster
+    u64 bufferSize;
+    Fat32DefragReport* report;
+} DefragState;
+
+// Measures the chain and claims its clusters, false if it is broken or shared with another chain
+static bool defragMeasureChain(DefragState* st, DefragChain* chain)
+{
+    Fat32Context* cont = st->cont;
+    const u32 end = cont->clusterCount + 2;
+    chain->length = 0;
+    chain->fragments = 0;
+    u32 cluster = chain->first;
+    u32 previous = 0;
+    while (true)
     {
-        fseek(cont->file, address, SEEK_SET);
+        if (cluster < 2 || cluster >= end || chain->length >= cont->clusterCount
+            || (st->claimed[cluster / 64] & (1ULL << (cluster % 64))))
+            return false;
+        const ClusterPtr next = fatGetNextClusterPtr(cont, cluster);
+        if (clusterPtrIsNull(next) || clusterPtrIsBadCluster(next))
+            return false;
+
+        st->claimed[cluster / 64] |= 1ULL << (cluster % 64);
+        if (cluster != previous + 1)
+            ++chain->fragments;
+        ++chain->length;
+        previous = cluster;
+        if (clusterPtrIsLastCluster(next))
+            return true;
+        cluster = clusterPtrGetIndex(next);
     }
+}
 
-    u64 cluster = findFreeCluster(cont);
-    strcpy_s(directoryEntry.fileName,11,entryName);
-    directoryEntry.attributes = attributes;
-    directoryEntry.ntReserved = 0;
-    directoryEntry.creationTimeTenthSec = 0x25;
-    directoryEntry.creationTime = 0x7e3c;
-    directoryEntry.creationDate = 0x4262;
-    directoryEntry.accessDate  = 0x4262;
-    directoryEntry.entryFirstClusterNum1 = (cluster >> 16) & 0xffff;
-    directoryEntry.modificationTime = 0x7e3c;
-    directoryEntry.modificationDate = 0x4262;
-    directoryEntry.entryFirstClusterNum2 = cluster & 0xffff;
-    directoryEntry.fileSize = size;
+static bool defragPush(DefragState* st, const DefragChain* chain)
+{
+    if (st->chainCount == st->chainCapacity)
+    {
+        st->chainCapacity = st->chainCapacity ? st->chainCapacity * 2 : 256;
+        st->chains = realloc(st->chains, st->chainCapacity * sizeof(DefragChain));
+        assert(st->chains);
+    }
+    st->chains[st->chainCount] = *chain;
+    if (chain->first && !defragMeasureChain(st, &st->chains[st->chainCount]))
+        return false;
+
+    const DefragChain* added = &st->chains[st->chainCount++];
+    Fat32DefragReport* report = st->report;
+    if (added->isDirectory)
+        ++report->directories;
+    else
+        ++report->files;
+    report->fragmentsBefore += added->fragments;
+    if (added->fragments > 1)
+        ++report->fragmentedBefore;
+    return true;
+}
 
-    fwrite(&directoryEntry,sizeof(DirectoryEntry),1,cont->file);
+// Adds the entries of every directory to the list, which is walked while it grows
+static ChError defragWalk(DefragState* st)
+{
+    Fat32Context* cont = st->cont;
+    u8* data = st->buffer;
+    for (u32 i = 0; i < st->chainCount; ++i)
+    {
+        if (!st->chains[i].isDirectory)
+            continue;
+        st->chains[i].childStart = st->chainCount;
+        u32 cluster = st->chains[i].first;
+        bool isEnd = false;
+        for (u32 index = 0; index < st->chains[i].length && !isEnd; ++index)
+        {
+            const u64 clusterAddress = fat32GetClusterAddress(cont, cluster);
+            if (!fat32ReadAt(cont, clusterAddress, data, st->clusterSize))
+                return ERROR_IO;
+            for (u32 offset = 0; offset < st->clusterSize; offset += sizeof(DirectoryEntry))
+            {
+                const DirectoryEntry* entry = (const DirectoryEntry*)(data + offset);
+                if (entry->fileName[0] == 0)
+                {
+                    isEnd = true;
+                    break;
+                }
+                if (entry->fileName[0] == 0xe5
+                    || directoryEntryIsLFE(entry->attributes)
+                    || (entry->attributes & (DIRENTRY_ATTR_VOLUME_ID | DIRENTRY_ATTR_DIRECTORY)) == DIRENTRY_ATTR_VOLUME_ID
+                    || (entry->fileName[0] == '.'
+                        && (entry->fileName[1] == ' ' || (entry->fileName[1] == '.' && entry->fileName[2] == ' '))))
+                    continue;
+
+                const DefragChain chain = {
+                        .entryAddress = clusterAddress + offset,
+                        .parent = i,
+                        .entryIndex = index,
+                        .first = directoryEntryGetFirstClusterNumber(entry),
+                        .isDirectory = directoryEntryIsDirectory(entry),
+                };
+                if (!defragPush(st, &chain))
+                    return ERROR_INVALID_ARG;
+            }
+            cluster = clusterPtrGetIndex(fatGetNextClusterPtr(cont, cluster));
+        }
+        st->chains[i].childCount = st->chainCount - st->chains[i].childStart;
+    }
+    return ERROR_OK;
 }
 
+// Copies the old chain into its new run, gathering the old clusters into large writes
+static bool defragCopyChain(DefragState* st, const DefragChain* chain)
+{
+    Fat32Context* cont = st->cont;
+    const u32 clustersPerBuffer = st->bufferSize / st->clusterSize;
+    u32 cluster = chain->first;
+    u32 done = 0;
+    while (done < chain->length)
+    {
+        const u32 count = umin(clustersPerBuffer, chain->length - done);
+        u32 filled = 0;
+        while (filled < count)
+        {
+            // The longest contiguous piece of the old chain that still fits
+            u32 run = 1;
+            u32 last = cluster;
+            while (filled + run < count)
+            {
+                const u32 next = clusterPtrGetIndex(fatGetNextClusterPtr(cont, last));
+                if (next != last + 1)
+                    break;
+                last = next;
+                ++run;
+            }
+            if (!fat32ReadAt(cont, fat32GetClusterAddress(cont, cluster),
+                             st->buffer + (u64)filled * st->clusterSize, (u64)run * st->clusterSize))
+                return false;
+            filled += run;
+            cluster = clusterPtrGetIndex(fatGetNextClusterPtr(cont, last));
+        }
+        if (!fat32WriteAt(cont, fat32GetClusterAddress(cont, chain->newFirst + done),
+                          st->buffer, (u64)count * st->clusterSize))
+            return false;
+        done += count;
+    }
+    return true;
+}
 
-DirectoryIteratorEntry* fat32OpenFile(Fat32Context* cont, const char* path)
+// Where the entry is now. Its directory may have moved in an earlier batch, or
+// is moving in this one, and then the entry is patched in the new run.
+static u64 defragEntryAddress(const DefragState* st, const DefragChain* chain)
 {
-    return findPath(cont, path, cont->rootDirectoryAddress);
+    Fat32Context* cont = st->cont;
+    const DefragChain* parent = &st->chains[chain->parent];
+    if (!parent->newFirst && parent->fragments > 1)
+        return chain->entryAddress;
+    const u64 offset = chain->entryAddress - fat32GetClusterAddress(cont, fat32AddressToCluster(cont, chain->entryAddress));
+    const u32 parentFirst = parent->newFirst ? parent->newFirst : parent->first;
+    return fat32GetClusterAddress(cont, parentFirst + chain->entryIndex) + offset;
 }
 
-static bool hasLower(const char* str)
+// Points the dot entry in slot 0 or the dot dot entry in slot 1 of a directory at cluster
+static void defragSetDotEntry(Fat32Context* cont, u32 dirCluster, u32 slot, u32 cluster)
 {
-    for (size_t i=0; i < strlen(str); ++i)
-        if (islower(str[i]))
-            return true;
-    return false;
+    u8* data = fat32CacheGetCluster(cont, dirCluster);
+    if (!data)
+        return;
+    DirectoryEntry* entry = (DirectoryEntry*)(data + slot * sizeof(DirectoryEntry));
+    static const u8 names[2][3] = {{'.', ' ', ' '}, {'.', '.', ' '}};
+    if (memcmp(entry->fileName, names[slot], 3) != 0 || !directoryEntryIsDirectory(entry))
+        return;
+    entry->entryFirstClusterNum1 = (cluster >> 16) & 0xffff;
+    entry->entryFirstClusterNum2 = cluster & 0xffff;
+    fat32CacheMarkDirty(cont, dirCluster);
 }
 
-ChError fsRenameVolume(Fat32Context* cont, const char* name)
+// Drops every cluster copy, the cache must be clean
+static void defragDropCache(Fat32Context* cont)
 {
-    const size_t nameLen = strlen(name);
-    if (nameLen > EBPB_LABEL_LEN)
+    Fat32Cache* cache = &cont->cache;
+    for (u32 i = 0; i < cache->used; ++i)
     {
-        printf("New volume label is too long (%i chars), max is %i\n", nameLen, EBPB_LABEL_LEN);
-        return ERROR_INVALID_ARG;
+        if (cache->entries[i].cluster != 0)
+            cacheDropEntry(cache, &cache->entries[i]);
     }
-    char* nameUpper = strtToUpper(name);
-    if (hasLower(name))
+}
+
+// Moves the chains [start, end) that were given a new run, in the crash safe order
+static bool defragCommit(DefragState* st, u32 start, u32 end)
+{
+    Fat32Context* cont = st->cont;
+    for (u32 i = start; i < end; ++i)
     {
-        printf("New volume label is not lowercase: '%s', using uppercase: '%s'\n", name, nameUpper);
+        if (st->chains[i].newFirst && !defragCopyChain(st, &st->chains[i]))
+            return false;
     }
+    // The new runs are filled and allocated on disk, but nothing points to them yet
+    if (!flushVolume(cont))
+        return false;
+    // The copies changed clusters under the cache
+    defragDropCache(cont);
 
-    uint8_t buffer[DIRENTRY_FILENAME_LEN];
-    memset(buffer, ' ', DIRENTRY_FILENAME_LEN); // Write padding
-    memcpy((char*)buffer, nameUpper, strlen(nameUpper)); // Copy string without null terminator
-
-    // Change entry value in root directory
+    for (u32 i = start; i < end; ++i)
     {
-        DirectoryIterator* it = directoryIteratorNew(cont->rootDirectoryAddress);
-        DirectoryIteratorEntry* labelEntry;
-        while (true)
+        DefragChain* chain = &st->chains[i];
+        if (!chain->newFirst)
+            continue;
+
+        if (i == 0)
         {
-            labelEntry = directoryIteratorNext(cont, it);
-            if (!labelEntry)
-                break;
+            cont->ebpb->rootDirectoryClusterNumber = chain->newFirst;
+            cont->isEbpbModified = true;
+            cont->rootDirectoryAddress = fat32GetClusterAddress(cont, chain->newFirst);
+        }
+        else
+        {
+            u32 cluster;
+            DirectoryEntry* entry = (DirectoryEntry*)cacheGetAddress(cont, defragEntryAddress(st, chain), &cluster);
+            if (!entry)
+                return false;
+            entry->entryFirstClusterNum1 = (chain->newFirst >> 16) & 0xffff;
+            entry->entryFirstClusterNum2 = chain->newFirst & 0xffff;
+            fat32CacheMarkDirty(cont, cluster);
+        }
 
-            if (directoryEntryIsVolumeLabel(labelEntry->entry))
-                break;
+        // The root directory has no dot entries, and children point to it with 0
+        if (chain->isDirectory && i != 0)
+        {
+            defragSetDotEntry(cont, chain->newFirst, 0, chain->newFirst);
+            for (u32 c = chain->childStart; c < chain->childStart + chain->childCount; ++c)
+            {
+                const DefragChain* child = &st->chains[c];
+                if (child->isDirectory && child->first)
+                    defragSetDotEntry(cont, child->newFirst ? child->newFirst : child->first, 1, chain->newFirst);
+            }
+        }
+    }
+    // The entries point to the new runs, the old chains are lost clusters until freed
+    if (!flushVolume(cont))
+        return false;
 
-            directoryIteratorEntryFree(&labelEntry);
+    for (u32 i = start; i < end; ++i)
+    {
+        DefragChain* chain = &st->chains[i];
+        if (!chain->newFirst)
+            continue;
+        fat32FreeClusterChain(cont, chain->first);
+        chain->first = chain->newFirst;
+        chain->newFirst = 0;
+        chain->fragments = 1;
+        ++st->report->moved;
+        st->report->movedClusters += chain->length;
+    }
+    return flushVolume(cont);
+}
+
+// Gives each fragmented chain a run behind its directory and moves them batch by batch
+static bool defragMove(DefragState* st)
+{
+    Fat32Context* cont = st->cont;
+    u32 batchStart = 0;
+    u64 batchClusters = 0;
+    for (u32 i = 0; i < st->chainCount; ++i)
+    {
+        DefragChain* chain = &st->chains[i];
+        if (chain->fragments > 1)
+        {
+            u32 hint = 2;
+            if (i != 0)
+            {
+                // Right behind the directory when it is one run, otherwise where the chain is now
+                const DefragChain* parent = &st->chains[chain->parent];
+                hint = parent->newFirst ? parent->newFirst + parent->length
+                        : parent->fragments == 1 ? parent->first + parent->length
+                        : chain->first;
+            }
+            chain->newFirst = allocateExtent(cont, chain->length, hint, FAT32_ALLOC_NEXT_FIT);
+            if (chain->newFirst)
+                batchClusters += chain->length;
+            else
+                ++st->report->skipped;
         }
-        directoryIteratorFree(&it);
 
-        if (!labelEntry)
+        if (batchClusters >= FAT32_DEFRAG_BATCH || (i + 1 == st->chainCount && batchClusters))
         {
-            printf("BUG: Failed to find volume label entry\n");
-            assert(false);
-            abort();
+            if (!defragCommit(st, batchStart, i + 1))
+                return false;
+            batchStart = i + 1;
+            batchClusters = 0;
         }
+    }
+    return true;
+}
 
-        fseek(cont->file, labelEntry->address, SEEK_SET);
-        const size_t written = fwrite(buffer, 1, DIRENTRY_FILENAME_LEN, cont->file);
-        assert(written == DIRENTRY_FILENAME_LEN);
+static ChError defragVolume(Fat32Context* cont, u32 flags, Fat32DefragReport* report);
 
+ChError fat32Defragment(Fat32Context* cont, u32 flags, Fat32DefragReport* report)
+{
+    if (!cont || !report)
+        return ERROR_INVALID_ARG;
+    if (!(flags & FAT32_DEFRAG_ANALYZE) && !fat32IsWritable(cont))
+        return ERROR_READ_ONLY;
 
-        directoryIteratorEntryFree(&labelEntry);
+    lockExclusive(cont, &cont->volumeLock);
+    const ChError error = defragVolume(cont, flags, report);
+    if (!(flags & FAT32_DEFRAG_ANALYZE))
+    {
+        // Entries and directories moved under the lookup caches
+        fat32DentryCacheClear(cont);
+        nameIndexFreeAll(cont);
+        __atomic_add_fetch(&cont->dirGeneration, 1, __ATOMIC_RELEASE);
     }
+    unlockRw(cont, &cont->volumeLock);
+    return error;
+}
 
-    // Change EBPB value
+// Needs the volume lock exclusive
+static ChError defragVolume(Fat32Context* cont, u32 flags, Fat32DefragReport* report)
+{
+    memset(report, 0, sizeof(Fat32DefragReport));
+    // The walk and the copies read the image directly
+    if (!flushVolume(cont))
+        return ERROR_IO;
+
+    DefragState st = {
+            .cont = cont,
+            .clusterSize = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize,
+            .report = report,
+    };
+    st.bufferSize = FAT32_SCAN_CHUNK_SIZE / st.clusterSize * st.clusterSize;
+    if (st.bufferSize == 0)
+        st.bufferSize = st.clusterSize;
+    st.claimed = calloc((cont->clusterCount + 2 + 63) / 64, sizeof(u64));
+    st.buffer = malloc(st.bufferSize);
+    if (!st.claimed || !st.buffer)
     {
-        memcpy(cont->ebpb->label, buffer, DIRENTRY_FILENAME_LEN);
-        cont->isEbpbModified = true;
+        free(st.claimed);
+        free(st.buffer);
+        return ERROR_NO_SPACE;
     }
 
-    free(nameUpper);
-    return ERROR_OK;
+    const DefragChain root = {
+            .first = cont->ebpb->rootDirectoryClusterNumber,
+            .isDirectory = true,
+    };
+    ChError error = defragPush(&st, &root) ? defragWalk(&st) : ERROR_INVALID_ARG;
+    if (error == ERROR_INVALID_ARG)
+        printf("The volume has broken or cross-linked chains, run fsck -r first\n");
+
+    if (error == ERROR_OK && !(flags & FAT32_DEFRAG_ANALYZE) && !defragMove(&st))
+        error = ERROR_IO;
+
+    for (u32 i = 0; i < st.chainCount; ++i)
+    {
+        report->fragmentsAfter += st.chains[i].fragments;
+        if (st.chains[i].fragments > 1)
+            ++report->fragmentedAfter;
+    }
+    free(st.chains);
+    free(st.claimed);
+    free(st.buffer);
+    return error;
 }
@@ -11,8 +11,34 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #define DISK_SIZE (20 * (1024 * 1024))
+#define FAT32_MIN_DISK_SIZE (1024 * 1024)
+#define FAT32_DEFAULT_CACHE_SIZE (1024 * 1024)
+#define FAT32_MIN_CACHE_CLUSTERS 4
+#define FAT32_NAME_INDEX_DIRS 16
+#define FAT32_DENTRY_CACHE_SIZE 1024
+#define FAT32_DENTRY_BUCKETS 2048
+#define FAT32_MAX_PATH_LEN 1024
+#define FAT32_READAHEAD_MIN (16 * 1024)
+#define FAT32_READAHEAD_MAX (1024 * 1024)
+#define FAT32_WRITE_BATCH_CLUSTERS 16
+#define FAT32_DIR_LOCK_STRIPES 64
+#define FAT32_FAT_LOCK_STRIPES 64
+#define FAT32_FAT_LOCK_REGION 4096 // Clusters per FAT region lock, one free map summary word
+#define FAT32_SCAN_CHUNK_SIZE (1024 * 1024) // Bytes a surface scan worker reads at once
+#define FAT32_DEFRAG_BATCH (64 * 1024) // Clusters moved between two rounds of flushes when defragmenting
+#define FAT32_HISTOGRAM_BUCKETS 40 // Bucket i counts latencies in [2^i, 2^(i+1)) ns
+#define FAT32_IO_BATCH 32 // Requests gathered before a batch is submitted
+#define FAT32_IO_QUEUE_DEPTH 64 // io_uring submission queue entries
+#define FAT32_IO_POOL_THREADS 4 // Workers of the thread pool engine
+
+/* fat32Open flags */
+#define FAT32_OPEN_MMAP (1 << 0) // Map the image and access FAT, directories and data in place
+#define FAT32_OPEN_CONCURRENT (1 << 1) // Allow calls from several threads, see the locking notes in FAT32.c
+#define FAT32_OPEN_READONLY (1 << 2) // Open the image read-only, with FAT32_OPEN_MMAP it is mapped read-only
+#define FAT32_OPEN_ASYNC_IO (1 << 3) // Submit batches through io_uring, or a thread pool where it is unavailable
 #define DEFAULT_SECTOR_SIZE 512
 #define DEFAULT_SECTORS_PER_CLUSTER 1
 
@@ -20,6 +46,8 @@ typedef uint32_t u32;
 typedef uint64_t u64;
 typedef uint16_t u16;
 typedef uint8_t u8;
+typedef int64_t s64;
+typedef int32_t s32;
 
 #define PACKED __attribute__((packed))
 
@@ -35,33 +63,250 @@ typedef struct EBPB EBPB;
 typedef struct FSInfo FSInfo;
 typedef struct DirectoryIteratorEntry DirectoryIteratorEntry;
 
+/* How a run of clusters is picked, see freeMapFindRun in FAT32.c */
+typedef enum Fat32AllocPolicy
+{
+    FAT32_ALLOC_NEXT_FIT, // First run long enough from the allocation hint on
+    FAT32_ALLOC_BEST_FIT, // Shortest run long enough on the volume
+} Fat32AllocPolicy;
+
+/* Free cluster map, see freeMapFind in FAT32.c */
+typedef struct Fat32FreeMap
+{
+    u64* bits;    // One bit per cluster, set when free
+    u64* summary; // One bit per word of bits, set when the word has a free cluster
+    u32 wordCount;
+    u32 summaryCount;
+    u32 clusterCount;
+    u32 freeCount;
+    u32 hint;     // Where the next search starts
+} Fat32FreeMap;
+
+typedef struct Fat32CacheEntry
+{
+    u32 cluster;
+    bool isDirty;
+    u8* data;
+    struct Fat32CacheEntry* prev; // LRU list, most recently used first
+    struct Fat32CacheEntry* next;
+    struct Fat32CacheEntry* hashNext;
+} Fat32CacheEntry;
+
+/* Write-back cache of data area clusters, see fat32CacheGetCluster in FAT32.c */
+typedef struct Fat32Cache
+{
+    Fat32CacheEntry* entries;
+    Fat32CacheEntry** buckets;
+    u32 bucketCount;
+    u32 capacity;
+    u32 used;
+    u32 clusterSize;
+    u64 budgetBytes;
+    Fat32CacheEntry* lruHead;
+    Fat32CacheEntry* lruTail;
+} Fat32Cache;
+
+typedef struct Fat32NameIndexSlot
+{
+    u32 hash; // 0 when the slot is empty
+    u32 nameOffset; // Case-folded key in the pool
+    u32 longNameOffset; // Long name as stored on disk, 0xffffffff if there is none
+    u64 address; // Address of the short entry
+} Fat32NameIndexSlot;
+
+/* Name lookup table of one directory, see fat32FindInDirectory in FAT32.c */
+typedef struct Fat32NameIndex
+{
+    u32 dirCluster;
+    u32 slotCount;
+    u32 used;
+    Fat32NameIndexSlot* slots;
+    char* pool;
+    u32 poolSize;
+    u32 poolCapacity;
+    u64 lastUse;
+} Fat32NameIndex;
+
+typedef struct Fat32Dentry
+{
+    u32 hash;
+    u32 parentCluster; // 0 when key is a whole path from the root
+    char* key; // Case-folded name or normalized path
+    bool isNegative;
+    u64 generation;
+    u64 address; // Address of the short entry
+    u32 dirCluster; // Directory holding the short entry
+    char* longFilename; // NULL if the entry has none
+    struct Fat32Dentry* hashNext;
+    struct Fat32Dentry* prev; // LRU list, most recently used first
+    struct Fat32Dentry* next;
+} Fat32Dentry;
+
+/* Path resolution cache, see findPath in FAT32.c */
+typedef struct Fat32DentryCache
+{
+    Fat32Dentry* buckets[FAT32_DENTRY_BUCKETS];
+    Fat32Dentry* lruHead;
+    Fat32Dentry* lruTail;
+    u32 count;
+    u64 generation;
+} Fat32DentryCache;
+
+/* One request of a batch submitted to a block device */
+typedef struct Fat32IoRequest
+{
+    u64 offset;
+    void* data;
+    size_t size;
+    bool isWrite;
+    bool isDone; // Set by the device, false when the request failed
+} Fat32IoRequest;
+
+/* Block device all image I/O goes through, offsets are in bytes */
+typedef struct Fat32BlockDevice Fat32BlockDevice;
+struct Fat32BlockDevice
+{
+    bool (*read)(Fat32BlockDevice* dev, u64 offset, void* data, size_t size);
+    bool (*write)(Fat32BlockDevice* dev, u64 offset, const void* data, size_t size);
+    // Runs independent requests in any order, true when all of them succeeded
+    bool (*submit)(Fat32BlockDevice* dev, Fat32IoRequest* requests, u32 count);
+    bool (*flush)(Fat32BlockDevice* dev);
+    u64 (*size)(const Fat32BlockDevice* dev);
+    void (*close)(Fat32BlockDevice* dev); // Also frees the device
+    u8* map; // Whole device when it can be read and written in place, NULL otherwise
+    bool isReadOnly;
+};
+
+Fat32BlockDevice* fat32FileDeviceOpen(const char* path, bool isReadOnly);
+Fat32BlockDevice* fat32FileDeviceCreate(const char* path, u64 size);
+Fat32BlockDevice* fat32MapDeviceOpen(const char* path, bool isReadOnly);
+Fat32BlockDevice* fat32RamDeviceNew(u64 size);
+void fat32BlockDeviceClose(Fat32BlockDevice** devP);
+
+typedef enum Fat32IoEngine
+{
+    FAT32_IO_SYNC, // Requests run one after another on the calling thread
+    FAT32_IO_URING,
+    FAT32_IO_THREADS,
+} Fat32IoEngine;
+
+// Starts the preferred engine on a file device, falling back from io_uring to threads. Returns the one started.
+Fat32IoEngine fat32FileDeviceStartEngine(Fat32BlockDevice* dev, Fat32IoEngine preferred);
+
+/* Counters of a context, updated with relaxed atomics */
+typedef enum Fat32StatsOp
+{
+    FAT32_STATS_LOOKUP, // fat32OpenFile and fat32FindInDirectory
+    FAT32_STATS_CREATE,
+    FAT32_STATS_LIST,
+    FAT32_STATS_FLUSH,
+    FAT32_STATS_OP_COUNT,
+} Fat32StatsOp;
+
+typedef struct Fat32Histogram
+{
+    u64 count;
+    u64 totalNs;
+    u64 maxNs;
+    u64 buckets[FAT32_HISTOGRAM_BUCKETS];
+} Fat32Histogram;
+
+// Only u64 members, they are copied and reset one by one
+typedef struct Fat32Stats
+{
+    u64 reads;
+    u64 writes;
+    u64 seeks; // Device requests not starting where the previous one ended
+    u64 bytesRead;
+    u64 bytesWritten;
+    u64 allocations; // Heap allocations on lookup, iteration, listing and file paths
+    u64 cacheHits;
+    u64 cacheMisses;
+    u64 clustersAllocated;
+    u64 clustersFreed;
+    u64 fatSectorsFlushed;
+    Fat32Histogram latency[FAT32_STATS_OP_COUNT];
+} Fat32Stats;
+
 typedef struct Fat32Context
 {
-    FILE* file;
+    Fat32BlockDevice* device;
     BPB* bpb;
     bool isBpbModified;
     EBPB* ebpb;
     bool isEbpbModified;
     FSInfo* fsinfo;
     bool  isFsinfoModified;
+    bool isFsinfoBad; // FSInfo on disk had wrong signatures or free count at mount
     u8* fat;
     u64 fatSizeBytes;
     bool isFatModified;
+    u64* fatDirty; // One bit per FAT sector changed since the last flush
     u32 firstDataSector;
     u64 rootDirectoryAddress;
+    u32 clusterCount; // Valid cluster indices are [2, clusterCount + 2)
+    Fat32FreeMap freeMap;
+    Fat32Cache cache;
+    u8* map; // The device's map, the FAT, directories and data are then used in place
+    u64 mapSize;
+    Fat32NameIndex nameIndexes[FAT32_NAME_INDEX_DIRS];
+    u64 nameIndexClock;
+    Fat32DentryCache dentryCache;
+    // Locks, only taken when opened with FAT32_OPEN_CONCURRENT
+    bool isConcurrent;
+    pthread_rwlock_t volumeLock; // Shared by every call, exclusive for flush and whole volume work
+    pthread_rwlock_t dirLocks[FAT32_DIR_LOCK_STRIPES]; // By the first cluster of the directory
+    pthread_mutex_t fatLocks[FAT32_FAT_LOCK_STRIPES]; // By FAT region of FAT32_FAT_LOCK_REGION clusters
+    pthread_mutex_t allocLock; // Free map, allocation hint and FSInfo counters
+    pthread_mutex_t cacheLock; // Held by directory writers for their whole update
+    pthread_rwlock_t nameIndexLock;
+    pthread_mutex_t dentryLock;
+    u64 dirGeneration; // Bumped after every directory write, readers drop older cluster copies
+    Fat32Stats stats;
+    u64 ioPosition; // End of the last device request, for counting seeks
+    Fat32AllocPolicy allocPolicy; // Used for every multi-cluster allocation
 } Fat32Context;
 
 Fat32Context* fat32Initialize(const char* devFilePath,bool *isFAT32);
-Fat32Context* fat32Create(const char* devFilePath);
-
-void fat32ContextCloseAndFree(Fat32Context** contextP);
+Fat32Context* fat32Open(const char* devFilePath, u32 flags, bool *isFAT32);
+Fat32Context* fat32Create(const char* devFilePath, u64 diskSize);
+// The context takes over the device, also when these fail
+Fat32Context* fat32OpenDevice(Fat32BlockDevice* dev, u32 flags, bool *isFAT32);
+Fat32Context* fat32CreateOnDevice(Fat32BlockDevice* dev); // The device must read as zeros
+
+void fat32ContextCloseAndFree(Fat32Context** contextP); // Does nothing for a NULL context
+bool fat32Flush(Fat32Context* cont);
+
+void fat32StatsGet(const Fat32Context* cont, Fat32Stats* out);
+void fat32StatsReset(Fat32Context* cont);
+const char* fat32StatsOpName(Fat32StatsOp op);
+// Upper bound of the bucket holding the given percentile, 0 for an empty histogram
+u64 fat32HistogramPercentile(const Fat32Histogram* histogram, double percentile);
+
+u8* fat32CacheGetCluster(Fat32Context* cont, u32 cluster);
+u8* fat32CacheNewCluster(Fat32Context* cont, u32 cluster);
+void fat32CacheMarkDirty(Fat32Context* cont, u32 cluster);
+bool fat32CacheFlush(Fat32Context* cont);
+bool fat32CacheSetBudget(Fat32Context* cont, u64 budgetBytes);
 
 uint32_t fat32GetFirstSectorOfCluster(const Fat32Context* cont, u32 cluster);
+u64 fat32GetClusterAddress(const Fat32Context* cont, u32 cluster);
+u32 fat32AddressToCluster(const Fat32Context* cont, u64 address);
 void fat32ListDirectory(Fat32Context* cont, u64 address);
 DirectoryIteratorEntry* fat32FindInDirectory(Fat32Context* cont, u64 address, const char* toFind);
+void fat32NameIndexInvalidate(Fat32Context* cont, u32 dirCluster);
 DirectoryIteratorEntry* fat32OpenFile(Fat32Context* cont, const char* path);
+void fat32DentryCacheClear(Fat32Context* cont);
 void fat32CreateDirectoryEntry(Fat32Context* cont, const char* currentFolder,const char* entryName,u32 size,u8 attributes);
-void fat32Format(Fat32Context* context,const char* diskName);
+
+typedef struct Fat32NewEntry
+{
+    const char* name;
+    u32 size;
+    u8 attributes;
+} Fat32NewEntry;
+
+u32 fat32CreateDirectoryEntries(Fat32Context* cont, const char* currentFolder, const Fat32NewEntry* entries, u32 count);
 
 #define BPB_OEM_LEN 8
 
@@ -139,6 +384,7 @@ bool clusterPtrIsBadCluster(ClusterPtr ptr);
 bool clusterPtrIsLastCluster(ClusterPtr ptr);
 bool clusterPtrIsNull(ClusterPtr ptr);
 u32 fatGetNextClusterPtr(const Fat32Context* cont, ClusterPtr current);
+void fatSetNextClusterPtr(Fat32Context* cont, ClusterPtr current, ClusterPtr next);
 
 #define DIRENTRY_FILENAME_LEN 11
 #define DIRENTRY_ATTR_READONLY  (1 << 0)
@@ -159,6 +405,9 @@ u32 fatGetNextClusterPtr(const Fat32Context* cont, ClusterPtr current);
             | DIRENTRY_ATTR_VOLUME_ID \
             | DIRENTRY_ATTR_DIRECTORY \
             | DIRENTRY_ATTR_ARCHIVE   )
+/* ntReserved bits of names that fit 8.3 but are stored upper case */
+#define DIRENTRY_NT_LOWER_BASE (1 << 3)
+#define DIRENTRY_NT_LOWER_EXT  (1 << 4)
 typedef struct DirectoryEntry
 {
     u8 fileName[DIRENTRY_FILENAME_LEN];
@@ -185,6 +434,37 @@ u32 directoryEntryGetFirstClusterNumber(const DirectoryEntry* input);
 u64 directoryEntryGetDataAddress(const Fat32Context* cont, const DirectoryEntry* entry);
 char* directoryEntryAttrsToString(u8 attrs);
 u32 findFreeCluster(Fat32Context* cont);
+u32 fat32AllocateCluster(Fat32Context* cont);
+u32 fat32AllocateClusters(Fat32Context* cont, u32 count);
+// First of count contiguous clusters chained in order, 0 if the volume has no free run that long
+u32 fat32AllocateExtent(Fat32Context* cont, u32 count, Fat32AllocPolicy policy);
+void fat32SetAllocPolicy(Fat32Context* cont, Fat32AllocPolicy policy);
+// Counted from the FAT itself, not from the free map
+u32 fat32CountFreeClusters(const Fat32Context* cont);
+void fat32FreeClusterChain(Fat32Context* cont, u32 firstCluster);
+
+u64 directoryEntryReadFileData(Fat32Context* cont, const DirectoryEntry* entry, u8* buffer, size_t bufferSize);
+
+/* Contiguous run of clusters in a chain */
+typedef struct Fat32Extent
+{
+    u32 fileCluster; // Index of the first cluster of the run inside the chain
+    u32 startCluster;
+    u32 length;
+} Fat32Extent;
+
+typedef struct Fat32ExtentMap
+{
+    Fat32Extent* extents;
+    u32 count;
+    u32 capacity;
+    u32 clusterCount; // Clusters in the whole chain
+} Fat32ExtentMap;
+
+bool fat32ExtentMapBuild(Fat32Context* cont, u32 firstCluster, Fat32ExtentMap* map);
+void fat32ExtentMapFree(Fat32ExtentMap* map);
+u32 fat32ExtentMapFind(const Fat32ExtentMap* map, u32 fileCluster);
+u64 fat32ExtentMapRead(Fat32Context* cont, const Fat32ExtentMap* map, u64 offset, u8* buffer, u64 size);
 
 typedef struct DirectoryEntryTime
 {
@@ -208,7 +488,11 @@ char* directoryEntryDateToString(const DirectoryEntryDate* input);
 
 
 #define LFE_ENTRY_NAME_LEN 13
-#define LFE_FULL_NAME_LEN LFE_ENTRY_NAME_LEN*16
+#define LFE_MAX_FRAGMENTS 20
+#define LFE_MAX_NAME_UNITS 255 // UCS-2 characters in the longest long name
+#define LFE_FULL_NAME_LEN (LFE_MAX_NAME_UNITS * 3) // Its length in UTF-8
+#define LFE_LAST_FRAGMENT 0x40 // Flag in nameStrIndex of the fragment holding the end of the name
+#define LFE_INDEX_MASK 0x1f
 typedef struct LfeEntry
 {
     u8 nameStrIndex;
@@ -221,8 +505,14 @@ typedef struct LfeEntry
     u16 name2[2];
 } PACKED LfeEntry;
 
-u16* lfeEntryGetNameUCS2(const LfeEntry* entry);
-char* lfeEntryGetNameASCII(const LfeEntry* entry);
+// Characters of one fragment, returns how many come before the terminator
+u32 lfeEntryGetNameUCS2(const LfeEntry* entry, u16 out[LFE_ENTRY_NAME_LEN]);
+// Same as UTF-8, returns the length without the terminator
+u32 lfeEntryGetNameUTF8(const LfeEntry* entry, char* out, size_t outSize);
+// Long name codec, neither allocates. Decoding stops at a 0 or 0xFFFF character, surrogate pairs
+// become one 4 byte sequence. Encoding returns the UCS-2 length, -1 for invalid UTF-8 or a too long name.
+u32 fat32Ucs2ToUtf8(const u16* in, u32 count, char* out, size_t outSize);
+s32 fat32Utf8ToUcs2(const char* in, u16* out, u32 outCount);
 
 
 typedef struct DirectoryIteratorEntry
@@ -236,15 +526,35 @@ typedef struct DirectoryIteratorEntry
 void directoryIteratorEntryFree(DirectoryIteratorEntry** entryP);
 char* directoryIteratorEntryGetFileName(DirectoryIteratorEntry* entry);
 
+// Entry filled by directoryIteratorNextRecord, owned by the caller
+typedef struct DirectoryIteratorRecord
+{
+    DirectoryEntry entry;
+    char longFilename[LFE_FULL_NAME_LEN + 1];
+    // 8.3 name with the padding removed and the dot added back
+    char shortFilename[DIRENTRY_FILENAME_LEN + 2];
+    // Address of the entry itself, not where it points to
+    u64 address;
+} DirectoryIteratorRecord;
+
+void directoryEntryGetShortName(const DirectoryEntry* entry, char out[DIRENTRY_FILENAME_LEN + 2]);
+const char* directoryIteratorRecordGetFileName(const DirectoryIteratorRecord* record);
+
 typedef struct DirectoryIterator
 {
     u64 address;
     u64 initAddress;
-    char* longFilename;
-    u8 lfeChecksums[16];
+    // Fragments seen since the last short entry, bit i for fragment i + 1
+    u32 lfeFragments;
+    u8 lfeChecksums[LFE_MAX_FRAGMENTS];
+    u16 longName[LFE_MAX_FRAGMENTS * LFE_ENTRY_NAME_LEN];
 } DirectoryIterator;
 
+// Iterators can live on the stack, directoryIteratorNew is only needed for heap ones
+void directoryIteratorInit(DirectoryIterator* it, u64 address);
 DirectoryIterator* directoryIteratorNew(u64 address);
+// Does not allocate, returns false at the end of the directory
+bool directoryIteratorNextRecord(Fat32Context* cont, DirectoryIterator* it, DirectoryIteratorRecord* out);
 DirectoryIteratorEntry* directoryIteratorNext(Fat32Context* cont, DirectoryIterator* it);
 void directoryIteratorSetAddress(DirectoryIterator* it, u64 address);
 void directoryIteratorRewind(DirectoryIterator* it);
@@ -254,9 +564,106 @@ typedef enum
 {
     ERROR_OK,
     ERROR_INVALID_ARG,
+    ERROR_NO_SPACE,
+    ERROR_IO,
+    ERROR_READ_ONLY,
+    ERROR_NOT_FOUND,
+    ERROR_NOT_EMPTY,
 } ChError;
 
 ChError fsRenameVolume(Fat32Context* cont, const char* name);
+// Removes a file or an empty directory, its slots are reused by later creates.
+// Nothing may have the file open.
+ChError fat32DeleteEntry(Fat32Context* cont, const char* path);
+// Packs the live entries of a directory to its start and frees the clusters left over.
+// Nothing in the directory may be open.
+ChError fat32CompactDirectory(Fat32Context* cont, const char* path, u32* freedClusters);
+
+/* fat32FileOpen flags */
+#define FAT32_FILE_READ   (1 << 0)
+#define FAT32_FILE_WRITE  (1 << 1)
+#define FAT32_FILE_CREATE (1 << 2)
+
+typedef struct Fat32File
+{
+    Fat32Context* cont;
+    u32 flags;
+    u64 entryAddress; // Address of the file's short entry
+    u32 parentCluster; // Directory holding the entry
+    bool isEntryModified;
+    u32 firstCluster;
+    u32 lastCluster;
+    u32 clusterCount; // Allocated clusters, can be ahead of size until close
+    u32 size;
+    u64 position;
+    // Last cluster touched, so sequential access never rewalks the chain
+    u32 currentCluster;
+    u32 currentIndex;
+    // Readahead
+    u64 lastReadEnd;
+    u64 readaheadWindow;
+    u8* readahead;
+    u64 readaheadCapacity;
+    u64 readaheadOffset;
+    u64 readaheadSize;
+} Fat32File;
+
+Fat32File* fat32FileOpen(Fat32Context* cont, const char* path, u32 flags);
+u64 fat32FileRead(Fat32File* file, void* buffer, u64 size);
+u64 fat32FileWrite(Fat32File* file, const void* buffer, u64 size);
+s64 fat32FileSeek(Fat32File* file, s64 offset, int whence);
+ChError fat32FileTruncate(Fat32File* file, u64 size);
+// Allocates the clusters for size bytes in one run where possible, without changing the size.
+// What the file hasn't grown into is given back on close.
+ChError fat32FileReserve(Fat32File* file, u64 size);
+void fat32FileClose(Fat32File** fileP);
+
+/* fat32Fsck flags */
+#define FAT32_FSCK_REPAIR (1 << 0)
+
+typedef struct Fat32FsckReport
+{
+    u32 directories;
+    u32 files;
+    u32 crossLinks;        // Chains running into a cluster owned by another chain
+    u32 loops;             // Chains running into themselves
+    u32 badLinks;          // Chains pointing to a free, bad or out of range cluster
+    u32 lostClusters;      // Used in the FAT but not reachable from any entry
+    u32 sizeMismatches;    // File sizes that don't match the chain length
+    u32 fatCopyMismatches; // FAT sectors that differ between the copies
+    bool isFsinfoBad;      // FSInfo on disk has wrong signatures or free count
+    u32 repaired;          // Problems fixed when repairing
+} Fat32FsckReport;
+
+/* fat32Format flags */
+#define FAT32_FORMAT_SURFACE_SCAN (1 << 0) // Read the whole data area and mark unreadable clusters bad
+
+// Rewrites the metadata of the open context's device in place, or of the image file when *contextP is NULL,
+// and replaces *contextP with the new context. The surface scan runs on threadCount workers, 0 for one per core.
+ChError fat32Format(Fat32Context** contextP, const char* diskName, u32 flags, u32 threadCount);
+
+// Checks the volume with threadCount workers, 0 for one per core. Repairs what it finds with FAT32_FSCK_REPAIR.
+ChError fat32Fsck(Fat32Context* cont, u32 flags, u32 threadCount, Fat32FsckReport* report);
+
+/* fat32Defragment flags */
+#define FAT32_DEFRAG_ANALYZE (1 << 0) // Only measure the fragmentation
+
+typedef struct Fat32DefragReport
+{
+    u32 directories;
+    u32 files;
+    u32 fragmentedBefore; // Chains in more than one piece
+    u64 fragmentsBefore;  // Pieces of all chains together
+    u32 fragmentedAfter;
+    u64 fragmentsAfter;
+    u32 moved;            // Chains copied into one run
+    u64 movedClusters;
+    u32 skipped;          // Fragmented chains no free run was long enough for
+} Fat32DefragReport;
+
+// Moves every fragmented chain into one run, directories first with their children behind them.
+// The volume stays consistent if this is interrupted. No file may be open while it runs.
+ChError fat32Defragment(Fat32Context* cont, u32 flags, Fat32DefragReport* report);
 
 #endif //FAT32_H
 
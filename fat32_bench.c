@@ -0,0 +1,697 @@
+#include <time.h>
+#include <unistd.h>
+#include "FAT32.h"
+
+/* Parameters of the synthetic image and of the runs */
+typedef struct BenchParams
+{
+    const char* imagePath;
+    u64 imageSize;
+    u32 depth; // Directory levels below the root
+    u32 fanout; // Files in every directory
+    u32 subdirs; // Subdirectories in every directory above the last level
+    double lfnRatio; // Share of files getting a long name
+    double fragmentation; // Chance of a hole before every data cluster
+    u32 minFileSize;
+    u32 maxFileSize;
+    u32 ops;
+    u64 seed;
+    u32 openFlags;
+    bool isKeepImage;
+} BenchParams;
+
+static u64 rngState;
+
+static u64 benchRandom()
+{
+    // xorshift64*
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545f4914f6cdd1dull;
+}
+
+static u32 benchRandomBelow(u32 n)
+{
+    return n ? (u32)(benchRandom() % n) : 0;
+}
+
+static double benchRandomUnit()
+{
+    return (benchRandom() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static u64 benchNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Generated tree, kept for picking lookup targets */
+typedef struct BenchDir
+{
+    char* path; // Without the leading separator, empty for the root
+    u32 cluster;
+    u32 firstChild; // Into BenchTree.names
+    u32 childCount;
+} BenchDir;
+
+typedef struct BenchTree
+{
+    BenchDir* dirs;
+    u32 dirCount;
+    u32 dirCapacity;
+    char** names;
+    u32 nameCount;
+    u32 nameCapacity;
+    u32 fileCount;
+    u32* holes; // Clusters allocated between data clusters, freed once the tree is written
+    u32 holeCount;
+    u32 holeCapacity;
+} BenchTree;
+
+static void* benchGrow(void* data, u32* capacity, u32 count, size_t itemSize)
+{
+    if (count < *capacity)
+        return data;
+    *capacity = *capacity ? *capacity * 2 : 64;
+    data = realloc(data, *capacity * itemSize);
+    assert(data);
+    return data;
+}
+
+static u32 benchTreeAddName(BenchTree* tree, const char* name)
+{
+    tree->names = benchGrow(tree->names, &tree->nameCapacity, tree->nameCount, sizeof(char*));
+    tree->names[tree->nameCount] = strdup(name);
+    assert(tree->names[tree->nameCount]);
+    return tree->nameCount++;
+}
+
+static void benchTreeFree(BenchTree* tree)
+{
+    for (u32 i = 0; i < tree->dirCount; ++i)
+        free(tree->dirs[i].path);
+    for (u32 i = 0; i < tree->nameCount; ++i)
+        free(tree->names[i]);
+    free(tree->dirs);
+    free(tree->names);
+    free(tree->holes);
+    memset(tree, 0, sizeof(BenchTree));
+}
+
+static void benchChildPath(const BenchTree* tree, const BenchDir* dir, u32 child, char* out, size_t outSize)
+{
+    const char* name = tree->names[dir->firstChild + child];
+    if (dir->path[0])
+        snprintf(out, outSize, "%s/%s", dir->path, name);
+    else
+        snprintf(out, outSize, "%s", name);
+}
+
+/* Appends raw records to a directory, so the generator controls the long names */
+typedef struct DirWriter
+{
+    Fat32Context* cont;
+    u32 cluster;
+    u32 slot;
+    u32 entriesPerCluster;
+} DirWriter;
+
+static bool dirWriterInit(DirWriter* w, Fat32Context* cont, u32 firstCluster)
+{
+    w->cont = cont;
+    w->entriesPerCluster = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize / sizeof(DirectoryEntry);
+    w->cluster = firstCluster;
+    while (true)
+    {
+        const ClusterPtr next = fatGetNextClusterPtr(cont, w->cluster);
+        if (clusterPtrIsNull(next) || clusterPtrIsLastCluster(next) || clusterPtrIsBadCluster(next))
+            break;
+        w->cluster = clusterPtrGetIndex(next);
+    }
+
+    const u8* data = fat32CacheGetCluster(cont, w->cluster);
+    if (!data)
+        return false;
+    w->slot = 0;
+    while (w->slot < w->entriesPerCluster && data[w->slot * sizeof(DirectoryEntry)] != 0)
+        ++w->slot;
+    return true;
+}
+
+static DirectoryEntry* dirWriterNextSlot(DirWriter* w)
+{
+    if (w->slot == w->entriesPerCluster)
+    {
+        const u32 cluster = fat32AllocateCluster(w->cont);
+        if (cluster == 0)
+            return NULL;
+        fatSetNextClusterPtr(w->cont, w->cluster, cluster);
+        fat32CacheNewCluster(w->cont, cluster);
+        w->cluster = cluster;
+        w->slot = 0;
+    }
+
+    u8* data = fat32CacheGetCluster(w->cont, w->cluster);
+    if (!data)
+        return NULL;
+    fat32CacheMarkDirty(w->cont, w->cluster);
+    return (DirectoryEntry*)(data + w->slot++ * sizeof(DirectoryEntry));
+}
+
+static u8 benchShortNameChecksum(const u8 name[DIRENTRY_FILENAME_LEN])
+{
+    u8 sum = 0;
+    for (int i = 0; i < DIRENTRY_FILENAME_LEN; ++i)
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + name[i];
+    return sum;
+}
+
+static bool dirWriterAdd(DirWriter* w, const char* shortName, const char* longName, u8 attributes, u32 cluster, u32 size)
+{
+    u8 fileName[DIRENTRY_FILENAME_LEN];
+    memset(fileName, ' ', sizeof(fileName));
+    const char* dot = strchr(shortName, '.');
+    const size_t baseLen = dot ? (size_t)(dot - shortName) : strlen(shortName);
+    memcpy(fileName, shortName, baseLen < 8 ? baseLen : 8);
+    if (dot)
+        memcpy(fileName + 8, dot + 1, strlen(dot + 1) < 3 ? strlen(dot + 1) : 3);
+
+    if (longName)
+    {
+        // Fragments go last one first, each holds 13 UCS-2 characters padded with 0xFFFF after the terminator
+        const size_t len = strlen(longName);
+        const u32 fragCount = (len + LFE_ENTRY_NAME_LEN - 1) / LFE_ENTRY_NAME_LEN;
+        const u8 checksum = benchShortNameChecksum(fileName);
+        for (u32 frag = fragCount; frag > 0; --frag)
+        {
+            u16 chars[LFE_ENTRY_NAME_LEN];
+            for (u32 i = 0; i < LFE_ENTRY_NAME_LEN; ++i)
+            {
+                const size_t pos = (frag - 1) * LFE_ENTRY_NAME_LEN + i;
+                chars[i] = pos < len ? (u8)longName[pos] : pos == len ? 0 : 0xffff;
+            }
+
+            LfeEntry* lfe = (LfeEntry*)dirWriterNextSlot(w);
+            if (!lfe)
+                return false;
+            lfe->nameStrIndex = frag | (frag == fragCount ? 0x40 : 0);
+            lfe->attributes = DIRENTRY_ATTR_LONG_NAME;
+            lfe->type = 0;
+            lfe->checksum = checksum;
+            lfe->alwaysZero = 0;
+            memcpy(lfe->name0, chars, sizeof(lfe->name0));
+            memcpy(lfe->name1, chars + 5, sizeof(lfe->name1));
+            memcpy(lfe->name2, chars + 11, sizeof(lfe->name2));
+        }
+    }
+
+    DirectoryEntry* entry = dirWriterNextSlot(w);
+    if (!entry)
+        return false;
+    memset(entry, 0, sizeof(DirectoryEntry));
+    memcpy(entry->fileName, fileName, sizeof(fileName));
+    entry->attributes = attributes;
+    entry->creationTime = 0x7e3c;
+    entry->creationDate = 0x4262;
+    entry->accessDate = 0x4262;
+    entry->modificationTime = 0x7e3c;
+    entry->modificationDate = 0x4262;
+    entry->entryFirstClusterNum1 = (cluster >> 16) & 0xffff;
+    entry->entryFirstClusterNum2 = cluster & 0xffff;
+    entry->fileSize = size;
+    return true;
+}
+
+/* Synthetic image generator */
+
+// Chain for size bytes, a hole before a cluster makes the chain jump
+static u32 benchAllocateData(Fat32Context* cont, BenchTree* tree, const BenchParams* params, u32 size)
+{
+    const u32 clusterSize = cont->bpb->sectorsPerClusters * cont->bpb->sectorSize;
+    const u32 clusters = (size + clusterSize - 1) / clusterSize;
+    u32 first = 0;
+    u32 last = 0;
+    for (u32 i = 0; i < clusters; ++i)
+    {
+        if (benchRandomUnit() < params->fragmentation)
+        {
+            const u32 hole = fat32AllocateCluster(cont);
+            if (hole)
+            {
+                tree->holes = benchGrow(tree->holes, &tree->holeCapacity, tree->holeCount, sizeof(u32));
+                tree->holes[tree->holeCount++] = hole;
+            }
+        }
+
+        const u32 cluster = fat32AllocateCluster(cont);
+        if (cluster == 0)
+            break;
+        if (last)
+            fatSetNextClusterPtr(cont, last, cluster);
+        else
+            first = cluster;
+        last = cluster;
+    }
+    return first;
+}
+
+static bool benchGenerateDirectory(Fat32Context* cont, BenchTree* tree, const BenchParams* params, u32 dirIndex, u32 level)
+{
+    static u32 serial = 0;
+
+    DirWriter w;
+    if (!dirWriterInit(&w, cont, tree->dirs[dirIndex].cluster))
+        return false;
+
+    tree->dirs[dirIndex].firstChild = tree->nameCount;
+    for (u32 i = 0; i < params->fanout; ++i)
+    {
+        char shortName[16];
+        char longName[64];
+        snprintf(shortName, sizeof(shortName), "F%07u.DAT", ++serial);
+        const bool isLong = benchRandomUnit() < params->lfnRatio;
+        if (isLong)
+            snprintf(longName, sizeof(longName), "synthetic bench file %u of level %u.dat", serial, level);
+
+        const u32 size = params->minFileSize + benchRandomBelow(params->maxFileSize - params->minFileSize + 1);
+        const u32 first = benchAllocateData(cont, tree, params, size);
+        if (size && first == 0)
+            return false;
+        if (!dirWriterAdd(&w, shortName, isLong ? longName : NULL, DIRENTRY_ATTR_ARCHIVE, first, size))
+            return false;
+        benchTreeAddName(tree, isLong ? longName : shortName);
+        ++tree->fileCount;
+    }
+
+    const u32 subdirs = level < params->depth ? params->subdirs : 0;
+    const u32 firstSubdir = tree->dirCount;
+    for (u32 i = 0; i < subdirs; ++i)
+    {
+        char shortName[16];
+        snprintf(shortName, sizeof(shortName), "D%07u", ++serial);
+        const u32 cluster = fat32AllocateCluster(cont);
+        if (cluster == 0)
+            return false;
+        fat32CacheNewCluster(cont, cluster);
+        fat32CacheMarkDirty(cont, cluster);
+        if (!dirWriterAdd(&w, shortName, NULL, DIRENTRY_ATTR_DIRECTORY, cluster, 0))
+            return false;
+        benchTreeAddName(tree, shortName);
+
+        char path[FAT32_MAX_PATH_LEN];
+        const BenchDir* parent = &tree->dirs[dirIndex];
+        benchChildPath(tree, parent, tree->nameCount - 1 - parent->firstChild, path, sizeof(path));
+        tree->dirs = benchGrow(tree->dirs, &tree->dirCapacity, tree->dirCount, sizeof(BenchDir));
+        tree->dirs[tree->dirCount++] = (BenchDir){
+                .path = strdup(path),
+                .cluster = cluster,
+        };
+    }
+    tree->dirs[dirIndex].childCount = tree->nameCount - tree->dirs[dirIndex].firstChild;
+
+    for (u32 i = 0; i < subdirs; ++i)
+    {
+        if (!benchGenerateDirectory(cont, tree, params, firstSubdir + i, level + 1))
+            return false;
+    }
+    return true;
+}
+
+static bool benchGenerate(const BenchParams* params, BenchTree* tree)
+{
+    // Cleared first, the caller frees the tree even when the image can't be created
+    memset(tree, 0, sizeof(BenchTree));
+    Fat32Context* cont = fat32Create(params->imagePath, params->imageSize);
+    if (!cont)
+        return false;
+
+    tree->dirs = benchGrow(NULL, &tree->dirCapacity, 0, sizeof(BenchDir));
+    tree->dirs[tree->dirCount++] = (BenchDir){
+            .path = strdup(""),
+            .cluster = cont->ebpb->rootDirectoryClusterNumber,
+    };
+
+    bool isOk = benchGenerateDirectory(cont, tree, params, 0, 0);
+    // The holes become the free space between the data
+    for (u32 i = 0; i < tree->holeCount; ++i)
+        fat32FreeClusterChain(cont, tree->holes[i]);
+
+    isOk &= fat32Flush(cont);
+    fat32ContextCloseAndFree(&cont);
+    return isOk;
+}
+
+/* Latency samples */
+typedef struct BenchSamples
+{
+    u64* ns;
+    u32 count;
+    u32 capacity;
+} BenchSamples;
+
+static void benchSamplesAdd(BenchSamples* samples, u64 ns)
+{
+    samples->ns = benchGrow(samples->ns, &samples->capacity, samples->count, sizeof(u64));
+    samples->ns[samples->count++] = ns;
+}
+
+static int benchCompareU64(const void* a, const void* b)
+{
+    const u64 x = *(const u64*)a;
+    const u64 y = *(const u64*)b;
+    return (x > y) - (x < y);
+}
+
+// One JSON object per line, so runs of different builds can be diffed and plotted
+static void benchReport(const char* name, BenchSamples* samples)
+{
+    u64 total = 0;
+    for (u32 i = 0; i < samples->count; ++i)
+        total += samples->ns[i];
+    qsort(samples->ns, samples->count, sizeof(u64), benchCompareU64);
+
+    const u64 p50 = samples->count ? samples->ns[(samples->count - 1) / 2] : 0;
+    const u64 p99 = samples->count ? samples->ns[(u64)(samples->count - 1) * 99 / 100] : 0;
+    printf("{\"bench\":\"%s\",\"ops\":%u,\"ops_per_s\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu}\n",
+           name, samples->count, total ? samples->count * 1e9 / total : 0.0,
+           (unsigned long long)p50, (unsigned long long)p99);
+    fflush(stdout);
+    samples->count = 0;
+}
+
+/* Microbenchmarks */
+
+static Fat32Context* benchMount(const BenchParams* params, BenchSamples* samples)
+{
+    const u32 runs = params->ops / 100 ? params->ops / 100 : 1;
+    bool isFAT32 = true;
+    for (u32 i = 0; i < runs; ++i)
+    {
+        const u64 start = benchNow();
+        Fat32Context* cont = fat32Open(params->imagePath, params->openFlags, &isFAT32);
+        const u64 end = benchNow();
+        if (!cont)
+            return NULL;
+        benchSamplesAdd(samples, end - start);
+        fat32ContextCloseAndFree(&cont);
+    }
+    benchReport("mount", samples);
+    return fat32Open(params->imagePath, params->openFlags, &isFAT32);
+}
+
+static void benchIterate(Fat32Context* cont, const BenchTree* tree, const BenchParams* params, BenchSamples* samples)
+{
+    while (samples->count < params->ops)
+    {
+        const BenchDir* dir = &tree->dirs[benchRandomBelow(tree->dirCount)];
+        DirectoryIterator it;
+        directoryIteratorInit(&it, fat32GetClusterAddress(cont, dir->cluster));
+        while (samples->count < params->ops)
+        {
+            const u64 start = benchNow();
+            DirectoryIteratorEntry* entry = directoryIteratorNext(cont, &it);
+            const u64 end = benchNow();
+            if (!entry)
+                break;
+            benchSamplesAdd(samples, end - start);
+            directoryIteratorEntryFree(&entry);
+        }
+    }
+    benchReport("directory_iterator_next", samples);
+}
+
+static void benchFindInDirectory(Fat32Context* cont, const BenchTree* tree, const BenchParams* params, BenchSamples* samples)
+{
+    for (u32 i = 0; i < params->ops; ++i)
+    {
+        const BenchDir* dir = &tree->dirs[benchRandomBelow(tree->dirCount)];
+        if (dir->childCount == 0)
+            continue;
+        const char* name = tree->names[dir->firstChild + benchRandomBelow(dir->childCount)];
+        const u64 address = fat32GetClusterAddress(cont, dir->cluster);
+
+        const u64 start = benchNow();
+        DirectoryIteratorEntry* entry = fat32FindInDirectory(cont, address, name);
+        const u64 end = benchNow();
+        if (!entry)
+        {
+            fprintf(stderr, "'%s' not found\n", name);
+            continue;
+        }
+        benchSamplesAdd(samples, end - start);
+        directoryIteratorEntryFree(&entry);
+    }
+    benchReport("fat32_find_in_directory", samples);
+}
+
+// Path lookups, with the dentry cache dropped before every one when cold
+static void benchFindPath(Fat32Context* cont, const BenchTree* tree, const BenchParams* params, BenchSamples* samples, bool isCold)
+{
+    for (u32 i = 0; i < params->ops; ++i)
+    {
+        const BenchDir* dir = &tree->dirs[benchRandomBelow(tree->dirCount)];
+        if (dir->childCount == 0)
+            continue;
+        char path[FAT32_MAX_PATH_LEN];
+        benchChildPath(tree, dir, benchRandomBelow(dir->childCount), path, sizeof(path));
+        if (isCold)
+            fat32DentryCacheClear(cont);
+
+        const u64 start = benchNow();
+        DirectoryIteratorEntry* entry = fat32OpenFile(cont, path);
+        const u64 end = benchNow();
+        if (!entry)
+        {
+            fprintf(stderr, "'%s' not found\n", path);
+            continue;
+        }
+        benchSamplesAdd(samples, end - start);
+        directoryIteratorEntryFree(&entry);
+    }
+    benchReport(isCold ? "find_path_cold" : "find_path_warm", samples);
+}
+
+static void benchCreate(Fat32Context* cont, const BenchParams* params, BenchSamples* samples)
+{
+    fat32CreateDirectoryEntry(cont, "/", "NEWFILES", 0, DIRENTRY_ATTR_DIRECTORY);
+    for (u32 i = 0; i < params->ops; ++i)
+    {
+        // The same share of long names as the generated tree, they are written with their fragments and a ~N alias
+        char name[64];
+        if (benchRandomUnit() < params->lfnRatio)
+            snprintf(name, sizeof(name), "new bench file %u with a long name.dat", i);
+        else
+            snprintf(name, sizeof(name), "N%07u.DAT", i);
+        const u32 size = params->minFileSize + benchRandomBelow(params->maxFileSize - params->minFileSize + 1);
+
+        const u64 start = benchNow();
+        fat32CreateDirectoryEntry(cont, "/NEWFILES", name, size, DIRENTRY_ATTR_ARCHIVE);
+        benchSamplesAdd(samples, benchNow() - start);
+    }
+    benchReport("fat32_create_directory_entry", samples);
+}
+
+// Every found cluster is taken, so the search walks through the holes left by the generator
+static void benchFindFreeCluster(Fat32Context* cont, const BenchParams* params, BenchSamples* samples)
+{
+    u32* taken = malloc(params->ops * sizeof(u32));
+    assert(taken);
+    u32 takenCount = 0;
+    for (u32 i = 0; i < params->ops; ++i)
+    {
+        const u64 start = benchNow();
+        const u32 cluster = findFreeCluster(cont);
+        const u64 end = benchNow();
+        if (cluster == 0)
+            break;
+        benchSamplesAdd(samples, end - start);
+
+        const u32 allocated = fat32AllocateCluster(cont);
+        if (allocated == 0)
+            break;
+        taken[takenCount++] = allocated;
+    }
+    benchReport("find_free_cluster", samples);
+
+    for (u32 i = 0; i < takenCount; ++i)
+        fat32FreeClusterChain(cont, taken[i]);
+    free(taken);
+}
+
+// Extents of 1 to 64 clusters, each freed again, so every search sees the generator's holes
+static void benchAllocateExtent(Fat32Context* cont, const BenchParams* params, BenchSamples* samples, Fat32AllocPolicy policy)
+{
+    for (u32 i = 0; i < params->ops; ++i)
+    {
+        const u32 count = 1 + benchRandomBelow(64);
+        const u64 start = benchNow();
+        const u32 first = fat32AllocateExtent(cont, count, policy);
+        const u64 end = benchNow();
+        if (first == 0)
+            break;
+        benchSamplesAdd(samples, end - start);
+        fat32FreeClusterChain(cont, first);
+    }
+    benchReport(policy == FAT32_ALLOC_BEST_FIT ? "allocate_extent_best_fit" : "allocate_extent_next_fit", samples);
+}
+
+// Flushes after dirtying a few FAT sectors spread over the volume
+static void benchFlush(Fat32Context* cont, const BenchParams* params, BenchSamples* samples)
+{
+    const u32 runs = params->ops / 100 ? params->ops / 100 : 1;
+    for (u32 i = 0; i < runs; ++i)
+    {
+        for (u32 j = 0; j < 8; ++j)
+        {
+            const u32 cluster = 2 + benchRandomBelow(cont->clusterCount);
+            fatSetNextClusterPtr(cont, cluster, fatGetNextClusterPtr(cont, cluster));
+        }
+
+        const u64 start = benchNow();
+        const bool isOk = fat32Flush(cont);
+        const u64 end = benchNow();
+        if (!isOk)
+            break;
+        benchSamplesAdd(samples, end - start);
+    }
+    benchReport("flush", samples);
+}
+
+static void printUsage(const char* program)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            " --image <path>      image to generate, default fat32_bench.img\n"
+            " --image-size <MiB>  default 512\n"
+            " --depth <n>         directory levels below the root, default 3\n"
+            " --fanout <n>        files per directory, default 256\n"
+            " --subdirs <n>       subdirectories per directory, default 4\n"
+            " --lfn <ratio>       share of files with a long name, default 0.5\n"
+            " --frag <ratio>      chance of a hole before a data cluster, default 0.1\n"
+            " --min-size <bytes>  default 0\n"
+            " --max-size <bytes>  default 16384\n"
+            " --ops <n>           samples per benchmark, default 20000\n"
+            " --seed <n>          default 1\n"
+            " --mmap, --async     open flags of the benchmarked context\n"
+            " --keep              keep the image\n",
+            program);
+}
+
+static bool parseArgs(int argc, char** argv, BenchParams* params)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--mmap") == 0)
+        {
+            params->openFlags |= FAT32_OPEN_MMAP;
+            continue;
+        }
+        if (strcmp(arg, "--async") == 0)
+        {
+            params->openFlags |= FAT32_OPEN_ASYNC_IO;
+            continue;
+        }
+        if (strcmp(arg, "--keep") == 0)
+        {
+            params->isKeepImage = true;
+            continue;
+        }
+
+        // Everything else takes a value
+        if (i + 1 == argc)
+            return false;
+        const char* value = argv[++i];
+        if (strcmp(arg, "--image") == 0)
+            params->imagePath = value;
+        else if (strcmp(arg, "--image-size") == 0)
+            params->imageSize = strtoull(value, NULL, 10) << 20;
+        else if (strcmp(arg, "--depth") == 0)
+            params->depth = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--fanout") == 0)
+            params->fanout = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--subdirs") == 0)
+            params->subdirs = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--lfn") == 0)
+            params->lfnRatio = strtod(value, NULL);
+        else if (strcmp(arg, "--frag") == 0)
+            params->fragmentation = strtod(value, NULL);
+        else if (strcmp(arg, "--min-size") == 0)
+            params->minFileSize = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--max-size") == 0)
+            params->maxFileSize = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--ops") == 0)
+            params->ops = strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--seed") == 0)
+            params->seed = strtoull(value, NULL, 10);
+        else
+            return false;
+    }
+    return params->maxFileSize >= params->minFileSize && params->ops > 0;
+}
+
+int main(int argc, char** argv)
+{
+    BenchParams params = {
+            .imagePath = "fat32_bench.img",
+            .imageSize = 512ull << 20,
+            .depth = 3,
+            .fanout = 256,
+            .subdirs = 4,
+            .lfnRatio = 0.5,
+            .fragmentation = 0.1,
+            .minFileSize = 0,
+            .maxFileSize = 16384,
+            .ops = 20000,
+            .seed = 1,
+    };
+    if (!parseArgs(argc, argv, &params))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    rngState = params.seed ? params.seed : 1;
+
+    BenchTree tree;
+    const u64 generateStart = benchNow();
+    if (!benchGenerate(&params, &tree))
+    {
+        fprintf(stderr, "Failed to generate the image, is it large enough?\n");
+        benchTreeFree(&tree);
+        return 1;
+    }
+    printf("{\"image\":\"%s\",\"image_size\":%llu,\"depth\":%u,\"fanout\":%u,\"subdirs\":%u,"
+           "\"lfn\":%.2f,\"frag\":%.2f,\"min_size\":%u,\"max_size\":%u,"
+           "\"directories\":%u,\"files\":%u,\"generate_ms\":%.1f}\n",
+           params.imagePath, (unsigned long long)params.imageSize, params.depth, params.fanout, params.subdirs,
+           params.lfnRatio, params.fragmentation, params.minFileSize, params.maxFileSize,
+           tree.dirCount, tree.fileCount, (benchNow() - generateStart) / 1e6);
+
+    BenchSamples samples = {0};
+    Fat32Context* cont = benchMount(&params, &samples);
+    if (!cont)
+    {
+        fprintf(stderr, "Failed to mount the image\n");
+        benchTreeFree(&tree);
+        return 1;
+    }
+    benchIterate(cont, &tree, &params, &samples);
+    benchFindInDirectory(cont, &tree, &params, &samples);
+    benchFindPath(cont, &tree, &params, &samples, true);
+    benchFindPath(cont, &tree, &params, &samples, false);
+    benchFindFreeCluster(cont, &params, &samples);
+    benchAllocateExtent(cont, &params, &samples, FAT32_ALLOC_NEXT_FIT);
+    benchAllocateExtent(cont, &params, &samples, FAT32_ALLOC_BEST_FIT);
+    benchCreate(cont, &params, &samples);
+    benchFlush(cont, &params, &samples);
+
+    fat32ContextCloseAndFree(&cont);
+    benchTreeFree(&tree);
+    free(samples.ns);
+    if (!params.isKeepImage)
+        unlink(params.imagePath);
+    return 0;
+}
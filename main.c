@@ -1,122 +1,549 @@
 #include <stdio.h>
 #include <ctype.h>
+#include <time.h>
 #include "FAT32.h"
+#define MAX_LINE_LEN (FAT32_MAX_PATH_LEN + 1024)
 static char currentPath[256] = "/";
 
-static char* readCmd()
+// Creates queued between begin and commit
+typedef struct PendingCreate
 {
-    printf("\n%s> ",currentPath);
-    char* cmd = malloc(1024);
-    if (!fgets(cmd, 1024, stdin))
+    char folder[256];
+    char name[FAT32_MAX_PATH_LEN];
+    u8 attributes;
+} PendingCreate;
+
+static PendingCreate* pending = NULL;
+static u32 pendingCount = 0;
+static u32 pendingCapacity = 0;
+static bool isInTransaction = false;
+
+// Reads one line into the caller's buffer, the prompt is only shown in the interactive mode.
+// A line too long for the buffer is read to its end and reported, running part of it would do something else.
+static bool readCmd(FILE* input, char* cmd, size_t size, bool isInteractive, bool* isTooLong)
+{
+    *isTooLong = false;
+    if (isInteractive)
     {
-        free(cmd);
-        return NULL;
+        printf("\n%s> ",currentPath);
+    }
+    if (!fgets(cmd, size, input))
+    {
+        return false;
     }
     const size_t len = strlen(cmd);
-    if (cmd[len-1] == '\n')
+    if (len && cmd[len-1] == '\n')
+    {
         cmd[len-1] = 0; // Remove newline from the end of line
-    return cmd;
+    }
+    else if (len + 1 == size)
+    {
+        // A line that just fills the buffer ends right after it
+        int c = fgetc(input);
+        *isTooLong = c != EOF && c != '\n';
+        while (c != EOF && c != '\n')
+            c = fgetc(input);
+    }
+    return true;
 }
 u64 openDirectory(Fat32Context* context,const char* path);
 
-int main(int argc, char** argv)
+// Path of a command argument relative to the current directory, without the leading separator.
+// False when it doesn't fit, a cut off path would name another file.
+static bool resolvePath(const char* arg, char* out, size_t outSize)
 {
-    Fat32Context* context = NULL;
-    bool isFAT32 = true;
-    char* diskName = "disk1.img";
-    if(argc == 2)
+    const int length = arg[0] == '/'
+            ? snprintf(out, outSize, "%s", arg + 1)
+            : snprintf(out, outSize, "%s%s", currentPath + 1, arg);
+    if (length < 0 || (size_t)length >= outSize)
     {
-        diskName = argv[1];
-        context = fat32Initialize(argv[1], &isFAT32);
+        printf("Path is too long\n");
+        return false;
     }
-    else if (argc == 1)
+    return true;
+}
+
+static u64 nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Names that don't fit are not queued, commit would create them under a cut off name
+static void queueCreate(const char* name, u8 attributes)
+{
+    if (pendingCount == pendingCapacity)
     {
-        context = fat32Create(diskName);
+        pendingCapacity = pendingCapacity ? pendingCapacity * 2 : 64;
+        pending = realloc(pending, pendingCapacity * sizeof(PendingCreate));
+        assert(pending);
     }
-    bool isRunning = true;
-    while (isRunning)
+    PendingCreate* create = &pending[pendingCount];
+    const int folderLength = snprintf(create->folder, sizeof(create->folder), "%s", currentPath);
+    const int nameLength = snprintf(create->name, sizeof(create->name), "%s", name);
+    if (folderLength < 0 || (size_t)folderLength >= sizeof(create->folder)
+        || nameLength < 0 || (size_t)nameLength >= sizeof(create->name))
     {
-        char* input = readCmd();
-        if (!input)
-        {
-            printf("\nNo command, exiting\n");
-            break;
-        }
+        printf("Path is too long\n");
+        return;
+    }
+    create->attributes = attributes;
+    ++pendingCount;
+}
 
-        size_t cmdLength = 0;
-        while (input[cmdLength] && !isspace(input[cmdLength]))
-        {
-            ++cmdLength;
-        }
+// Runs the queued creates as one batch per folder, in the order the folders were first used, then flushes
+static void commitTransaction(Fat32Context* context)
+{
+    Fat32NewEntry* entries = malloc((pendingCount ? pendingCount : 1) * sizeof(Fat32NewEntry));
+    assert(entries);
+    bool* isQueued = calloc(pendingCount ? pendingCount : 1, sizeof(bool));
+    assert(isQueued);
 
-        if (!cmdLength)
-        {
-            free(input);
+    u32 created = 0;
+    for (u32 i = 0; i < pendingCount; ++i)
+    {
+        if (isQueued[i])
             continue;
+
+        u32 count = 0;
+        for (u32 j = i; j < pendingCount; ++j)
+        {
+            if (isQueued[j] || strcmp(pending[j].folder, pending[i].folder) != 0)
+                continue;
+            entries[count++] = (Fat32NewEntry){
+                    .name = pending[j].name,
+                    .size = 0,
+                    .attributes = pending[j].attributes,
+            };
+            isQueued[j] = true;
         }
+        created += fat32CreateDirectoryEntries(context, pending[i].folder, entries, count);
+    }
 
-        char* cmd = malloc(cmdLength + 1);
-        strncpy(cmd, input, cmdLength);
-        cmd[cmdLength] = 0;
+    if (!fat32Flush(context))
+    {
+        printf("Failed to flush the volume\n");
+    }
+    printf("Committed %u of %u creates\n", created, pendingCount);
+    free(entries);
+    free(isQueued);
+    pendingCount = 0;
+    isInTransaction = false;
+}
 
-        if(strcmp(cmd, "exit") == 0 || strcmp(cmd, "e") == 0)
+// Returns false when the shell should exit
+static bool runCommand(Fat32Context** contextP, const char* diskName, bool isFAT32, const char* input)
+{
+    Fat32Context* context = *contextP;
+    size_t cmdLength = 0;
+    while (input[cmdLength] && !isspace(input[cmdLength]))
+    {
+        ++cmdLength;
+    }
+
+    char cmd[32];
+    snprintf(cmd, sizeof(cmd), "%.*s", (int)cmdLength, input);
+    // Everything after the command and the spaces following it
+    const char* arg = input + cmdLength;
+    while (*arg && isspace(*arg))
+    {
+        ++arg;
+    }
+
+    if(strcmp(cmd, "exit") == 0 || strcmp(cmd, "e") == 0)
+    {
+        return false;
+    }
+    else if(strcmp(cmd,"format") == 0)
+    {
+        // format [-s], -s also scans the data area for bad clusters
+        if (isInTransaction)
         {
-            isRunning = false;
+            printf("Commit or abort the transaction first\n");
         }
-        else if(strcmp(cmd,"format") == 0)
+        else if (fat32Format(contextP, diskName, strcmp(arg, "-s") == 0 ? FAT32_FORMAT_SURFACE_SCAN : 0, 0) == ERROR_OK)
         {
-            fat32Format(context,diskName);
+            currentPath[0] = '/';
+            currentPath[1] = '\0';
         }
-        if(context == NULL && !isFAT32)
+    }
+    else if(strcmp(cmd,"help") == 0)
+    {
+        printf("help - show this.\n ls - show files. \n format [-s] - format disk to FAT32, -s also marks unreadable clusters bad.\n mkdir <dir name> - create directory. \n cd <dir name> - open directory\n touch <file name> - create file\n cat <file name> - print file\n write <file name> <text> - append text to file\n rm <name> - delete a file or an empty directory\n compact [dir name] - pack the entries of a directory and free its unused clusters\n df - show free space\n fsck [-r] - check the volume, -r repairs it\n defrag [-n] - make fragmented files and directories contiguous, -n only measures\n stats [reset] - show I/O, cache and latency counters, reset zeroes them\n begin - queue the following mkdir and touch commands\n commit - run the queued commands together and flush\n abort - drop the queued commands\n exit - leave\n");
+    }
+    else if(context == NULL)
+    {
+        printf(isFAT32 ? "No disk is open\n" : "Unknown disk format.Please format disk\n");
+    }
+    else if(strcmp(cmd,"mkdir") == 0)
+    {
+        if (isInTransaction)
         {
-            printf("Unknown disk format.Please format disk\n");
+            queueCreate(arg, DIRENTRY_ATTR_DIRECTORY);
         }
-        else if(strcmp(cmd,"mkdir") == 0)
+        else
         {
-            const char* arg = input + cmdLength + 1;
             fat32CreateDirectoryEntry(context,currentPath,arg,0,DIRENTRY_ATTR_DIRECTORY);
         }
-        else if (strcmp(cmd, "ls") == 0)
+    }
+    else if (strcmp(cmd, "ls") == 0)
+    {
+        fat32ListDirectory(context, openDirectory(context,currentPath));
+    }
+    else if(strcmp(cmd, "cd") == 0)
+    {
+        if (arg[0] == '/' && arg[1] == '\0')
         {
-            fat32ListDirectory(context, openDirectory(context,currentPath));
+            currentPath[0] = '/';
+            currentPath[1] = '\0';
         }
-        else if(strcmp(cmd, "cd") == 0)
+        else
         {
-            const char* arg = input + cmdLength + 1;
-
-            if (arg[0] == '/' && arg[1] == '\0')
+            if(arg[0] == '/')
             {
-                currentPath[0] = '/';
-                currentPath[1] = '\0';
+                strcpy(currentPath,arg);
             }
             else
             {
-                if(arg[0] == '/')
-                {
-                    strcpy(currentPath,arg);
-                }
-                else
-                {
-                    strcat(currentPath,arg);
-                }
-                u32 openedDirectory = openDirectory(context,arg);
-                strcat(currentPath,"/");
+                strcat(currentPath,arg);
+            }
+            openDirectory(context,arg);
+            strcat(currentPath,"/");
+        }
+    }
+    else if(strcmp(cmd,"touch") == 0)
+    {
+        if (isInTransaction)
+        {
+            queueCreate(arg, DIRENTRY_ATTR_ARCHIVE);
+        }
+        else
+        {
+            fat32CreateDirectoryEntry(context,currentPath,arg,0,DIRENTRY_ATTR_ARCHIVE);
+        }
+    }
+    else if(strcmp(cmd,"cat") == 0)
+    {
+        char path[FAT32_MAX_PATH_LEN];
+        if (!resolvePath(arg, path, sizeof(path)))
+        {
+            return true;
+        }
+        Fat32File* file = fat32FileOpen(context, path, FAT32_FILE_READ);
+        if (!file)
+        {
+            printf("File '%s' not found\n", path);
+        }
+        else
+        {
+            char buffer[4096];
+            u64 readBytes;
+            while ((readBytes = fat32FileRead(file, buffer, sizeof(buffer))) > 0)
+            {
+                fwrite(buffer, 1, readBytes, stdout);
+            }
+            printf("\n");
+            fat32FileClose(&file);
+        }
+    }
+    else if(strcmp(cmd,"write") == 0)
+    {
+        // write <file name> <text>, appends the text to the file
+        const char* text = strchr(arg, ' ');
+        char name[FAT32_MAX_PATH_LEN];
+        const size_t nameLen = text ? (size_t)(text - arg) : strlen(arg);
+        if (nameLen >= sizeof(name))
+        {
+            printf("Path is too long\n");
+            return true;
+        }
+        snprintf(name, sizeof(name), "%.*s", (int)nameLen, arg);
+        char path[FAT32_MAX_PATH_LEN];
+        if (!resolvePath(name, path, sizeof(path)))
+        {
+            return true;
+        }
+        Fat32File* file = fat32FileOpen(context, path, FAT32_FILE_WRITE | FAT32_FILE_CREATE);
+        if (file)
+        {
+            fat32FileSeek(file, 0, SEEK_END);
+            if (text)
+            {
+                fat32FileWrite(file, text + 1, strlen(text + 1));
+            }
+            fat32FileClose(&file);
+        }
+    }
+    else if(strcmp(cmd,"rm") == 0)
+    {
+        char path[FAT32_MAX_PATH_LEN];
+        if (!resolvePath(arg, path, sizeof(path)))
+        {
+            return true;
+        }
+        if (isInTransaction)
+        {
+            printf("Commit or abort the transaction first\n");
+        }
+        else
+        {
+            fat32DeleteEntry(context, path);
+        }
+    }
+    else if(strcmp(cmd,"compact") == 0)
+    {
+        // compact [dir name], the current directory without one
+        char path[FAT32_MAX_PATH_LEN];
+        if (!resolvePath(arg, path, sizeof(path)))
+        {
+            return true;
+        }
+        u32 freedClusters;
+        if (isInTransaction)
+        {
+            printf("Commit or abort the transaction first\n");
+        }
+        else if (fat32CompactDirectory(context, path, &freedClusters) == ERROR_OK)
+        {
+            printf("Freed %u clusters\n", freedClusters);
+        }
+    }
+    else if(strcmp(cmd,"df") == 0)
+    {
+        const u64 clusterSize = (u64)context->bpb->sectorsPerClusters * context->bpb->sectorSize;
+        const u64 freeClusters = fat32CountFreeClusters(context);
+        const u64 usedClusters = context->clusterCount - freeClusters;
+        printf("%12s  %12s  %12s  %s\n", "SIZE(KiB)", "USED(KiB)", "FREE(KiB)", "USE%");
+        printf("%12lu  %12lu  %12lu  %3lu%%\n",
+               context->clusterCount * clusterSize / 1024,
+               usedClusters * clusterSize / 1024,
+               freeClusters * clusterSize / 1024,
+               context->clusterCount ? usedClusters * 100 / context->clusterCount : 0);
+    }
+    else if(strcmp(cmd,"fsck") == 0)
+    {
+        // fsck [-r], -r repairs what is found
+        const bool isRepair = strcmp(arg, "-r") == 0;
+        Fat32FsckReport report;
+        if (fat32Fsck(context, isRepair ? FAT32_FSCK_REPAIR : 0, 0, &report) != ERROR_OK)
+        {
+            printf("Failed to check the volume\n");
+        }
+        else
+        {
+            printf("%u directories, %u files\n", report.directories, report.files);
+            printf("Cross-linked chains: %u\n", report.crossLinks);
+            printf("Looping chains: %u\n", report.loops);
+            printf("Bad links: %u\n", report.badLinks);
+            printf("Lost clusters: %u\n", report.lostClusters);
+            printf("Size mismatches: %u\n", report.sizeMismatches);
+            printf("Differing FAT sectors: %u\n", report.fatCopyMismatches);
+            printf("FSInfo: %s\n", report.isFsinfoBad ? "bad" : "ok");
+            if (isRepair)
+            {
+                printf("Repaired: %u\n", report.repaired);
+            }
+        }
+    }
+    else if(strcmp(cmd,"defrag") == 0)
+    {
+        // defrag [-n], -n only measures the fragmentation
+        const bool isAnalyze = strcmp(arg, "-n") == 0;
+        Fat32DefragReport report;
+        if (fat32Defragment(context, isAnalyze ? FAT32_DEFRAG_ANALYZE : 0, &report) != ERROR_OK)
+        {
+            printf("Failed to defragment the volume\n");
+        }
+        else
+        {
+            printf("%u directories, %u files\n", report.directories, report.files);
+            printf("Fragmented chains: %u", report.fragmentedBefore);
+            if (!isAnalyze)
+            {
+                printf(" -> %u", report.fragmentedAfter);
+            }
+            printf("\nFragments: %lu", report.fragmentsBefore);
+            if (!isAnalyze)
+            {
+                printf(" -> %lu\nMoved: %u chains, %lu clusters\nNo room for: %u chains", report.fragmentsAfter,
+                       report.moved, report.movedClusters, report.skipped);
             }
+            printf("\n");
+        }
+    }
+    else if(strcmp(cmd,"stats") == 0)
+    {
+        // stats [reset], reset zeroes the counters after printing them
+        Fat32Stats stats;
+        fat32StatsGet(context, &stats);
+        printf("Reads: %lu (%lu KiB)\n", stats.reads, stats.bytesRead / 1024);
+        printf("Writes: %lu (%lu KiB)\n", stats.writes, stats.bytesWritten / 1024);
+        printf("Seeks: %lu\n", stats.seeks);
+        printf("Cache hits: %lu, misses: %lu\n", stats.cacheHits, stats.cacheMisses);
+        printf("Heap allocations: %lu\n", stats.allocations);
+        printf("Clusters allocated: %lu, freed: %lu\n", stats.clustersAllocated, stats.clustersFreed);
+        printf("FAT sectors flushed: %lu\n", stats.fatSectorsFlushed);
+        printf("%-8s  %10s  %10s  %10s  %10s  %10s\n", "OP", "COUNT", "AVG(us)", "P50(us)", "P99(us)", "MAX(us)");
+        for (u32 i = 0; i < FAT32_STATS_OP_COUNT; ++i)
+        {
+            const Fat32Histogram* latency = &stats.latency[i];
+            printf("%-8s  %10lu  %10.1f  %10.1f  %10.1f  %10.1f\n",
+                   fat32StatsOpName(i), latency->count,
+                   latency->count ? latency->totalNs / 1000.0 / latency->count : 0.0,
+                   fat32HistogramPercentile(latency, 50) / 1000.0,
+                   fat32HistogramPercentile(latency, 99) / 1000.0,
+                   latency->maxNs / 1000.0);
         }
-        else if(strcmp(cmd,"touch") == 0)
+        if (strcmp(arg, "reset") == 0)
         {
-            const char* arg = input + cmdLength + 1;
-            fat32CreateDirectoryEntry(context,currentPath,arg,256,DIRENTRY_ATTR_SYSTEM);
+            fat32StatsReset(context);
         }
-        else if(strcmp(cmd,"help") == 0)
+    }
+    else if(strcmp(cmd,"begin") == 0)
+    {
+        if (isInTransaction)
+        {
+            printf("A transaction is already open\n");
+        }
+        isInTransaction = true;
+    }
+    else if(strcmp(cmd,"commit") == 0)
+    {
+        if (!isInTransaction)
         {
-            printf("help - show this.\n ls - show files. \n format - format disk to FAT32.\n mkdir <dir name> - create directory. \n cd <dir name> - open directory\n touch <file name> - create file\n");
+            printf("No transaction is open\n");
         }
         else
         {
-            printf("Unknown command!Please enter help to see commands.\n");
+            commitTransaction(context);
+        }
+    }
+    else if(strcmp(cmd,"abort") == 0)
+    {
+        if (!isInTransaction)
+        {
+            printf("No transaction is open\n");
+        }
+        else
+        {
+            printf("Dropped %u creates\n", pendingCount);
+            pendingCount = 0;
+            isInTransaction = false;
+        }
+    }
+    else
+    {
+        printf("Unknown command!Please enter help to see commands.\n");
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Fat32Context* context = NULL;
+    bool isFAT32 = true;
+    char* diskName = "disk1.img";
+    u32 openFlags = 0;
+    const char* batchPath = NULL;
+    bool isTimed = false;
+    for (int i = 2; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--mmap") == 0)
+            openFlags |= FAT32_OPEN_MMAP;
+        else if (strcmp(argv[i], "--readonly") == 0)
+            openFlags |= FAT32_OPEN_READONLY;
+        else if (strcmp(argv[i], "--async") == 0)
+            openFlags |= FAT32_OPEN_ASYNC_IO;
+        else if (strcmp(argv[i], "--time") == 0)
+            isTimed = true;
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batchPath = argv[++i];
+    }
+    if(argc >= 2)
+    {
+        diskName = argv[1];
+        context = fat32Open(argv[1], openFlags, &isFAT32);
+    }
+    else
+    {
+        context = fat32Create(diskName, DISK_SIZE);
+    }
+
+    // Batch mode reads commands from a file, or stdin for "-", without prompts
+    FILE* input = stdin;
+    const bool isInteractive = batchPath == NULL;
+    if (batchPath && strcmp(batchPath, "-") != 0)
+    {
+        input = fopen(batchPath, "r");
+        if (!input)
+        {
+            fprintf(stderr, "Failed to open '%s': %s\n", batchPath, strerror(errno));
+            fat32ContextCloseAndFree(&context);
+            return 1;
+        }
+    }
+
+    // One line buffer for the whole session
+    char line[MAX_LINE_LEN];
+    u64 commandCount = 0;
+    const u64 batchStart = nowNs();
+    while (true)
+    {
+        bool isTooLong;
+        if (!readCmd(input, line, sizeof(line), isInteractive, &isTooLong))
+        {
+            if (isInteractive)
+            {
+                printf("\nNo command, exiting\n");
+            }
+            break;
+        }
+        if (isTooLong)
+        {
+            fprintf(stderr, "Error: Line longer than %d characters, skipped\n", MAX_LINE_LEN - 2);
+            continue;
+        }
+
+        const char* cmd = line;
+        while (isspace(*cmd))
+        {
+            ++cmd;
+        }
+        // Empty lines and comments
+        if (!*cmd || *cmd == '#')
+        {
+            continue;
+        }
+
+        const u64 start = nowNs();
+        const bool isRunning = runCommand(&context, diskName, isFAT32, cmd);
+        ++commandCount;
+        if (isTimed)
+        {
+            fprintf(stderr, "%12.1f us  %s\n", (nowNs() - start) / 1000.0, cmd);
+        }
+        if (!isRunning)
+        {
+            break;
+        }
+    }
+
+    if (isInTransaction)
+    {
+        printf("Dropped %u creates of the transaction left open\n", pendingCount);
+    }
+    if (!isInteractive)
+    {
+        const double seconds = (nowNs() - batchStart) / 1e9;
+        fprintf(stderr, "%lu commands in %.3f s (%.0f commands/s)\n",
+                commandCount, seconds, seconds > 0 ? commandCount / seconds : 0.0);
+        if (input != stdin)
+        {
+            fclose(input);
         }
     }
+    free(pending);
 
     fat32ContextCloseAndFree(&context);
 